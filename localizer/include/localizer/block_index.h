@@ -0,0 +1,159 @@
+#ifndef BLOCK_INDEX_H_
+#define BLOCK_INDEX_H_ BLOCK_INDEX_H_
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+
+/// Open-addressing hash table that maps the integer coordinates of blocks of a sparse grid to block numbers.
+/// Uses linear probing in a power-of-two table that stores keys and values in two flat arrays, so a lookup
+/// touches one or two cache lines in the common case.
+class BlockIndex
+{
+public:
+    /// Value returned by find() if a key is not contained in the index.
+    static const uint32_t npos = 0xffffffffu;
+
+
+protected:
+    /// Key marking an empty slot.
+    static const uint64_t empty_key = 0xffffffffffffffffull;
+
+    /// Keys of all slots.
+    std::vector<uint64_t> keys_;
+
+    /// Values of all slots.
+    std::vector<uint32_t> values_;
+
+    /// Number of occupied slots.
+    size_t size_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] capacity number of entries the index can hold before it has to grow.
+    BlockIndex(size_t capacity = 64u)
+        : size_(0u)
+    {
+        size_t n = 16u;
+        while (n < 2u*capacity)
+            n *= 2u;
+
+        keys_.assign(n, uint64_t(empty_key));
+        values_.assign(n, uint32_t(npos));
+    }
+
+
+    /// Packs 2D block coordinates into a key.
+    /// The coordinates are offset so that no valid key equals the empty-slot marker.
+    static uint64_t key(int32_t x, int32_t y)
+    {
+        return ((uint64_t)((uint32_t)x ^ 0x80000000u) << 32) | (uint64_t)((uint32_t)y ^ 0x80000000u);
+    }
+
+
+    /// Packs 3D block coordinates into a key.
+    /// Each coordinate must lie in [-2^20, 2^20).
+    static uint64_t key(int32_t x, int32_t y, int32_t z)
+    {
+        const uint64_t mask = (1ull << 21) - 1ull;
+        const int32_t offset = 1 << 20;
+        return (((uint64_t)(x+offset) & mask) << 42) | (((uint64_t)(y+offset) & mask) << 21)
+            | ((uint64_t)(z+offset) & mask);
+    }
+
+
+    /// Returns the value stored for the given key or npos, if the key is not contained in the index.
+    uint32_t find(uint64_t key) const
+    {
+        const size_t mask = keys_.size() - 1u;
+        for (size_t i = hash(key) & mask; ; i = (i+1u) & mask)
+        {
+            if (keys_[i] == key)
+                return values_[i];
+            if (keys_[i] == empty_key)
+                return npos;
+        }
+    }
+
+
+    /// Inserts the given key-value pair, unless the key is already contained in the index.
+    /// \return value stored for the key after the insertion.
+    uint32_t insert(uint64_t key, uint32_t value)
+    {
+        // Keep the load factor below one half.
+        if (2u*(size_+1u) > keys_.size())
+            grow();
+
+        const size_t mask = keys_.size() - 1u;
+        for (size_t i = hash(key) & mask; ; i = (i+1u) & mask)
+        {
+            if (keys_[i] == key)
+                return values_[i];
+            if (keys_[i] == empty_key)
+            {
+                keys_[i] = key;
+                values_[i] = value;
+                ++size_;
+                return value;
+            }
+        }
+    }
+
+
+    /// Returns the number of entries.
+    size_t size() const
+    {
+        return size_;
+    }
+
+
+    /// Removes all entries but keeps the allocated memory.
+    void clear()
+    {
+        std::fill(keys_.begin(), keys_.end(), uint64_t(empty_key));
+        std::fill(values_.begin(), values_.end(), uint32_t(npos));
+        size_ = 0u;
+    }
+
+
+    /// Returns the number of bytes allocated by the index.
+    size_t memory_usage() const
+    {
+        return keys_.size() * (sizeof(uint64_t) + sizeof(uint32_t));
+    }
+
+
+protected:
+    /// Scrambles the bits of the key.
+    /// This is the finalizer of the SplitMix64 generator.
+    static uint64_t hash(uint64_t key)
+    {
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+        return key ^ (key >> 31);
+    }
+
+
+    /// Doubles the number of slots and reinserts all entries.
+    void grow()
+    {
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> values;
+        keys.swap(keys_);
+        values.swap(values_);
+
+        keys_.assign(2u*keys.size(), uint64_t(empty_key));
+        values_.assign(2u*keys.size(), uint32_t(npos));
+        size_ = 0u;
+
+        for (size_t i = 0u; i < keys.size(); ++i)
+            if (keys[i] != empty_key)
+                insert(keys[i], values[i]);
+    }
+};
+
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef DIRECTIONAL_DISTANCE_TABLE_H_
+#define DIRECTIONAL_DISTANCE_TABLE_H_ DIRECTIONAL_DISTANCE_TABLE_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+
+/// Compressed directional distance table of a 2D occupancy grid.
+/// Answers ray casting queries, the distance from a point to the first obstacle in a given direction, without
+/// marching along the ray. The directions are discretized into n_theta bins over half a circle. For every
+/// direction, the plane is divided into rows parallel to the direction, and every row stores the sorted
+/// positions of the obstacles whose cells cross its center line. A query determines the row of the start point
+/// and finds the next obstacle by binary search. Rays in the opposite direction use the same rows searched
+/// backwards.
+/// The table stores every obstacle about once per direction, so it takes far less memory than a table of
+/// distances for every cell and direction. Described in:
+/// Corey H. Walsh and Sertac Karaman.
+/// CDDT: Fast Approximate 2D Ray Casting for Accelerated Localization.
+/// IEEE International Conference on Robotics and Automation (ICRA), 2018.
+class DirectionalDistanceTable
+{
+protected:
+    /// Number of directions over half a circle.
+    size_t n_theta_;
+
+    /// Edge length of the cells of the grid and width of the rows.
+    double resolution_;
+
+    /// x-coordinate of the lower left corner of the grid.
+    double x_min_;
+
+    /// y-coordinate of the lower left corner of the grid.
+    double y_min_;
+
+    /// Distance returned if a ray does not hit any obstacle.
+    float max_range_;
+
+    /// Direction cosine and sine of every direction.
+    std::vector<double> cos_, sin_;
+
+    /// Lowest coordinate perpendicular to the direction covered by the rows, per direction.
+    std::vector<double> v_min_;
+
+    /// Index of the first obstacle of every row and one past the last row, per direction.
+    std::vector<std::vector<uint32_t> > rows_;
+
+    /// Positions of the obstacles along the direction, sorted within each row, per direction.
+    std::vector<std::vector<float> > u_;
+
+
+public:
+    /// Default constructor.
+    /// Creates a table without obstacles.
+    DirectionalDistanceTable()
+        : n_theta_(0u),
+          resolution_(1.0),
+          x_min_(0.0),
+          y_min_(0.0),
+          max_range_(0.0f)
+    {
+    }
+
+
+    /// Constructor.
+    /// Computes the table of the given grid using all available cores.
+    /// \param[in] occupied flags that tell which cells are obstacles. Cell (ix, iy) is located at index
+    /// ix*y_size + iy.
+    /// \param[in] x_size number of cells in x direction.
+    /// \param[in] y_size number of cells in y direction.
+    /// \param[in] resolution edge length of the cells.
+    /// \param[in] x_min x-coordinate of the lower left corner of the grid.
+    /// \param[in] y_min y-coordinate of the lower left corner of the grid.
+    /// \param[in] n_theta number of directions over half a circle.
+    /// \param[in] max_range distance returned if a ray does not hit any obstacle.
+    DirectionalDistanceTable(const std::vector<unsigned char>& occupied, size_t x_size, size_t y_size,
+                             double resolution, double x_min, double y_min, size_t n_theta, double max_range)
+        : n_theta_(std::max<size_t>(1u, n_theta)),
+          resolution_(resolution),
+          x_min_(x_min),
+          y_min_(y_min),
+          max_range_(max_range),
+          cos_(n_theta_),
+          sin_(n_theta_),
+          v_min_(n_theta_),
+          rows_(n_theta_),
+          u_(n_theta_)
+    {
+        // Collect the centers of the obstacles relative to the lower left corner of the grid.
+        std::vector<float> x, y;
+        for (size_t ix = 0u; ix < x_size; ++ix)
+            for (size_t iy = 0u; iy < y_size; ++iy)
+                if (occupied[ix*y_size + iy])
+                {
+                    x.push_back((ix + 0.5) * resolution_);
+                    y.push_back((iy + 0.5) * resolution_);
+                }
+
+        // Compute the rows of all directions.
+        const size_t n_threads = std::max(1u, boost::thread::hardware_concurrency());
+        const size_t directions_per_thread = (n_theta_ + n_threads-1u) / n_threads;
+        boost::thread_group threads;
+        for (size_t begin = 0u; begin < n_theta_; begin += directions_per_thread)
+            threads.create_thread(boost::bind(&DirectionalDistanceTable::compute_directions, this,
+                                              boost::cref(x), boost::cref(y), x_size * resolution_,
+                                              y_size * resolution_, begin,
+                                              std::min(begin + directions_per_thread, n_theta_)));
+        threads.join_all();
+    }
+
+
+    /// Returns the distance from the given point to the first obstacle in the given direction.
+    /// \param[in] x x-coordinate of the start point.
+    /// \param[in] y y-coordinate of the start point.
+    /// \param[in] angle direction of the ray in radians.
+    /// \return distance to the obstacle, at most the maximum range.
+    float distance(double x, double y, double angle) const
+    {
+        if (n_theta_ == 0u)
+            return max_range_;
+
+        // Determine the direction and whether the ray runs backwards along its rows.
+        long k = std::floor(angle / M_PI * n_theta_ + 0.5);
+        k %= (long)(2u*n_theta_);
+        if (k < 0)
+            k += 2u*n_theta_;
+        const bool backward = k >= (long)n_theta_;
+        const size_t theta = backward ? k - n_theta_ : k;
+
+        // Determine the row of the start point.
+        const double px = x - x_min_;
+        const double py = y - y_min_;
+        const double u = px*cos_[theta] + py*sin_[theta];
+        const double v = -px*sin_[theta] + py*cos_[theta];
+        const double row = std::floor((v - v_min_[theta]) / resolution_);
+        const std::vector<uint32_t>& rows = rows_[theta];
+        if (!(row >= 0.0 && row < rows.size() - 1u))
+            return max_range_;
+
+        // Find the next obstacle along the ray. The distance is measured to the boundary of its cell.
+        const float* begin = u_[theta].empty() ? NULL : &u_[theta][0] + rows[(size_t)row];
+        const float* end = u_[theta].empty() ? NULL : &u_[theta][0] + rows[(size_t)row + 1u];
+        double d = max_range_;
+        if (backward)
+        {
+            const float* obstacle = std::upper_bound(begin, end, (float)u);
+            if (obstacle != begin)
+                d = u - *(obstacle - 1);
+        }
+        else
+        {
+            const float* obstacle = std::lower_bound(begin, end, (float)u);
+            if (obstacle != end)
+                d = *obstacle - u;
+        }
+
+        return std::min(max_range_, (float)std::max(0.0, d - 0.5*resolution_));
+    }
+
+
+    /// Returns the distance returned if a ray does not hit any obstacle.
+    float get_max_range() const
+    {
+        return max_range_;
+    }
+
+
+protected:
+    /// Computes the rows of the directions [begin, end).
+    void compute_directions(const std::vector<float>& x, const std::vector<float>& y, double width,
+                            double height, size_t begin, size_t end)
+    {
+        for (size_t theta = begin; theta < end; ++theta)
+        {
+            const double angle = theta * M_PI / n_theta_;
+            const double c = std::cos(angle);
+            const double s = std::sin(angle);
+            cos_[theta] = c;
+            sin_[theta] = s;
+
+            // Determine the rows covering the grid.
+            const double v_corners[4] = {0.0, -width*s, height*c, -width*s + height*c};
+            const double v_min = *std::min_element(v_corners, v_corners + 4);
+            const double v_max = *std::max_element(v_corners, v_corners + 4);
+            const size_t n_rows = std::floor((v_max - v_min) / resolution_) + 1u;
+            v_min_[theta] = v_min;
+
+            // Count the obstacles per row. The cell of an obstacle covers this extent on either side of its
+            // center, perpendicular to the direction.
+            const double extent = 0.5 * resolution_ * (std::abs(c) + std::abs(s));
+            std::vector<uint32_t>& rows = rows_[theta];
+            rows.assign(n_rows + 1u, 0u);
+            for (size_t i = 0u; i < x.size(); ++i)
+            {
+                long first, last;
+                row_range(-x[i]*s + y[i]*c - v_min, extent, n_rows, first, last);
+                for (long row = first; row <= last; ++row)
+                    rows[row + 1]++;
+            }
+
+            for (size_t row = 0u; row < n_rows; ++row)
+                rows[row + 1u] += rows[row];
+
+            // Enter the obstacles into their rows and sort the rows.
+            std::vector<float>& u = u_[theta];
+            u.resize(rows[n_rows]);
+            std::vector<uint32_t> next(rows.begin(), rows.end() - 1);
+            for (size_t i = 0u; i < x.size(); ++i)
+            {
+                long first, last;
+                row_range(-x[i]*s + y[i]*c - v_min, extent, n_rows, first, last);
+                for (long row = first; row <= last; ++row)
+                    u[next[row]++] = x[i]*c + y[i]*s;
+            }
+
+            for (size_t row = 0u; row < n_rows; ++row)
+                std::sort(u.begin() + rows[row], u.begin() + rows[row + 1u]);
+        }
+    }
+
+
+    /// Determines the rows an obstacle is entered into: the rows whose center lines cross its cell.
+    /// Entering the obstacle into all rows its cell overlaps would let rays that pass close by the cell hit it.
+    /// \param[in] v position of the center of the cell perpendicular to the direction, relative to the rows.
+    /// \param[in] extent extent of the cell on either side of its center, perpendicular to the direction.
+    /// \param[in] n_rows number of rows.
+    /// \param[out] first first row. Greater than the last row if the cell does not cross any center line.
+    /// \param[out] last last row.
+    void row_range(double v, double extent, size_t n_rows, long& first, long& last) const
+    {
+        first = std::max(0.0, std::ceil((v - extent) / resolution_ - 0.5));
+        last = std::min<double>(n_rows - 1u, std::floor((v + extent) / resolution_ - 0.5));
+    }
+};
+
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef DISTANCE_FIELD_H_
+#define DISTANCE_FIELD_H_ DISTANCE_FIELD_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// ROS logging.
+#include <ros/console.h>
+
+// Localizer.
+#include "localizer/block_index.h"
+#include "localizer/distance_transform.h"
+
+
+/// Truncated Euclidean distance field of a point cloud map.
+/// Stores for every voxel the distance from its center to the center of the nearest voxel that contains a map
+/// point, capped at a maximum distance. Only the blocks of voxels that lie within the maximum distance of the
+/// map are stored, so the memory scales with the surface of the map, not with its volume. Looking up the
+/// distance of a point costs one hash table lookup. Compared to the exact distance to the nearest map point,
+/// the result deviates by at most the voxel diagonal.
+class DistanceField3d
+{
+protected:
+    /// Number of voxels along each edge of a block.
+    static const int block_size = 8;
+
+    /// Number of voxels of a block.
+    static const int block_voxels = block_size * block_size * block_size;
+
+    /// Block coordinates must lie in [-block_limit, block_limit) to fit into the keys of the block index.
+    static const long block_limit = 1l << 20;
+
+    /// Coordinates of a block.
+    struct Block
+    {
+        int32_t x, y, z;
+
+        Block(int32_t x, int32_t y, int32_t z)
+            : x(x), y(y), z(z)
+        {
+        }
+    };
+
+    /// Occupancy of the voxels of a block, one bit per voxel.
+    struct Occupancy
+    {
+        uint64_t bits[block_voxels / 64];
+
+        Occupancy()
+        {
+            std::fill(bits, bits + block_voxels/64, 0u);
+        }
+    };
+
+
+    /// Edge length of the voxels.
+    double resolution_;
+
+    /// Maximum distance stored in the field.
+    float d_max_;
+
+    /// Corner of the voxel all voxel indices are relative to. Lies near the map, so the indices of maps in UTM
+    /// coordinates fit into the keys.
+    double x_origin_, y_origin_, z_origin_;
+
+    /// Maps the key of a block to the block number, which gives the position of its voxels in distances_.
+    BlockIndex blocks_;
+
+    /// Distances of the voxels of all blocks.
+    /// Voxel (lx, ly, lz) of block number b is located at index b*block_voxels + (lx*8 + ly)*8 + lz.
+    std::vector<float> distances_;
+
+
+public:
+    /// Constructor.
+    /// Computes the distance field of the given map using all available cores.
+    /// \param[in] map point cloud map.
+    /// \param[in] resolution edge length of the voxels.
+    /// \param[in] d_max maximum distance stored in the field.
+    template<typename PointType>
+    DistanceField3d(const pcl::PointCloud<PointType>& map, double resolution, double d_max)
+        : resolution_(resolution),
+          d_max_(d_max),
+          x_origin_(0.0),
+          y_origin_(0.0),
+          z_origin_(0.0)
+    {
+        // Put the origin at the corner of the voxel of the first finite point.
+        for (size_t i = 0u; i < map.size(); ++i)
+            if (pcl::isFinite(map[i]))
+            {
+                x_origin_ = std::floor(map[i].x / resolution_) * resolution_;
+                y_origin_ = std::floor(map[i].y / resolution_) * resolution_;
+                z_origin_ = std::floor(map[i].z / resolution_) * resolution_;
+                break;
+            }
+
+        // Mark the voxels that contain map points.
+        BlockIndex occupied;
+        std::vector<Block> occupied_blocks;
+        std::vector<Occupancy> occupancy;
+        size_t n_outside = 0u;
+        for (size_t i = 0u; i < map.size(); ++i)
+        {
+            long vx, vy, vz;
+            if (!voxel(map[i].x, map[i].y, map[i].z, vx, vy, vz))
+            {
+                n_outside += pcl::isFinite(map[i]);
+                continue;
+            }
+
+            const Block b(block(vx), block(vy), block(vz));
+            const uint32_t o = occupied.insert(BlockIndex::key(b.x, b.y, b.z), occupancy.size());
+            if (o == occupancy.size())
+            {
+                occupied_blocks.push_back(b);
+                occupancy.push_back(Occupancy());
+            }
+
+            const int l = local(vx, vy, vz);
+            occupancy[o].bits[l / 64] |= (uint64_t)1u << (l % 64);
+        }
+
+        if (n_outside > 0u)
+            ROS_WARN_STREAM(n_outside << " map points lie outside the range of the distance field.");
+
+        // Allocate all blocks within the maximum distance of an occupied block.
+        const int radius = std::ceil(d_max_ / resolution_);
+        const int block_radius = (radius + block_size-1) / block_size;
+        std::vector<Block> blocks;
+        for (size_t i = 0u; i < occupied_blocks.size(); ++i)
+        {
+            const Block& b = occupied_blocks[i];
+            for (long dx = -block_radius; dx <= block_radius; ++dx)
+                for (long dy = -block_radius; dy <= block_radius; ++dy)
+                    for (long dz = -block_radius; dz <= block_radius; ++dz)
+                        if (in_range(b.x+dx, b.y+dy, b.z+dz)
+                            && blocks_.insert(BlockIndex::key(b.x+dx, b.y+dy, b.z+dz), blocks.size())
+                               == blocks.size())
+                            blocks.push_back(Block(b.x+dx, b.y+dy, b.z+dz));
+        }
+
+        distances_.resize(blocks.size() * block_voxels);
+        if (blocks.empty())
+            return;
+
+        // Compute the distances block by block, distributed over all available cores.
+        const size_t n_threads = std::max(1u, boost::thread::hardware_concurrency());
+        const size_t blocks_per_thread = (blocks.size() + n_threads-1u) / n_threads;
+        boost::thread_group threads;
+        for (size_t begin = 0u; begin < blocks.size(); begin += blocks_per_thread)
+            threads.create_thread(boost::bind(&DistanceField3d::compute_blocks, this, boost::cref(occupied),
+                                              boost::cref(occupancy), boost::cref(blocks), radius, begin,
+                                              std::min(begin + blocks_per_thread, blocks.size())));
+        threads.join_all();
+    }
+
+
+    /// Returns the distance from the given point to the map, capped at the maximum distance.
+    /// Points outside the stored blocks and NaN points yield the maximum distance.
+    float distance(double x, double y, double z) const
+    {
+        long vx, vy, vz;
+        if (!voxel(x, y, z, vx, vy, vz))
+            return d_max_;
+
+        const uint32_t b = blocks_.find(BlockIndex::key(block(vx), block(vy), block(vz)));
+        if (b == BlockIndex::npos)
+            return d_max_;
+
+        return distances_[(size_t)b*block_voxels + local(vx, vy, vz)];
+    }
+
+
+    /// Returns the edge length of the voxels.
+    double get_resolution() const
+    {
+        return resolution_;
+    }
+
+
+    /// Returns the maximum distance stored in the field.
+    float get_d_max() const
+    {
+        return d_max_;
+    }
+
+
+    /// Returns the number of stored blocks.
+    size_t n_blocks() const
+    {
+        return blocks_.size();
+    }
+
+
+protected:
+    /// Computes the distances of the blocks [begin, end).
+    /// \param[in] occupied maps the key of every block that contains map points to its position in occupancy.
+    /// \param[in] occupancy occupancy of the voxels of these blocks.
+    /// \param[in] blocks coordinates of all stored blocks, in the order of their block numbers.
+    /// Every block is transformed together with a margin of the given radius, so all occupied voxels within the
+    /// maximum distance of the block take part. The squared distances are computed by three passes of the
+    /// one-dimensional transform, one along each axis.
+    void compute_blocks(const BlockIndex& occupied, const std::vector<Occupancy>& occupancy,
+                        const std::vector<Block>& blocks, int radius, size_t begin, size_t end)
+    {
+        const int size = block_size + 2*radius;
+        const int block_radius = (radius + block_size-1) / block_size;
+        const double empty = 1.0e20;
+        std::vector<double> f(size * size * size), line(size), d(size), z(size + 1);
+        std::vector<uint32_t> arg(size), v(size);
+        for (size_t b = begin; b < end; ++b)
+        {
+            const long bx = blocks[b].x, by = blocks[b].y, bz = blocks[b].z;
+            const long x0 = bx*block_size - radius, y0 = by*block_size - radius, z0 = bz*block_size - radius;
+
+            // Copy the occupancy of the block and its margin.
+            std::fill(f.begin(), f.end(), empty);
+            for (long dx = -block_radius; dx <= block_radius; ++dx)
+                for (long dy = -block_radius; dy <= block_radius; ++dy)
+                    for (long dz = -block_radius; dz <= block_radius; ++dz)
+                    {
+                        if (!in_range(bx+dx, by+dy, bz+dz))
+                            continue;
+
+                        const uint32_t o = occupied.find(BlockIndex::key(bx+dx, by+dy, bz+dz));
+                        if (o == BlockIndex::npos)
+                            continue;
+
+                        for (int l = 0; l < block_voxels; ++l)
+                        {
+                            if (!(occupancy[o].bits[l / 64] >> (l % 64) & 1u))
+                                continue;
+
+                            const long ix = (bx+dx)*block_size + l / (block_size*block_size) - x0;
+                            const long iy = (by+dy)*block_size + l / block_size % block_size - y0;
+                            const long iz = (bz+dz)*block_size + l % block_size - z0;
+                            if (0 <= ix && ix < size && 0 <= iy && iy < size && 0 <= iz && iz < size)
+                                f[(ix*size + iy)*size + iz] = 0.0;
+                        }
+                    }
+
+            // Transform along z, y, and x. Lines without occupied voxels keep the empty value. The passes along
+            // y and x only transform the lines that cross the block itself, as the margin is not stored.
+            for (int ix = 0; ix < size; ++ix)
+                for (int iy = 0; iy < size; ++iy)
+                    transform_line(&f[(ix*size + iy)*size], 1, size, line, d, arg, v, z);
+            for (int ix = 0; ix < size; ++ix)
+                for (int iz = radius; iz < radius + block_size; ++iz)
+                    transform_line(&f[ix*size*size + iz], size, size, line, d, arg, v, z);
+            for (int iy = radius; iy < radius + block_size; ++iy)
+                for (int iz = radius; iz < radius + block_size; ++iz)
+                    transform_line(&f[iy*size + iz], size*size, size, line, d, arg, v, z);
+
+            // Store the capped distances of the block without its margin.
+            float* distances = &distances_[b * block_voxels];
+            for (int lx = 0; lx < block_size; ++lx)
+                for (int ly = 0; ly < block_size; ++ly)
+                    for (int lz = 0; lz < block_size; ++lz)
+                    {
+                        const double d2 = f[((lx+radius)*size + ly+radius)*size + lz+radius];
+                        distances[(lx*block_size + ly)*block_size + lz]
+                            = std::min(d_max_, (float)(std::sqrt(d2) * resolution_));
+                    }
+        }
+    }
+
+
+    /// Computes the one-dimensional squared distance transform of a line of the given grid in place.
+    /// Lines without any occupied voxel are left unchanged.
+    static void transform_line(double* f, int stride, int size, std::vector<double>& line, std::vector<double>& d,
+                               std::vector<uint32_t>& arg, std::vector<uint32_t>& v, std::vector<double>& z)
+    {
+        const double empty = 1.0e20;
+        bool occupied = false;
+        for (int k = 0; k < size; ++k)
+        {
+            line[k] = f[k*stride];
+            occupied |= line[k] < empty;
+        }
+
+        if (!occupied)
+            return;
+
+        distance_transform_1d(&line[0], size, &d[0], &arg[0], &v[0], &z[0]);
+        for (int k = 0; k < size; ++k)
+            f[k*stride] = d[k];
+    }
+
+
+    /// Computes the indices of the voxel that contains the given point, relative to the origin.
+    /// \return \c false if the point is NaN or outside the range of the field.
+    bool voxel(double x, double y, double z, long& vx, long& vy, long& vz) const
+    {
+        const double limit = (double)block_limit * block_size;
+        const double fx = std::floor((x - x_origin_) / resolution_);
+        const double fy = std::floor((y - y_origin_) / resolution_);
+        const double fz = std::floor((z - z_origin_) / resolution_);
+        if (!(std::abs(fx) < limit && std::abs(fy) < limit && std::abs(fz) < limit))
+            return false;
+
+        vx = fx;
+        vy = fy;
+        vz = fz;
+        return true;
+    }
+
+
+    /// Returns the index of the block that contains the voxel with the given index along one axis.
+    static long block(long v)
+    {
+        return (v >= 0 ? v : v - (block_size-1)) / block_size;
+    }
+
+
+    /// Returns the index of the given voxel within its block.
+    static int local(long vx, long vy, long vz)
+    {
+        return ((vx - block(vx)*block_size) * block_size + vy - block(vy)*block_size) * block_size
+            + vz - block(vz)*block_size;
+    }
+
+
+    /// Returns whether the given block coordinates can be stored in a key.
+    static bool in_range(long bx, long by, long bz)
+    {
+        return -block_limit <= bx && bx < block_limit
+            && -block_limit <= by && by < block_limit
+            && -block_limit <= bz && bz < block_limit;
+    }
+};
+
+
+#endif
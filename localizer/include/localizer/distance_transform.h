@@ -0,0 +1,210 @@
+#ifndef DISTANCE_TRANSFORM_H_
+#define DISTANCE_TRANSFORM_H_ DISTANCE_TRANSFORM_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+
+/// Index returned by distance_transform() for tiles without any valid tile in the grid.
+const uint32_t distance_transform_npos = 0xffffffffu;
+
+
+/// Computes the one-dimensional squared Euclidean distance transform of a sampled function:
+/// d[q] = min_p (q-p)^2 + f[p]. Runs in linear time using the lower envelope of parabolas described in:
+/// Pedro F. Felzenszwalb and Daniel P. Huttenlocher.
+/// Distance Transforms of Sampled Functions.
+/// Theory of Computing, 8(19):415-428, 2012.
+/// \param[in] f function values.
+/// \param[in] n number of samples.
+/// \param[out] d transformed values.
+/// \param[out] arg minimizing sample p for every sample q.
+/// \param v scratch memory for n elements.
+/// \param z scratch memory for n+1 elements.
+inline void distance_transform_1d(const double* f, size_t n, double* d, uint32_t* arg, uint32_t* v, double* z)
+{
+    if (n == 0u)
+        return;
+
+    // Compute the lower envelope of the parabolas rooted at the samples.
+    size_t k = 0u;
+    v[0] = 0u;
+    z[0] = -std::numeric_limits<double>::infinity();
+    z[1] = +std::numeric_limits<double>::infinity();
+    for (size_t q = 1u; q < n; ++q)
+    {
+        // Remove the parabolas hidden by the new one. As z[0] is minus infinity, the first one always stays.
+        double s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+        while (s <= z[k])
+        {
+            --k;
+            s = ((f[q] + (double)q*q) - (f[v[k]] + (double)v[k]*v[k])) / (2.0*q - 2.0*v[k]);
+        }
+
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k+1u] = +std::numeric_limits<double>::infinity();
+    }
+
+    // Evaluate the lower envelope at every sample.
+    k = 0u;
+    for (size_t q = 0u; q < n; ++q)
+    {
+        while (z[k+1u] < q)
+            ++k;
+        const double dq = (double)q - v[k];
+        d[q] = dq*dq + f[v[k]];
+        arg[q] = v[k];
+    }
+}
+
+
+/// Computes the first pass of distance_transform() for the rows [ix_begin, ix_end).
+/// As the input is binary, the squared distance along a row is found by two linear scans that track the
+/// closest valid tile on either side, without the general one-dimensional transform.
+inline void distance_transform_rows(const unsigned char* valid, size_t y_size, size_t ix_begin, size_t ix_end,
+                                    double* g, uint32_t* arg_y)
+{
+    // Rows without any valid tile get a large finite cost instead of infinity, so the parabola intersections of
+    // the second pass stay finite.
+    const double invalid = 1.0e20;
+    for (size_t ix = ix_begin; ix < ix_end; ++ix)
+    {
+        const size_t row = ix * y_size;
+
+        // Find the closest valid tile on the left.
+        long last = -1;
+        for (size_t iy = 0u; iy < y_size; ++iy)
+        {
+            if (valid[row + iy])
+                last = iy;
+            const double d = (double)iy - last;
+            g[row + iy] = last < 0 ? invalid : d*d;
+            arg_y[row + iy] = last < 0 ? 0u : (uint32_t)last;
+        }
+
+        // Replace it by the closest valid tile on the right, if that one is closer.
+        last = -1;
+        for (size_t iy = y_size; iy-- > 0u; )
+        {
+            if (valid[row + iy])
+                last = iy;
+            const double d = (double)last - iy;
+            if (last >= 0 && d*d < g[row + iy])
+            {
+                g[row + iy] = d*d;
+                arg_y[row + iy] = last;
+            }
+        }
+    }
+}
+
+
+/// Computes the second pass of distance_transform() for the columns [iy_begin, iy_end).
+/// Transforms every column of the result of the first pass along the x axis. The columns are gathered in
+/// batches of neighboring columns, so every row of the grid is read in contiguous pieces.
+inline void distance_transform_columns(const double* g, const uint32_t* arg_y, size_t x_size, size_t y_size,
+                                       size_t iy_begin, size_t iy_end, double* distance, uint32_t* nearest)
+{
+    // Squared distances at least this large stem from rows without any valid tile.
+    const double unreachable = 0.5e20;
+    const size_t batch_size = 16u;
+    std::vector<double> f(batch_size * x_size), d(batch_size * x_size), z(x_size + 1u);
+    std::vector<uint32_t> arg(batch_size * x_size), v(x_size);
+    for (size_t iy0 = iy_begin; iy0 < iy_end; iy0 += batch_size)
+    {
+        const size_t n_columns = std::min(batch_size, iy_end - iy0);
+
+        // Gather the columns of the batch.
+        for (size_t ix = 0u; ix < x_size; ++ix)
+            for (size_t c = 0u; c < n_columns; ++c)
+                f[c*x_size + ix] = g[ix*y_size + iy0 + c];
+
+        for (size_t c = 0u; c < n_columns; ++c)
+            distance_transform_1d(&f[c*x_size], x_size, &d[c*x_size], &arg[c*x_size], &v[0], &z[0]);
+
+        // Scatter the distances and the indices of the nearest valid tiles.
+        for (size_t ix = 0u; ix < x_size; ++ix)
+            for (size_t c = 0u; c < n_columns; ++c)
+            {
+                const size_t i = ix*y_size + iy0 + c;
+                const size_t k = c*x_size + ix;
+                if (d[k] < unreachable)
+                {
+                    distance[i] = std::sqrt(d[k]);
+                    nearest[i] = arg[k]*y_size + arg_y[arg[k]*y_size + iy0 + c];
+                }
+                else
+                {
+                    distance[i] = std::numeric_limits<double>::infinity();
+                    nearest[i] = distance_transform_npos;
+                }
+            }
+    }
+}
+
+
+/// Computes the exact Euclidean distance transform of a grid.
+/// For every tile, determines the nearest valid tile and the distance to its center in units of tiles.
+/// The transform is separable: the first pass transforms the rows, the second pass the columns. The rows and
+/// columns of each pass are distributed over all available cores. Small grids, such as the windows transformed
+/// by incremental updates of a map, are transformed in the calling thread, as starting threads would take
+/// longer than the transform itself.
+/// \param[in] valid flags that tell which tiles are valid. Tile (ix, iy) is located at index ix*y_size + iy.
+/// \param[in] x_size number of tiles in x direction.
+/// \param[in] y_size number of tiles in y direction.
+/// \param[out] distance distance to the nearest valid tile. Infinite if no tile is valid.
+/// \param[out] nearest index of the nearest valid tile. distance_transform_npos if no tile is valid.
+inline void distance_transform(const std::vector<unsigned char>& valid, size_t x_size, size_t y_size,
+                               std::vector<double>& distance, std::vector<uint32_t>& nearest)
+{
+    const size_t n_tiles = x_size * y_size;
+    distance.resize(n_tiles);
+    nearest.resize(n_tiles);
+    if (n_tiles == 0u)
+        return;
+
+    std::vector<double> g(n_tiles);
+    std::vector<uint32_t> arg_y(n_tiles);
+    const size_t min_tiles_per_thread = 65536u;
+    const size_t n_threads = std::max<size_t>(1u, std::min<size_t>(boost::thread::hardware_concurrency(),
+                                                                   n_tiles / min_tiles_per_thread));
+    if (n_threads == 1u)
+    {
+        distance_transform_rows(&valid[0], y_size, 0u, x_size, &g[0], &arg_y[0]);
+        distance_transform_columns(&g[0], &arg_y[0], x_size, y_size, 0u, y_size, &distance[0], &nearest[0]);
+        return;
+    }
+
+    // Transform the rows.
+    {
+        const size_t rows_per_thread = (x_size + n_threads-1u) / n_threads;
+        boost::thread_group threads;
+        for (size_t begin = 0u; begin < x_size; begin += rows_per_thread)
+            threads.create_thread(boost::bind(&distance_transform_rows, &valid[0], y_size, begin,
+                                              std::min(begin + rows_per_thread, x_size), &g[0], &arg_y[0]));
+        threads.join_all();
+    }
+
+    // Transform the columns.
+    {
+        const size_t columns_per_thread = (y_size + n_threads-1u) / n_threads;
+        boost::thread_group threads;
+        for (size_t begin = 0u; begin < y_size; begin += columns_per_thread)
+            threads.create_thread(boost::bind(&distance_transform_columns, &g[0], &arg_y[0], x_size, y_size, begin,
+                                              std::min(begin + columns_per_thread, y_size),
+                                              &distance[0], &nearest[0]));
+        threads.join_all();
+    }
+}
+
+
+#endif
@@ -7,6 +7,15 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <numeric>
+#include <set>
+#include <cstring>
+#include <stdint.h>
+
+// Boost.
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/crc.hpp>
 
 // Point Cloud Library.
 #include <pcl/point_cloud.h>
@@ -14,14 +23,57 @@
 // ROS logging.
 #include <ros/console.h>
 
+// Localizer.
+#include "localizer/layer_buffer.h"
+#include "localizer/distance_transform.h"
+#include "localizer/point_intensity.h"
+#include "localizer/worker_pool.h"
+
 
 /// Converts a PCL point cloud to an elevation map.
 template<typename PointType>
 class ElevationMap
 {
 protected:
-    /// Map data.
-    std::vector<std::vector<double> > map_;
+    /// Map data: maximum z-coordinate of the points in each tile.
+    /// The tiles are stored contiguously: tile (ix, iy) is located at index ix*y_size_ + iy.
+    /// All layers either own their tiles or refer to an external map image, see attach().
+    LayerBuffer<double> map_;
+
+    /// Optional statistics layers. If enabled, they have the same layout as the map data.
+    /// Minimum z-coordinate of the points in each tile.
+    LayerBuffer<double> min_;
+
+    /// Mean z-coordinate of the points in each tile.
+    LayerBuffer<double> mean_;
+
+    /// Variance of the z-coordinates of the points in each tile.
+    LayerBuffer<double> variance_;
+
+    /// Number of points in each tile.
+    LayerBuffer<uint32_t> count_;
+
+    /// Optional nearest-valid layers, see compute_nearest().
+    /// Elevation of the nearest tile with a valid elevation.
+    LayerBuffer<double> nearest_;
+
+    /// Distance to the center of the nearest tile with a valid elevation.
+    LayerBuffer<double> distance_;
+
+    /// Maximum of the distance layer. New valid tiles affect the nearest-valid layers only within this
+    /// distance around them, see update_nearest().
+    double distance_max_;
+
+    /// Optional reflectivity layer: mean intensity of the points in each tile. Requires the statistics layers,
+    /// which hold the number of points the mean is computed from. Points of types without an intensity field
+    /// leave the layer NaN.
+    LayerBuffer<double> reflectivity_;
+
+    /// Number of tiles in x direction.
+    size_t x_size_;
+
+    /// Number of tiles in y direction.
+    size_t y_size_;
 
     /// Edge length of the map tiles.
     double resolution_;
@@ -35,10 +87,73 @@ protected:
     /// Minimum y coordinate covered by the map.
     double y_min_;
 
+    /// Edge length of the square blocks of tiles used to track which parts of the map have changed.
+    static const size_t block_size = 32u;
+
+    /// Indices of the blocks of tiles modified by update() or fill_nan() since the dirty set was last cleared.
+    std::set<size_t> dirty_blocks_;
+
+
+public:
+    /// Interpolation modes used when looking up the map values of a batch of points.
+    enum Interp
+    {
+        /// Value of the tile in which the point lies.
+        NEAREST,
+
+        /// Bilinear interpolation between the centers of the four tiles surrounding the point.
+        BILINEAR
+    };
+
+
+    /// Per-tile layers of the map.
+    enum Layer
+    {
+        /// Maximum z-coordinate of the points in the tile. This is the elevation of the tile.
+        LAYER_MAX,
+
+        /// Minimum z-coordinate of the points in the tile.
+        LAYER_MIN,
+
+        /// Mean z-coordinate of the points in the tile.
+        LAYER_MEAN,
+
+        /// Variance of the z-coordinates of the points in the tile.
+        LAYER_VARIANCE,
+
+        /// Elevation of the nearest tile with a valid elevation.
+        LAYER_NEAREST,
+
+        /// Distance to the center of the nearest tile with a valid elevation.
+        LAYER_DISTANCE,
+
+        /// Mean intensity of the points in the tile.
+        LAYER_REFLECTIVITY
+    };
+
 
 public:
+    /// Default constructor.
+    /// Creates an empty map, for example to load a map from file.
+    ElevationMap()
+        : distance_max_(std::numeric_limits<double>::infinity()),
+          x_size_(0u),
+          y_size_(0u),
+          resolution_(resolution_min),
+          x_min_(0.0),
+          y_min_(0.0)
+    {
+    }
+
+
     /// Constructor.
-    ElevationMap(const pcl::PointCloud<PointType>& point_cloud, double resolution = 0.1)
+    /// \param[in] point_cloud point cloud to rasterize.
+    /// \param[in] resolution edge length of the map tiles.
+    /// \param[in] statistics if true, the minimum, mean, variance, and number of points of each tile are
+    /// stored in addition to the maximum z-coordinate.
+    /// \param[in] reflectivity if true, the mean intensity of each tile is stored as well. Implies statistics.
+    ElevationMap(const pcl::PointCloud<PointType>& point_cloud, double resolution = 0.1, bool statistics = false,
+                 bool reflectivity = false)
     {
         // Set the resolution.
         resolution_ = std::max(resolution_min, resolution);
@@ -59,32 +174,256 @@ public:
             }
         }
 
-        // Compute the corner of the map where the x and y coordinates reach their minimum.
-        x_min_ = std::floor(x_min/resolution_) * resolution_;
-        y_min_ = std::floor(y_min/resolution_) * resolution_;
-
-        // Compute the size of the map.
-        size_t x_size = std::max<size_t>(std::ceil((x_max-x_min_) / resolution_), 1);
-        size_t y_size = std::max<size_t>(std::ceil((y_max-y_min_) / resolution_), 1);
-
-        // Allocate the map and set all values to NaN.
-        map_.resize(x_size);
-        for (size_t ix = 0u; ix < map_.size(); ++ix)
-            map_[ix].resize(y_size, std::numeric_limits<double>::quiet_NaN());
+        // Allocate the map.
+        allocate(x_min, y_min, x_max, y_max, statistics, reflectivity);
 
         // Compute the elevation values.
         for (size_t i = 0u; i < point_cloud.size(); ++i)
         {
             size_t ix, iy;
             if (tile(point_cloud[i], ix, iy))
+                merge(index(ix, iy), point_cloud[i].z, PointIntensity<PointType>::get(point_cloud[i]));
+        }
+    }
+
+
+    /// Constructor.
+    /// Creates a map without any points that covers the given rectangle. Point clouds that do not fit into
+    /// memory at once can then be merged into the map piece by piece using update().
+    /// \param[in] x_min minimum x coordinate to cover.
+    /// \param[in] y_min minimum y coordinate to cover.
+    /// \param[in] x_max maximum x coordinate to cover.
+    /// \param[in] y_max maximum y coordinate to cover.
+    /// \param[in] resolution edge length of the map tiles.
+    /// \param[in] statistics if true, the statistics layers are stored.
+    /// \param[in] reflectivity if true, the reflectivity layer is stored. Implies statistics.
+    ElevationMap(double x_min, double y_min, double x_max, double y_max, double resolution = 0.1,
+                 bool statistics = false, bool reflectivity = false)
+    {
+        resolution_ = std::max(resolution_min, resolution);
+        allocate(x_min, y_min, x_max, y_max, statistics, reflectivity);
+    }
+
+
+    /// Merges the given point cloud into the map in place.
+    /// Points outside the map are ignored. The blocks of tiles hit by the point cloud are added to the set of
+    /// dirty blocks, so data derived from the map only needs to be recomputed for these blocks.
+    /// \param[in] pc point cloud in the map frame.
+    /// \param[in] replace if true, the tiles hit by the point cloud are overwritten by the maximum z-coordinate
+    /// of the new points. Otherwise, they keep the maximum of their old value and the new points.
+    /// \param[in] pool workers that merge large point clouds in parallel. If NULL, the calling thread merges them.
+    /// \return number of points merged into the map.
+    size_t update(const pcl::PointCloud<PointType>& pc, bool replace = false, WorkerPool* pool = NULL)
+    {
+        // Determine the tiles hit by the point cloud.
+        std::vector<size_t> hits;
+        std::vector<double> z, intensity;
+        hits.reserve(pc.size());
+        z.reserve(pc.size());
+        intensity.reserve(pc.size());
+        size_t ix, iy;
+        for (size_t i = 0u; i < pc.size(); ++i)
+            if (std::isfinite(pc[i].z) && tile(pc[i], ix, iy))
             {
-                if (std::isfinite(map_[ix][iy]))
-                    map_[ix][iy] = std::max<double>(map_[ix][iy], point_cloud[i].z);
-                else
-                    map_[ix][iy] = (double)point_cloud[i].z;
+                hits.push_back(index(ix, iy));
+                z.push_back(pc[i].z);
+                intensity.push_back(PointIntensity<PointType>::get(pc[i]));
+            }
+
+        // Mark the blocks of all touched tiles dirty and reset the touched tiles, if requested.
+        std::vector<size_t> touched(hits);
+        std::sort(touched.begin(), touched.end());
+        touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+        for (size_t i = 0u; i < touched.size(); ++i)
+        {
+            if (replace)
+                reset(touched[i]);
 
+            dirty_blocks_.insert(block(touched[i]));
+        }
+
+        // Merge the points into the map. Every part owns a contiguous range of tiles, so no two workers write
+        // to the same tile and the points of each tile are merged in their original order.
+        const size_t n = hits.size();
+        const size_t min_points_per_part = 100000u;
+        const size_t n_parts = pool == NULL ? 1u : std::max<size_t>(1u, std::min<size_t>(pool->size(),
+                                                                                         n / min_points_per_part));
+        if (n_parts > 1u)
+        {
+            // Copy the shared and external pages of the touched tiles before the workers write to them.
+            for (size_t i = 0u; i < touched.size(); ++i)
+                detach(touched[i]);
+
+            // Sort the points by the part that owns their tile. The counting sort is stable, so every part gets a
+            // contiguous range of points in their original order and does not scan the points of others.
+            const size_t tiles_per_part = (map_.size() + n_parts-1u) / n_parts;
+            std::vector<size_t> offsets(n_parts + 1u, 0u);
+            for (size_t i = 0u; i < n; ++i)
+                ++offsets[hits[i] / tiles_per_part + 1u];
+            for (size_t p = 0u; p < n_parts; ++p)
+                offsets[p+1u] += offsets[p];
+
+            std::vector<size_t> next(offsets.begin(), offsets.end() - 1u), sorted_hits(n);
+            std::vector<double> sorted_z(n), sorted_intensity(n);
+            for (size_t i = 0u; i < n; ++i)
+            {
+                const size_t k = next[hits[i] / tiles_per_part]++;
+                sorted_hits[k] = hits[i];
+                sorted_z[k] = z[i];
+                sorted_intensity[k] = intensity[i];
             }
+
+            pool->run(n_parts, boost::bind(&ElevationMap::merge_parts, this, boost::cref(sorted_hits),
+                                           boost::cref(sorted_z), boost::cref(sorted_intensity),
+                                           boost::cref(offsets), _1, _2));
+        }
+        else
+            merge_range(hits, z, intensity, 0u, n);
+
+        // Keep the nearest-valid layers consistent with the map. Only the region around the touched tiles can
+        // change.
+        if (has_nearest())
+            update_nearest(touched);
+
+        return n;
+    }
+
+
+    /// Returns whether the map stores the statistics layers.
+    bool has_statistics() const
+    {
+        return !count_.empty();
+    }
+
+
+    /// Returns whether the map stores the nearest-valid layers.
+    bool has_nearest() const
+    {
+        return !nearest_.empty();
+    }
+
+
+    /// Returns whether the map stores the reflectivity layer.
+    bool has_reflectivity() const
+    {
+        return !reflectivity_.empty();
+    }
+
+
+    /// Computes the nearest-valid layers.
+    /// For every tile, they hold the elevation of the nearest tile with a valid elevation and the distance to
+    /// it, so holes in the map and tiles near its border yield a meaningful elevation without any special
+    /// cases. The layers are computed by an exact Euclidean distance transform in parallel. Once computed,
+    /// update() and fill_nan() keep them up to date by recomputing the region around the modified tiles, pad()
+    /// by recomputing them.
+    void compute_nearest()
+    {
+        std::vector<unsigned char> valid(map_.size());
+        for (size_t i = 0u; i < valid.size(); ++i)
+            valid[i] = std::isfinite(map_[i]);
+
+        std::vector<double> distance;
+        std::vector<uint32_t> nearest_tile;
+        distance_transform(valid, x_size_, y_size_, distance, nearest_tile);
+
+        std::vector<double> nearest(valid.size());
+        for (size_t i = 0u; i < nearest.size(); ++i)
+        {
+            nearest[i] = nearest_tile[i] == distance_transform_npos
+                ? std::numeric_limits<double>::quiet_NaN() : map_[nearest_tile[i]];
+            distance[i] *= resolution_;
         }
+
+        nearest_.assign(nearest);
+        distance_.assign(distance);
+        bound_distance();
+    }
+
+
+    /// Extends the map by the given number of NaN tiles on each side.
+    /// Points slightly outside the original map then still get a nearest valid elevation.
+    /// As the indices of all tiles change, all blocks are marked dirty.
+    void pad(size_t n)
+    {
+        if (n == 0u || map_.empty())
+            return;
+
+        pad_layer(map_, n, std::numeric_limits<double>::quiet_NaN());
+        pad_layer(min_, n, std::numeric_limits<double>::quiet_NaN());
+        pad_layer(mean_, n, std::numeric_limits<double>::quiet_NaN());
+        pad_layer(variance_, n, std::numeric_limits<double>::quiet_NaN());
+        pad_layer(count_, n, 0u);
+        pad_layer(reflectivity_, n, std::numeric_limits<double>::quiet_NaN());
+        x_size_ += 2u*n;
+        y_size_ += 2u*n;
+        x_min_ -= n*resolution_;
+        y_min_ -= n*resolution_;
+
+        const bool nearest = has_nearest();
+        nearest_.clear();
+        distance_.clear();
+        if (nearest)
+            compute_nearest();
+
+        const size_t n_blocks = ((x_size_ + block_size - 1u) / block_size) * ((y_size_ + block_size - 1u) / block_size);
+        for (size_t i = 0u; i < n_blocks; ++i)
+            dirty_blocks_.insert(dirty_blocks_.end(), i);
+    }
+
+
+    /// Returns the given layer or NULL, if the layer is not stored.
+    /// All layers share the tile layout of the map data, so a kernel computes the index of a tile once and
+    /// reads any layer with it.
+    const LayerBuffer<double>* layer(Layer layer) const
+    {
+        const LayerBuffer<double>* data = &map_;
+        if (layer == LAYER_MIN)
+            data = &min_;
+        else if (layer == LAYER_MEAN)
+            data = &mean_;
+        else if (layer == LAYER_VARIANCE)
+            data = &variance_;
+        else if (layer == LAYER_NEAREST)
+            data = &nearest_;
+        else if (layer == LAYER_DISTANCE)
+            data = &distance_;
+        else if (layer == LAYER_REFLECTIVITY)
+            data = &reflectivity_;
+
+        return data->empty() ? NULL : data;
+    }
+
+
+    /// Returns the number of points per tile or NULL, if the statistics layers are not stored.
+    const LayerBuffer<uint32_t>* count() const
+    {
+        return count_.empty() ? NULL : &count_;
+    }
+
+
+    /// Returns the indices of the blocks of tiles modified since the dirty set was last cleared.
+    const std::set<size_t>& dirty_blocks() const
+    {
+        return dirty_blocks_;
+    }
+
+
+    /// Clears the set of dirty blocks.
+    void clear_dirty_blocks()
+    {
+        dirty_blocks_.clear();
+    }
+
+
+    /// Computes the range of tile indices covered by the block with the given index.
+    /// The end indices point behind the last tile of the block.
+    void block_range(size_t block, size_t& ix_begin, size_t& ix_end, size_t& iy_begin, size_t& iy_end) const
+    {
+        const size_t y_blocks = (y_size_ + block_size - 1u) / block_size;
+        ix_begin = (block / y_blocks) * block_size;
+        iy_begin = (block % y_blocks) * block_size;
+        ix_end = std::min(ix_begin + block_size, x_size_);
+        iy_end = std::min(iy_begin + block_size, y_size_);
     }
 
 
@@ -99,11 +438,10 @@ public:
 
         // Loop over all tiles of the elevation map and set the NaN tiles to the median of the values of all tiles
         // in the window.
-        unsigned int n = 0u;
-        std::vector<std::vector<double> > map(map_);
-        for (int x = 0u; x < (int)map_.size(); ++x)
-            for (int y = 0u; y < (int)map_[0].size(); ++y)
-                if (std::isnan(map_[x][y]))
+        std::vector<std::pair<size_t, double> > filled;
+        for (int x = 0u; x < (int)x_size_; ++x)
+            for (int y = 0u; y < (int)y_size_; ++y)
+                if (std::isnan(map_[index(x, y)]))
                 {
                     // Collect the values of all map tiles in the window.
                     std::vector<double> e_window;
@@ -112,9 +450,9 @@ public:
                     for (int wx = -d_window; wx <= +d_window; ++wx)
                         for (int wy = -d_window; wy <= +d_window; ++wy)
                             // Check if the index is valid.
-                            if (x+wx >= 0 && x+wx < map_.size() && y+wy >= 0 && y+wy < map_[0].size())
-                                if (!std::isnan(map_[x+wx][y+wy]))
-                                    e_window.push_back(map_[x+wx][y+wy]);
+                            if (x+wx >= 0 && x+wx < x_size_ && y+wy >= 0 && y+wy < y_size_)
+                                if (!std::isnan(map_[index(x+wx, y+wy)]))
+                                    e_window.push_back(map_[index(x+wx, y+wy)]);
 
                     // Compute the median of the values in the window.
                     if (!e_window.empty())
@@ -123,15 +461,26 @@ public:
                         std::nth_element(e_window.begin(), e_window.begin() + e_window.size()/2, e_window.end());
 
                         // Assign the median to the current map tile.
-                        map[x][y] = e_window[e_window.size() / 2];
-
-                        // Increment the counter of filled NaN value.
-                        ++n;
+                        filled.push_back(std::make_pair(index(x, y), e_window[e_window.size() / 2]));
                     }
                 }
 
-        // Store the filtered map.
-        map_ = map;
+        // Store the filled tiles and mark their blocks dirty. Only the pages that hold them are copied.
+        for (size_t i = 0u; i < filled.size(); ++i)
+        {
+            map_.writable(filled[i].first) = filled[i].second;
+            dirty_blocks_.insert(block(filled[i].first));
+        }
+        const unsigned int n = filled.size();
+
+        // Update the nearest-valid layers around the filled tiles.
+        if (has_nearest())
+        {
+            std::vector<size_t> tiles(n);
+            for (size_t i = 0u; i < n; ++i)
+                tiles[i] = filled[i].first;
+            update_nearest(tiles);
+        }
 
         return n;
     }
@@ -163,34 +512,74 @@ public:
     double elevation(size_t ix, size_t iy) const
     {
         if (check(ix, iy))
-            return map_[ix][iy];
+            return map_[index(ix, iy)];
         else
             return std::numeric_limits<double>::quiet_NaN();
     }
 
 
+    /// Looks up the map values at the given coordinates for a batch of points.
+    /// Points outside the map yield NaN. In bilinear mode, NaN tiles are left out of the interpolation
+    /// and the weights of the remaining tiles are renormalized.
+    /// The loops are free of data-dependent branches and index clamping replaces the bounds checks, so the
+    /// compiler can turn the lookups into SIMD gathers. The query point i is (x[i]+offset_x, y[i]+offset_y).
+    /// The offset is applied in double precision, like in match(), so the points can be given in a local frame
+    /// as floats while the map lies far from the origin.
+    /// \param[in] x x-coordinates of the query points.
+    /// \param[in] y y-coordinates of the query points.
+    /// \param[out] out map values at the query points.
+    /// \param[in] n number of query points.
+    /// \param[in] mode interpolation mode.
+    /// \param[in] layer map layer to look up.
+    /// \param[in] offset_x offset added to the x-coordinates.
+    /// \param[in] offset_y offset added to the y-coordinates.
+    void elevation(const float* x, const float* y, float* out, size_t n, Interp mode = NEAREST,
+                   Layer layer = LAYER_MAX, double offset_x = 0.0, double offset_y = 0.0) const
+    {
+        // If the map or the layer is empty, there is nothing to look up.
+        const LayerBuffer<double>* data = this->layer(layer);
+        if (data == NULL)
+        {
+            std::fill(out, out+n, std::numeric_limits<float>::quiet_NaN());
+            return;
+        }
+
+        if (mode == BILINEAR)
+            elevation_bilinear(*data, x, y, out, n, offset_x, offset_y);
+        else
+            elevation_nearest(*data, x, y, out, n, offset_x, offset_y);
+    }
+
+
     /// Returns the mean z-coordinate of the lowest map tiles above or below which the given points are located.
+    /// Only the tiles hit by the point cloud are visited, so the cost depends on the size of the point cloud,
+    /// not on the size of the map.
     double z_ground(const pcl::PointCloud<pcl::PointXYZI>& pc, double fraction) const
     {
-        // Create a mask that tells which tiles of the elevation map are located below or above a point of the given
-        // point cloud.
-        std::vector<std::vector<bool> > mask(map_.size(), std::vector<bool>(map_[0].size(), false));
+        // Collect the indices of the valid tiles located below or above a point of the given point cloud.
+        std::vector<size_t> tiles;
+        tiles.reserve(pc.size());
         size_t ix, iy;
         for (size_t i = 0u; i < pc.size(); ++i)
             if (tile(pc[i], ix, iy))
-                if (std::isfinite(map_[ix][iy]))
-                    mask[ix][iy] = true;
+                if (std::isfinite(map_[index(ix, iy)]))
+                    tiles.push_back(index(ix, iy));
+
+        // Count every tile only once.
+        std::sort(tiles.begin(), tiles.end());
+        tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
 
         // Create a vector that contains the z-coordinates of all tiles onto which points are projected.
-        std::vector<double> tile_z;
-        for (ix = 0u; ix < mask.size(); ++ix)
-            for (iy = 0u; iy < mask[0].size(); ++iy)
-                if (mask[ix][iy])
-                    tile_z.push_back(map_[ix][iy]);
+        std::vector<double> tile_z(tiles.size());
+        for (size_t i = 0u; i < tiles.size(); ++i)
+            tile_z[i] = map_[tiles[i]];
 
-        // Sort the vector and compute the mean of the lowest fraction of the coordinates.
-        std::sort(tile_z.begin(), tile_z.end());
+        // Move the lowest fraction of the coordinates to the front and compute their mean.
+        if (tile_z.empty())
+            return 0.0;
         int n = std::max(1, std::min<int>(tile_z.size(), (int)(fraction*tile_z.size()+0.5)));
+        if (n < (int)tile_z.size())
+            std::nth_element(tile_z.begin(), tile_z.begin()+n, tile_z.end());
         return std::accumulate(tile_z.begin(), tile_z.begin()+n, 0.0) / n;
     }
 
@@ -200,16 +589,16 @@ public:
     {
         // Compute the start and end indices in x- and y-direction.
         int ixstart = std::max<int>(((x-a/2) - x_min_) / resolution_, 0);
-        int ixend   = std::min<int>(((x+a/2) - x_min_) / resolution_, map_.size());
+        int ixend   = std::min<int>(((x+a/2) - x_min_) / resolution_, x_size_);
         int iystart = std::max<int>(((y-a/2) - y_min_) / resolution_, 0);
-        int iyend   = std::min<int>(((y+a/2) - y_min_) / resolution_, map_[0].size());
+        int iyend   = std::min<int>(((y+a/2) - y_min_) / resolution_, y_size_);
 
         // Push the z-coordinates of all tiles inside the square into a vector.
         std::vector<double> tile_z;
         for (int ix = ixstart; ix < ixend; ++ix)
             for (int iy = iystart; iy < iyend; ++iy)
-                if (std::isfinite(map_[ix][iy]))
-                    tile_z.push_back(map_[ix][iy]);
+                if (std::isfinite(map_[index(ix, iy)]))
+                    tile_z.push_back(map_[index(ix, iy)]);
 
         // Compute the mean of the lowest tiles.
         std::sort(tile_z.begin(), tile_z.end());
@@ -223,34 +612,24 @@ public:
 
     /// Computes a measure of how well the given map matches this map by computing the mean distance
     /// between the two elevation maps.
-    double diff(const ElevationMap& map, double d_max = 1.0) const
+    /// \param[in] map map to compare to.
+    /// \param[in] d_max maximum height difference per tile.
+    /// \param[in] pool workers that compare the maps. If NULL, the calling thread compares them.
+    double diff(const ElevationMap& map, double d_max = 1.0, WorkerPool* pool = NULL) const
     {
         d_max = std::abs(d_max);
 
         // Check if both maps have the same resolution.
         if (resolution_ != map.resolution_)
+        {
             ROS_ERROR("Elevation maps must have the same resolution to be comparable.");
+            return 0.0;
+        }
 
         // Compute the total height distance between the maps.
         double d_total = 0.0;
         size_t n = 0u;
-        for (size_t ix = 0u; ix < map_.size(); ++ix)
-            for (size_t iy = 0u; iy < map_[0].size(); ++iy)
-            {
-                // Compute the coordinates of the center of the map tile.
-                double x_center = x_min_ + (ix+0.5)*resolution_;
-                double y_center = y_min_ + (iy+0.5)*resolution_;
-
-                // Compute the height difference between the two map tiles.
-                double d = elevation(x_center, y_center) - map.elevation(x_center, y_center);
-
-                // If the height difference is defined, add it to the total difference.
-                if (std::isfinite(d))
-                {
-                    d_total += std::min(std::abs(d), d_max);
-                    n++;
-                }
-            }
+        compare(map, d_max, false, pool, d_total, n);
 
         // Return the mean of the distances.
         if (n < 1)
@@ -270,7 +649,7 @@ public:
         for (size_t i = 0u; i < pc.size(); ++i)
             if (tile(pc[i], ix, iy))
             {
-                double dz = pc[i].z - map_[ix][iy];
+                double dz = pc[i].z - map_[index(ix, iy)];
                 if (std::isfinite(dz))
                 {
                     d_total += dz;
@@ -283,8 +662,13 @@ public:
 
 
     /// Computes the error between the given point cloud and the elevation map.
+    /// If the nearest-valid layers are available, points above holes or outside the map are compared to the
+    /// nearest valid elevation. Otherwise, their distance is their z-coordinate.
     double match(const pcl::PointCloud<PointType>& pc) const
     {
+        if (has_nearest())
+            return match_nearest(pc);
+
         // Compute the total distance in z-direction between the point cloud and the map.
         double d_total = 0.0;
         double dz;
@@ -295,8 +679,8 @@ public:
             size_t ix, iy;
             if (tile(pc[i], ix, iy))
             {
-                if (std::isfinite(map_[ix][iy]))
-                    dz = pc[i].z - map_[ix][iy];
+                if (std::isfinite(map_[index(ix, iy)]))
+                    dz = pc[i].z - map_[index(ix, iy)];
                 else
                     dz = pc[i].z;
             }
@@ -316,35 +700,180 @@ public:
     }
 
 
+    /// Computes the error between a translated point cloud and the elevation map.
+    /// Yields the same error as match() for the point cloud (x+dx, y+dy, z+dz). The translation is applied in
+    /// double precision, so the points can be given in a local frame as floats while the map lies far from the
+    /// origin. The loop is free of data-dependent branches.
+    /// \param[in] x x-coordinates of the points.
+    /// \param[in] y y-coordinates of the points.
+    /// \param[in] z z-coordinates of the points.
+    /// \param[in] n number of points.
+    /// \param[in] dx translation in x-direction.
+    /// \param[in] dy translation in y-direction.
+    /// \param[in] dz translation in z-direction.
+    /// \param[in] bound if the error is certain to exceed this bound, the computation stops early and returns a
+    /// lower bound of the error that is larger than the given bound. The points should be in random order, so
+    /// the partial error is representative of the whole point cloud.
+    double match(const float* x, const float* y, const float* z, size_t n,
+                 double dx, double dy, double dz,
+                 double bound = std::numeric_limits<double>::infinity()) const
+    {
+        const bool nearest = has_nearest();
+        const LayerBuffer<double>& data = nearest ? nearest_ : map_;
+        const double inv_res = 1.0 / resolution_;
+        const double x_size = x_size_;
+        const double y_size = y_size_;
+        const double x_last = x_size - 1.0;
+        const double y_last = y_size - 1.0;
+        const double x_offset = dx - x_min_;
+        const double y_offset = dy - y_min_;
+
+        // All distances are nonnegative, so the partial sum divided by the number of all points is a lower
+        // bound of the error. The bound is checked after every block of points to keep the inner loop free of
+        // branches.
+        const size_t block_size = 64u;
+        const double d_bound = bound * n;
+
+        double d_total = 0.0;
+        unsigned int n_valid = 0u;
+        for (size_t begin = 0u; begin < n; begin += block_size)
+        {
+            if (d_total > d_bound)
+                return d_total / n;
+
+            const size_t end = std::min(n, begin + block_size);
+            for (size_t i = begin; i < end; ++i)
+            {
+                const double fx = std::floor((x[i] + x_offset) * inv_res);
+                const double fy = std::floor((y[i] + y_offset) * inv_res);
+
+                // Without the nearest-valid layer, points outside the map are compared to zero. With it, they
+                // are clamped to the closest border tile. NaN coordinates yield index zero in both cases.
+                const bool inside = fx >= 0.0 && fx < x_size && fy >= 0.0 && fy < y_size;
+                const double cx = std::min(x_last, std::max(0.0, fx));
+                const double cy = std::min(y_last, std::max(0.0, fy));
+                const double e = data[(size_t)cx*y_size_ + (size_t)cy];
+                const double reference = nearest || (inside && std::isfinite(e)) ? e : 0.0;
+                const double d = (z[i] + dz) - reference;
+
+                // Mask out NaN distances.
+                const bool valid = std::isfinite(d);
+                d_total += valid ? std::max(0.0, d) : 0.0;
+                n_valid += valid;
+            }
+        }
+
+        return d_total / n_valid;
+    }
+
+
+    /// Computes the sum of the intensity differences between a translated point cloud and the reflectivity layer.
+    /// The cost of a point is the absolute difference between its intensity and the reflectivity of its tile,
+    /// divided by the given scale and capped at one. Points outside the map, above tiles without reflectivity, or
+    /// with NaN intensity cost one. The translation is applied in double precision, like in match(), and the loop
+    /// is free of data-dependent branches.
+    /// \param[in] x x-coordinates of the points.
+    /// \param[in] y y-coordinates of the points.
+    /// \param[in] intensity intensities of the points.
+    /// \param[in] n number of points.
+    /// \param[in] dx translation in x-direction.
+    /// \param[in] dy translation in y-direction.
+    /// \param[in] scale intensity difference at which the cost reaches one.
+    /// \return sum of the costs of the points or n, if the map does not store the reflectivity layer.
+    double match_reflectivity(const float* x, const float* y, const float* intensity, size_t n,
+                              double dx, double dy, double scale) const
+    {
+        if (!has_reflectivity())
+            return n;
+
+        const LayerBuffer<double>& data = reflectivity_;
+        const double inv_res = 1.0 / resolution_;
+        const double inv_scale = 1.0 / scale;
+        const double x_size = x_size_;
+        const double y_size = y_size_;
+        const double x_last = x_size - 1.0;
+        const double y_last = y_size - 1.0;
+        const double x_offset = dx - x_min_;
+        const double y_offset = dy - y_min_;
+
+        double cost = 0.0;
+        for (size_t i = 0u; i < n; ++i)
+        {
+            const double fx = std::floor((x[i] + x_offset) * inv_res);
+            const double fy = std::floor((y[i] + y_offset) * inv_res);
+
+            // Clamp the indices, so every point reads a valid tile, and mask out the points outside the map.
+            // NaN coordinates yield index zero and fail the inside test.
+            const bool inside = fx >= 0.0 && fx < x_size && fy >= 0.0 && fy < y_size;
+            const double cx = std::min(x_last, std::max(0.0, fx));
+            const double cy = std::min(y_last, std::max(0.0, fy));
+            const double d = std::abs(intensity[i] - data[(size_t)cx*y_size_ + (size_t)cy]) * inv_scale;
+
+            // NaN differences fail the comparison and cost one.
+            cost += inside && d < 1.0 ? d : 1.0;
+        }
+
+        return cost;
+    }
+
+
+    /// Computes the error between the given point cloud and the vertical extent of the map tiles.
+    /// A point inside the interval between the minimum and the maximum z-coordinate observed in its tile causes
+    /// no error, so overhangs and vegetation do not penalize points that hit their lower parts. Points above
+    /// the interval are treated as in match(); points below it add their distance to the minimum.
+    /// Falls back to match() if the map does not store the statistics layers.
+    double match_band(const pcl::PointCloud<PointType>& pc) const
+    {
+        if (!has_statistics())
+            return match(pc);
+
+        double d_total = 0.0;
+        unsigned int n = 0u;
+        size_t ix, iy;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            // Determine the distances above the maximum and below the minimum of the tile.
+            double dz_max = pc[i].z, dz_min = 0.0;
+            if (tile(pc[i], ix, iy))
+            {
+                const size_t k = index(ix, iy);
+                if (std::isfinite(map_[k]))
+                    dz_max = pc[i].z - map_[k];
+                if (std::isfinite(min_[k]))
+                    dz_min = min_[k] - pc[i].z;
+            }
+
+            // If the distance is finite, add it to the total distance.
+            if (std::isfinite(dz_max))
+            {
+                d_total += std::max(0.0, dz_max) + std::max(0.0, dz_min);
+                n++;
+            }
+        }
+
+        return d_total / n;
+    }
+
+
     /// Computes a measure of how well the given map matches this map by computing the exponentials
     /// of the distance between the two elevation maps.
-    double expdiff(const ElevationMap& map, double d_max = 1.0) const
+    /// \param[in] map map to compare to.
+    /// \param[in] d_max maximum height difference per tile.
+    /// \param[in] pool workers that compare the maps. If NULL, the calling thread compares them.
+    double expdiff(const ElevationMap& map, double d_max = 1.0, WorkerPool* pool = NULL) const
     {
         // Check if both maps have the save resolution.
         if (resolution_ != map.resolution())
+        {
             ROS_ERROR("Elevation maps must have the same resolution to be compatible.");
+            return 0.0;
+        }
 
         // Compute the sum of the exponentials of the height difference between both maps.
         double exp_d_total = 0.0;
         const double exp_d_max = std::exp(std::abs(d_max));
         size_t n = 0u;
-        for (size_t ix = 0u; ix < map_.size(); ++ix)
-            for (size_t iy = 0u; iy < map_[0].size(); ++iy)
-            {
-                // Compute the coordinates of the center of the map tile.
-                double x_center = x_min_ + (ix+0.5)*resolution_;
-                double y_center = y_min_ + (iy+0.5)*resolution_;
-
-                // Compute the height difference between the two map tiles.
-                double d = elevation(x_center, y_center) - map.elevation(x_center, y_center);
-
-                // If the height difference is defined, compute the exponential and add it to the total difference.
-                if (std::isfinite(d))
-                {
-                    exp_d_total += std::min(std::exp(std::abs(d)), exp_d_max);
-                    n++;
-                }
-            }
+        compare(map, std::abs(d_max), true, pool, exp_d_total, n);
 
         // Return the mean of the exponentials.
         if (n < 1)
@@ -361,43 +890,1269 @@ public:
     }
 
 
-    /// Saves the elevation map to a CSV file.
-    void save(std::string filename = std::string()) const
+    /// Returns the number of tiles in x direction.
+    size_t x_size() const
+    {
+        return x_size_;
+    }
+
+
+    /// Returns the number of tiles in y direction.
+    size_t y_size() const
+    {
+        return y_size_;
+    }
+
+
+    /// Returns the x-coordinate of the lower left corner of the map.
+    double x_min() const
+    {
+        return x_min_;
+    }
+
+
+    /// Returns the y-coordinate of the lower left corner of the map.
+    double y_min() const
+    {
+        return y_min_;
+    }
+
+
+    /// Saves the elevation map to a binary file.
+    /// The file starts with a header that holds the map geometry and a checksum, followed by the tiles in
+    /// storage order: first the map data, then the statistics layers, the nearest-valid layers, and the
+    /// reflectivity layer, if present. Uncompressed files store the layers as raw arrays in host byte order, so
+    /// they can be memory-mapped directly. Compressed files encode runs of NaN tiles by their length and all
+    /// other tiles by the XOR of their bit pattern with the previous valid tile, which is mostly zero for smooth
+    /// terrain.
+    /// \param[in] filename name of the file. If empty, the current time is used.
+    /// \param[in] compress enables compression.
+    /// \return \c true if the file was written successfully.
+    bool save(std::string filename = std::string(), bool compress = true) const
     {
         // Define the filename.
         if (filename.empty())
         {
             ros::Time now(ros::Time::now());
             std::stringstream filename_stream;
-            filename_stream << now.sec << now.nsec << ".csv";
+            filename_stream << now.sec << now.nsec << ".map";
             filename = filename_stream.str();
         }
 
-        // Write the map to a comma-separated file.
-        std::ofstream file;
-        file.open(filename.c_str());
-        for (size_t ix = 0; ix < map_.size(); ++ix)
-            for (size_t iy = 0; iy < map_[0].size(); ++iy)
+        // Collect the chunks of the payload. Uncompressed layers are written directly from the layer vectors.
+        std::vector<unsigned char> buffer;
+        std::vector<std::pair<const unsigned char*, size_t> > chunks;
+        if (compress)
+        {
+            encode(map_, buffer);
+            if (has_statistics())
             {
-                file << map_[ix][iy];
-                if (iy < map_[ix].size()-1)
-                    file << ",";
-                else
-                    file << std::endl;
+                encode(min_, buffer);
+                encode(mean_, buffer);
+                encode(variance_, buffer);
+            }
+            if (has_nearest())
+            {
+                encode(nearest_, buffer);
+                encode(distance_, buffer);
             }
+            if (has_reflectivity())
+                encode(reflectivity_, buffer);
+            for (size_t i = 0u; i < count_.size(); ++i)
+                encode_varint(count_[i], buffer);
+            chunks.push_back(chunk(buffer));
+        }
+        else
+            chunks = layer_chunks();
+
+        // Fill in the header.
+        FileHeader header = file_header(compress);
+        boost::crc_32_type crc;
+        for (size_t i = 0u; i < chunks.size(); ++i)
+        {
+            header.payload_size += chunks[i].second;
+            crc.process_bytes(chunks[i].first, chunks[i].second);
+        }
+        header.checksum = crc.checksum();
+
+        // Write the header and the data.
+        std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+        file.write((const char*)&header, sizeof(header));
+        for (size_t i = 0u; i < chunks.size(); ++i)
+            file.write((const char*)chunks[i].first, chunks[i].second);
         file.close();
 
+        if (!file)
+        {
+            ROS_ERROR_STREAM("Failed to write \"" << filename << "\".");
+            return false;
+        }
+
         ROS_DEBUG_STREAM("Saved \"" << filename << "\".");
+        return true;
     }
 
 
-
-protected:
-    /// Checks if the given map tile indices are valid.
-    bool check(size_t ix, size_t iy) const
+    /// Loads an elevation map written by save().
+    /// If the file cannot be read or is corrupt, the map is left unchanged.
+    /// \return \c true if the map was loaded successfully.
+    bool load(const std::string& filename)
     {
-        return 0 <= ix && ix < map_.size()
-            && 0 <= iy && iy < map_[0].size();
+        std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+        if (!file)
+        {
+            ROS_ERROR_STREAM("Failed to open \"" << filename << "\".");
+            return false;
+        }
+
+        // Read and check the header.
+        FileHeader header;
+        file.read((char*)&header, sizeof(header));
+        if (!file || std::memcmp(header.magic, file_magic, sizeof(header.magic)) != 0)
+        {
+            ROS_ERROR_STREAM("\"" << filename << "\" is not an elevation map file.");
+            return false;
+        }
+        if (header.version != file_version)
+        {
+            ROS_ERROR_STREAM("\"" << filename << "\" has unsupported version " << header.version << ".");
+            return false;
+        }
+
+        // Check the header against the file size before allocating any memory.
+        file.seekg(0, std::ios::end);
+        const std::streamoff file_size = file.tellg();
+        file.seekg(sizeof(header), std::ios::beg);
+        if (!file || !check_header(header, file_size - sizeof(header)))
+        {
+            ROS_ERROR_STREAM("\"" << filename << "\" has an invalid header.");
+            return false;
+        }
+
+        // Check if the payload matches the map size before allocating the layers. A compressed payload is read
+        // and verified first, and its runs are checked against the map size without decoding them.
+        const size_t n_tiles = header.x_size * header.y_size;
+        const bool compressed = header.flags & file_compressed;
+        const bool statistics = header.flags & file_statistics;
+        const bool nearest_layers = header.flags & file_nearest;
+        const bool reflectivity = header.flags & file_reflectivity;
+        std::vector<unsigned char> buffer;
+        if (compressed)
+        {
+            buffer.resize(header.payload_size);
+            const std::pair<const unsigned char*, size_t> payload = chunk(buffer);
+            file.read((char*)payload.first, payload.second);
+            boost::crc_32_type crc;
+            crc.process_bytes(payload.first, payload.second);
+            if (!file || crc.checksum() != header.checksum)
+            {
+                ROS_ERROR_STREAM("\"" << filename << "\" is truncated or corrupt.");
+                return false;
+            }
+        }
+        if (compressed ? !check_encoded(buffer, n_tiles, header.flags)
+                       : header.payload_size != raw_payload_size(n_tiles, header.flags))
+        {
+            ROS_ERROR_STREAM("\"" << filename << "\" does not match the map size given in its header.");
+            return false;
+        }
+
+        // Allocate the layers.
+        std::vector<double> map(n_tiles), min, mean, variance, nearest, distance, intensity;
+        std::vector<uint32_t> count;
+        if (statistics)
+        {
+            min.resize(n_tiles);
+            mean.resize(n_tiles);
+            variance.resize(n_tiles);
+            count.resize(n_tiles);
+        }
+        if (nearest_layers)
+        {
+            nearest.resize(n_tiles);
+            distance.resize(n_tiles);
+        }
+        if (reflectivity)
+            intensity.resize(n_tiles);
+
+        // Read the uncompressed payload directly into the layer vectors.
+        if (!compressed)
+        {
+            std::vector<std::pair<const unsigned char*, size_t> > chunks;
+            chunks.push_back(chunk(map));
+            if (statistics)
+            {
+                chunks.push_back(chunk(min));
+                chunks.push_back(chunk(mean));
+                chunks.push_back(chunk(variance));
+            }
+            if (nearest_layers)
+            {
+                chunks.push_back(chunk(nearest));
+                chunks.push_back(chunk(distance));
+            }
+            if (reflectivity)
+                chunks.push_back(chunk(intensity));
+            if (statistics)
+                chunks.push_back(chunk(count));
+
+            boost::crc_32_type crc;
+            for (size_t i = 0u; i < chunks.size(); ++i)
+            {
+                file.read((char*)chunks[i].first, chunks[i].second);
+                crc.process_bytes(chunks[i].first, chunks[i].second);
+            }
+            if (!file || crc.checksum() != header.checksum)
+            {
+                ROS_ERROR_STREAM("\"" << filename << "\" is truncated or corrupt.");
+                return false;
+            }
+        }
+        else
+        {
+            // Decode the compressed layers.
+            size_t pos = 0u;
+            bool valid = decode(buffer, pos, map);
+            if (statistics)
+                valid = valid && decode(buffer, pos, min) && decode(buffer, pos, mean) && decode(buffer, pos, variance);
+            if (nearest_layers)
+                valid = valid && decode(buffer, pos, nearest) && decode(buffer, pos, distance);
+            if (reflectivity)
+                valid = valid && decode(buffer, pos, intensity);
+            for (size_t i = 0u; valid && i < count.size(); ++i)
+            {
+                uint64_t value;
+                valid = decode_varint(buffer, pos, value);
+                count[i] = value;
+            }
+
+            if (!valid || pos != buffer.size())
+            {
+                ROS_ERROR_STREAM("\"" << filename << "\" does not match the map size given in its header.");
+                return false;
+            }
+        }
+
+        // Replace the map.
+        map_.assign(map);
+        min_.assign(min);
+        mean_.assign(mean);
+        variance_.assign(variance);
+        count_.assign(count);
+        nearest_.assign(nearest);
+        distance_.assign(distance);
+        reflectivity_.assign(intensity);
+        bound_distance();
+        x_size_     = header.x_size;
+        y_size_     = header.y_size;
+        x_min_      = header.x_min;
+        y_min_      = header.y_min;
+        resolution_ = header.resolution;
+        dirty_blocks_.clear();
+
+        ROS_DEBUG_STREAM("Loaded \"" << filename << "\".");
+        return true;
+    }
+
+
+    /// Returns the size in bytes of the map image written by write_image().
+    size_t image_size() const
+    {
+        return sizeof(FileHeader) + raw_payload_size(map_.size(), file_header(false).flags);
+    }
+
+
+    /// Writes the map to memory in the format of an uncompressed map file.
+    /// \param[out] image memory of at least image_size() bytes.
+    void write_image(void* image) const
+    {
+        FileHeader header = file_header(false);
+        unsigned char* payload = (unsigned char*)image + sizeof(FileHeader);
+
+        // Copy the layers behind the header.
+        std::vector<std::pair<const unsigned char*, size_t> > chunks = layer_chunks();
+        boost::crc_32_type crc;
+        for (size_t i = 0u; i < chunks.size(); ++i)
+        {
+            std::memcpy(payload + header.payload_size, chunks[i].first, chunks[i].second);
+            crc.process_bytes(chunks[i].first, chunks[i].second);
+            header.payload_size += chunks[i].second;
+        }
+        header.checksum = crc.checksum();
+
+        std::memcpy(image, &header, sizeof(header));
+    }
+
+
+    /// Makes the map use the layers of a map image in memory instead of its own.
+    /// The image has the format of an uncompressed map file, for example a memory-mapped file or a shared
+    /// memory segment written by write_image(). The tiles are not copied. If the map is modified afterwards,
+    /// the modified layers are copied first, so the image is never written to.
+    /// If the image is invalid, the map is left unchanged.
+    /// \param[in] image start of the image. Must be aligned to eight bytes.
+    /// \param[in] size size of the image in bytes.
+    /// \param[in] owner keeps the image alive as long as the map or any of its copies refer to it.
+    /// \param[in] verify if true, the checksum of the image is verified.
+    /// \return \c true if the map refers to the image.
+    bool attach(const void* image, size_t size, const boost::shared_ptr<const void>& owner, bool verify = true)
+    {
+        // Check the header.
+        FileHeader header;
+        if (size < sizeof(header) || (uintptr_t)image % sizeof(double) != 0u)
+        {
+            ROS_ERROR("Map image is too small or misaligned.");
+            return false;
+        }
+        std::memcpy(&header, image, sizeof(header));
+        if (std::memcmp(header.magic, file_magic, sizeof(header.magic)) != 0 || header.version != file_version
+            || (header.flags & file_compressed))
+        {
+            ROS_ERROR("Memory does not hold an uncompressed elevation map image.");
+            return false;
+        }
+        if (!check_header(header, size - sizeof(header)))
+        {
+            ROS_ERROR("Map image has an invalid header.");
+            return false;
+        }
+
+        const size_t n_tiles = header.x_size * header.y_size;
+        const bool statistics = header.flags & file_statistics;
+        const bool nearest_layers = header.flags & file_nearest;
+        const bool reflectivity = header.flags & file_reflectivity;
+        const unsigned char* payload = (const unsigned char*)image + sizeof(header);
+        if (header.payload_size != raw_payload_size(n_tiles, header.flags)
+            || size - sizeof(header) < header.payload_size)
+        {
+            ROS_ERROR("Map image does not match the map size given in its header.");
+            return false;
+        }
+
+        // Verify the integrity of the payload.
+        if (verify)
+        {
+            boost::crc_32_type crc;
+            crc.process_bytes(payload, header.payload_size);
+            if (crc.checksum() != header.checksum)
+            {
+                ROS_ERROR("Map image is corrupt.");
+                return false;
+            }
+        }
+
+        // Point the layers into the image. The layers of doubles come first, so all of them are aligned.
+        const double* tiles = (const double*)payload;
+        map_.view(tiles, n_tiles, owner);
+        tiles += n_tiles;
+        min_.clear();
+        mean_.clear();
+        variance_.clear();
+        count_.clear();
+        nearest_.clear();
+        distance_.clear();
+        reflectivity_.clear();
+        if (statistics)
+        {
+            min_.view(tiles, n_tiles, owner);
+            mean_.view(tiles + n_tiles, n_tiles, owner);
+            variance_.view(tiles + 2u*n_tiles, n_tiles, owner);
+            tiles += 3u*n_tiles;
+        }
+        if (nearest_layers)
+        {
+            nearest_.view(tiles, n_tiles, owner);
+            distance_.view(tiles + n_tiles, n_tiles, owner);
+            tiles += 2u*n_tiles;
+        }
+        if (reflectivity)
+        {
+            reflectivity_.view(tiles, n_tiles, owner);
+            tiles += n_tiles;
+        }
+        if (statistics)
+            count_.view((const uint32_t*)tiles, n_tiles, owner);
+        bound_distance();
+        x_size_     = header.x_size;
+        y_size_     = header.y_size;
+        x_min_      = header.x_min;
+        y_min_      = header.y_min;
+        resolution_ = header.resolution;
+        dirty_blocks_.clear();
+
+        return true;
+    }
+
+
+    /// Saves the elevation map to a CSV file for inspection.
+    void save_csv(std::string filename = std::string()) const
+    {
+        // Define the filename.
+        if (filename.empty())
+        {
+            ros::Time now(ros::Time::now());
+            std::stringstream filename_stream;
+            filename_stream << now.sec << now.nsec << ".csv";
+            filename = filename_stream.str();
+        }
+
+        // Write the map to a comma-separated file.
+        std::ofstream file;
+        file.open(filename.c_str());
+        for (size_t ix = 0; ix < x_size_; ++ix)
+            for (size_t iy = 0; iy < y_size_; ++iy)
+            {
+                file << map_[index(ix, iy)];
+                if (iy < y_size_-1)
+                    file << ",";
+                else
+                    file << "\n";
+            }
+        file.close();
+
+        ROS_DEBUG_STREAM("Saved \"" << filename << "\".");
+    }
+
+
+
+protected:
+    /// Header of the binary map file.
+    struct FileHeader
+    {
+        /// File type identifier.
+        char magic[8];
+
+        /// Version of the file format.
+        uint32_t version;
+
+        /// Storage options.
+        uint32_t flags;
+
+        /// Minimum x and y coordinates covered by the map.
+        double x_min, y_min;
+
+        /// Edge length of the map tiles.
+        double resolution;
+
+        /// Number of tiles in x and y direction.
+        uint64_t x_size, y_size;
+
+        /// Number of bytes following the header.
+        uint64_t payload_size;
+
+        /// CRC-32 of the bytes following the header.
+        uint32_t checksum;
+
+        /// Unused. Pads the header to a multiple of eight bytes so that the map data is aligned.
+        uint32_t reserved;
+    };
+
+
+    /// File type identifier of binary map files.
+    static const char file_magic[8];
+
+    /// Current version of the binary map file format.
+    static const uint32_t file_version = 1u;
+
+    /// Flag indicating a compressed binary map file.
+    static const uint32_t file_compressed = 1u;
+
+    /// Flag indicating a binary map file that contains the statistics layers.
+    static const uint32_t file_statistics = 2u;
+
+    /// Flag indicating a binary map file that contains the nearest-valid layers.
+    static const uint32_t file_nearest = 4u;
+
+    /// Flag indicating a binary map file that contains the reflectivity layer.
+    static const uint32_t file_reflectivity = 8u;
+
+
+    /// Returns a file header that describes this map, without payload size and checksum.
+    FileHeader file_header(bool compressed) const
+    {
+        FileHeader header;
+        std::memcpy(header.magic, file_magic, sizeof(header.magic));
+        header.version      = file_version;
+        header.flags        = (compressed ? file_compressed : 0u) | (has_statistics() ? file_statistics : 0u)
+                            | (has_nearest() ? file_nearest : 0u) | (has_reflectivity() ? file_reflectivity : 0u);
+        header.x_min        = x_min_;
+        header.y_min        = y_min_;
+        header.resolution   = resolution_;
+        header.x_size       = x_size_;
+        header.y_size       = y_size_;
+        header.payload_size = 0u;
+        header.checksum     = 0u;
+        header.reserved     = 0u;
+
+        return header;
+    }
+
+
+    /// Checks the fields of a file header that determine how much memory is allocated for the map.
+    /// \param[in] header file header.
+    /// \param[in] size number of bytes available after the header.
+    /// \return \c true if all flags are known, the resolution is positive, neither the number of tiles nor the
+    /// size of the uncompressed payload overflows, and the payload fits into the available bytes.
+    static bool check_header(const FileHeader& header, uint64_t size)
+    {
+        const uint32_t known_flags = file_compressed | file_statistics | file_nearest | file_reflectivity;
+        if ((header.flags & ~known_flags) != 0u
+            || ((header.flags & file_reflectivity) && !(header.flags & file_statistics)))
+            return false;
+
+        if (!(header.resolution > 0.0) || !std::isfinite(header.resolution))
+            return false;
+
+        const uint64_t max_tiles = std::numeric_limits<size_t>::max() / raw_payload_size(1u, header.flags);
+        if (header.x_size > max_tiles || (header.x_size > 0u && header.y_size > max_tiles / header.x_size))
+            return false;
+
+        return header.payload_size <= size;
+    }
+
+
+    /// Returns the payload size in bytes of an uncompressed map file with the given number of tiles and the
+    /// layers given by the file flags.
+    static size_t raw_payload_size(size_t n_tiles, uint32_t flags)
+    {
+        return n_tiles * (sizeof(double) + ((flags & file_statistics) ? 3u*sizeof(double) + sizeof(uint32_t) : 0u)
+                          + ((flags & file_nearest) ? 2u*sizeof(double) : 0u)
+                          + ((flags & file_reflectivity) ? sizeof(double) : 0u));
+    }
+
+
+    /// Returns the chunks of the payload of an uncompressed map file.
+    /// The layers of doubles precede the number of points per tile, so all layers are aligned in the file.
+    std::vector<std::pair<const unsigned char*, size_t> > layer_chunks() const
+    {
+        std::vector<std::pair<const unsigned char*, size_t> > chunks;
+        append_chunks(map_, chunks);
+        if (has_statistics())
+        {
+            append_chunks(min_, chunks);
+            append_chunks(mean_, chunks);
+            append_chunks(variance_, chunks);
+        }
+        if (has_nearest())
+        {
+            append_chunks(nearest_, chunks);
+            append_chunks(distance_, chunks);
+        }
+        if (has_reflectivity())
+            append_chunks(reflectivity_, chunks);
+        if (has_statistics())
+            append_chunks(count_, chunks);
+
+        return chunks;
+    }
+
+
+    /// Returns the address and the size in bytes of the data of the given vector.
+    template<typename T>
+    static std::pair<const unsigned char*, size_t> chunk(const std::vector<T>& data)
+    {
+        return std::make_pair(data.empty() ? (const unsigned char*)NULL : (const unsigned char*)&data[0],
+                              data.size() * sizeof(T));
+    }
+
+
+    /// Appends the addresses and the sizes in bytes of the pages of the given layer to the chunks.
+    template<typename T>
+    static void append_chunks(const LayerBuffer<T>& data, std::vector<std::pair<const unsigned char*, size_t> >& chunks)
+    {
+        for (size_t p = 0u; p < data.n_pages(); ++p)
+            chunks.push_back(std::make_pair((const unsigned char*)data.page(p), data.page_length(p) * sizeof(T)));
+    }
+
+
+    /// Appends the given value to the buffer as a variable-length integer with seven bits per byte.
+    static void encode_varint(uint64_t value, std::vector<unsigned char>& buffer)
+    {
+        while (value >= 0x80u)
+        {
+            buffer.push_back((unsigned char)(value | 0x80u));
+            value >>= 7;
+        }
+        buffer.push_back((unsigned char)value);
+    }
+
+
+    /// Reads a variable-length integer from the buffer.
+    /// \return \c false if the buffer ends before the integer is complete.
+    static bool decode_varint(const std::vector<unsigned char>& buffer, size_t& pos, uint64_t& value)
+    {
+        value = 0u;
+        for (int shift = 0; pos < buffer.size() && shift < 64; shift += 7)
+        {
+            const unsigned char byte = buffer[pos++];
+            value |= (uint64_t)(byte & 0x7fu) << shift;
+            if (byte < 0x80u)
+                return true;
+        }
+
+        return false;
+    }
+
+
+    /// Compresses the given tiles.
+    /// The tiles are split into runs of NaN and non-NaN values. Each run starts with its length and type.
+    /// A non-NaN tile is stored as the XOR of its bit pattern with the one of the previous non-NaN tile.
+    /// One byte tells how many leading and trailing zero bytes the XOR has; only the remaining bytes follow.
+    /// The encoded tiles are appended to the buffer.
+    static void encode(const LayerBuffer<double>& tiles, std::vector<unsigned char>& buffer)
+    {
+        buffer.reserve(buffer.size() + tiles.size());
+        uint64_t previous = 0u;
+        for (size_t begin = 0u; begin < tiles.size(); )
+        {
+            // Find the end of the run.
+            const bool nan = std::isnan(tiles[begin]);
+            size_t end = begin + 1u;
+            while (end < tiles.size() && std::isnan(tiles[end]) == nan)
+                ++end;
+
+            // Write the run header.
+            encode_varint(((uint64_t)(end-begin) << 1) | (nan ? 1u : 0u), buffer);
+
+            // Write the delta-coded values.
+            if (!nan)
+                for (size_t i = begin; i < end; ++i)
+                {
+                    uint64_t bits;
+                    std::memcpy(&bits, &tiles[i], sizeof(bits));
+                    const uint64_t delta = bits ^ previous;
+                    previous = bits;
+
+                    const int leading  = delta == 0u ? 8 : __builtin_clzll(delta) / 8;
+                    const int trailing = delta == 0u ? 0 : __builtin_ctzll(delta) / 8;
+                    buffer.push_back((unsigned char)((leading << 4) | trailing));
+                    for (int b = trailing; b < 8-leading; ++b)
+                        buffer.push_back((unsigned char)(delta >> (8*b)));
+                }
+
+            begin = end;
+        }
+    }
+
+
+    /// Decompresses tiles encoded by encode().
+    /// \param[in] buffer compressed data.
+    /// \param[in,out] pos position in the buffer where the encoded tiles start. Set to the position behind them.
+    /// \param[in,out] tiles vector of the expected size that receives the tiles.
+    /// \return \c false if the buffer is malformed or ends before all tiles are decoded.
+    static bool decode(const std::vector<unsigned char>& buffer, size_t& pos, std::vector<double>& tiles)
+    {
+        return decode(buffer, pos, tiles.size(), tiles.empty() ? NULL : &tiles[0]);
+    }
+
+
+    /// Decompresses n tiles encoded by encode().
+    /// If tiles is NULL, the tiles are only skipped, which checks the encoding without any memory for the tiles.
+    static bool decode(const std::vector<unsigned char>& buffer, size_t& pos, size_t n, double* tiles)
+    {
+        uint64_t previous = 0u;
+        size_t i = 0u;
+        while (i < n)
+        {
+            // Read the run header.
+            uint64_t run;
+            if (!decode_varint(buffer, pos, run) || (run >> 1) == 0u || (run >> 1) > n - i)
+                return false;
+
+            const size_t end = i + (run >> 1);
+            if (run & 1u)
+            {
+                if (tiles != NULL)
+                    std::fill(tiles+i, tiles+end, std::numeric_limits<double>::quiet_NaN());
+                i = end;
+                continue;
+            }
+
+            // Read the delta-coded values.
+            for (; i < end; ++i)
+            {
+                if (pos >= buffer.size())
+                    return false;
+
+                const int leading  = buffer[pos] >> 4;
+                const int trailing = buffer[pos] & 0x0fu;
+                ++pos;
+                if (leading + trailing > 8 || pos + (8-leading-trailing) > buffer.size())
+                    return false;
+
+                uint64_t delta = 0u;
+                for (int b = trailing; b < 8-leading; ++b)
+                    delta |= (uint64_t)buffer[pos++] << (8*b);
+
+                previous ^= delta;
+                if (tiles != NULL)
+                    std::memcpy(&tiles[i], &previous, sizeof(previous));
+            }
+        }
+
+        return true;
+    }
+
+
+    /// Checks if a compressed payload holds exactly the layers of a map with the given number of tiles and the
+    /// layers given by the file flags. Only runs of non-NaN tiles are visited tile by tile, so a header that
+    /// claims a huge map is rejected without allocating it.
+    static bool check_encoded(const std::vector<unsigned char>& buffer, size_t n_tiles, uint32_t flags)
+    {
+        const int n_layers = 1 + ((flags & file_statistics) ? 3 : 0) + ((flags & file_nearest) ? 2 : 0)
+                           + ((flags & file_reflectivity) ? 1 : 0);
+        size_t pos = 0u;
+        for (int l = 0; l < n_layers; ++l)
+            if (!decode(buffer, pos, n_tiles, NULL))
+                return false;
+
+        // Every point count takes at least one byte.
+        if (flags & file_statistics)
+        {
+            if (buffer.size() - pos < n_tiles)
+                return false;
+
+            uint64_t value;
+            for (size_t i = 0u; i < n_tiles; ++i)
+                if (!decode_varint(buffer, pos, value))
+                    return false;
+        }
+
+        return pos == buffer.size();
+    }
+
+
+    /// Checks if the given map tile indices are valid.
+    bool check(size_t ix, size_t iy) const
+    {
+        return 0 <= ix && ix < x_size_
+            && 0 <= iy && iy < y_size_;
+    }
+
+
+    /// Returns the position of the tile with the given indices in the map data vector.
+    size_t index(size_t ix, size_t iy) const
+    {
+        return ix*y_size_ + iy;
+    }
+
+
+    /// Region where two maps overlap.
+    struct Overlap
+    {
+        /// Offset between the tile indices of the two maps in x direction.
+        long dx;
+
+        /// Offset between the tile indices of the two maps in y direction.
+        long dy;
+
+        /// Range of the tile indices of the first map in x direction.
+        long ix_begin, ix_end;
+
+        /// Range of the tile indices of the first map in y direction.
+        long iy_begin, iy_end;
+    };
+
+
+    /// Sums up the capped height differences between this map and the given map of the same resolution.
+    /// Only the region where both maps overlap is visited. As the map origins are multiples of the resolution,
+    /// the tiles of the two maps are related by a constant integer index offset, so both maps are traversed
+    /// row by row without any coordinate computations. The rows are distributed over the workers of the given
+    /// pool. The sums of the rows are added up in order, so the result does not depend on the scheduling.
+    /// \param[in] map map to compare to.
+    /// \param[in] d_max maximum height difference per tile.
+    /// \param[in] exponential if true, the exponentials of the capped height differences are summed up.
+    /// \param[in] pool workers that compare the rows. If NULL, the calling thread compares them.
+    /// \param[out] total sum over all tiles where both maps are defined.
+    /// \param[out] n number of tiles where both maps are defined.
+    void compare(const ElevationMap& map, double d_max, bool exponential, WorkerPool* pool, double& total,
+                 size_t& n) const
+    {
+        total = 0.0;
+        n = 0u;
+
+        // Compute the offset between the tile indices: tile (ix, iy) of this map corresponds to
+        // tile (ix-dx, iy-dy) of the given map.
+        Overlap overlap;
+        overlap.dx = std::floor((map.x_min_ - x_min_) / resolution_ + 0.5);
+        overlap.dy = std::floor((map.y_min_ - y_min_) / resolution_ + 0.5);
+
+        // Compute the overlap region in the tile indices of this map.
+        overlap.ix_begin = std::max(0l, overlap.dx);
+        overlap.ix_end   = std::min((long)x_size_, overlap.dx + (long)map.x_size_);
+        overlap.iy_begin = std::max(0l, overlap.dy);
+        overlap.iy_end   = std::min((long)y_size_, overlap.dy + (long)map.y_size_);
+        if (overlap.ix_begin >= overlap.ix_end || overlap.iy_begin >= overlap.iy_end)
+            return;
+
+        // Compare the rows in blocks of rows that are worth the scheduling overhead.
+        const size_t n_rows = overlap.ix_end - overlap.ix_begin;
+        std::vector<double> row_totals(n_rows);
+        std::vector<size_t> row_counts(n_rows);
+        if (pool != NULL)
+            pool->run(n_rows, boost::bind(&ElevationMap::compare_rows, this, boost::cref(map), boost::cref(overlap),
+                                          d_max, exponential, boost::ref(row_totals), boost::ref(row_counts), _1, _2),
+                      16u);
+        else
+            compare_rows(map, overlap, d_max, exponential, row_totals, row_counts, 0u, n_rows);
+
+        // Sum up the results of all rows.
+        for (size_t r = 0u; r < n_rows; ++r)
+        {
+            total += row_totals[r];
+            n += row_counts[r];
+        }
+    }
+
+
+    /// Computes the part of compare() that belongs to the rows [begin, end) of the overlap region.
+    void compare_rows(const ElevationMap& map, const Overlap& region, double d_max, bool exponential,
+                      std::vector<double>& row_totals, std::vector<size_t>& row_counts, size_t begin,
+                      size_t end) const
+    {
+        const long length = region.iy_end - region.iy_begin;
+        for (size_t r = begin; r < end; ++r)
+        {
+            const long ix = region.ix_begin + r;
+            double total = 0.0;
+            size_t n = 0u;
+
+            // Compute the starting points of the corresponding rows in both maps. The rows are split where a page
+            // of either map ends, so every piece is contiguous in both maps.
+            size_t i = index(ix, region.iy_begin);
+            size_t j = map.index(ix-region.dx, region.iy_begin-region.dy);
+            for (long k = 0; k < length; )
+            {
+                const long m = std::min<long>(length - k, std::min(map_.contiguous(i), map.map_.contiguous(j)));
+                const double* a = &map_[i];
+                const double* b = &map.map_[j];
+
+                // Sum up the capped height differences. NaN differences are masked out, so the loop is
+                // branch-free. The exponentials are computed batch by batch by exp_batch().
+                double piece_total = 0.0;
+                size_t piece_n = 0u;
+                if (exponential)
+                    for (long l0 = 0; l0 < m; l0 += exp_batch_size)
+                    {
+                        const long n_batch = std::min<long>(exp_batch_size, m - l0);
+                        double e[exp_batch_size];
+                        for (long l = 0; l < n_batch; ++l)
+                            e[l] = std::min(std::abs(a[l0+l] - b[l0+l]), d_max);
+
+                        exp_batch(e, n_batch, d_max);
+                        for (long l = 0; l < n_batch; ++l)
+                        {
+                            const bool valid = !std::isnan(e[l]);
+                            piece_total += valid ? e[l] : 0.0;
+                            piece_n += valid;
+                        }
+                    }
+                else
+                    for (long l = 0; l < m; ++l)
+                    {
+                        const double d = std::min(std::abs(a[l] - b[l]), d_max);
+                        const bool valid = !std::isnan(d);
+                        piece_total += valid ? d : 0.0;
+                        piece_n += valid;
+                    }
+
+                total += piece_total;
+                n += piece_n;
+                k += m;
+                i += m;
+                j += m;
+            }
+
+            row_totals[r] = total;
+            row_counts[r] = n;
+        }
+    }
+
+
+    /// Number of values exp_batch() is called with at once.
+    static const long exp_batch_size = 64;
+
+
+    /// Replaces values in [0, x_max] by their exponentials, in loops the compiler can vectorize.
+    /// The values are scaled by a power of two to at most 1/2, where the Taylor polynomial of degree 12 is
+    /// accurate to double precision, and the polynomial is squared back up once per halving. NaN values stay
+    /// NaN. Values above 1024 are treated like 1024, whose exponential overflows to infinity as well.
+    static void exp_batch(double* values, size_t n, double x_max)
+    {
+        int n_squarings = 0;
+        double scale = 1.0;
+        while (x_max*scale > 0.5 && n_squarings < 11)
+        {
+            scale *= 0.5;
+            ++n_squarings;
+        }
+
+        for (size_t i = 0u; i < n; ++i)
+        {
+            const double t = values[i] * scale;
+            double p = 1.0/479001600.0;
+            p = p*t + 1.0/39916800.0;
+            p = p*t + 1.0/3628800.0;
+            p = p*t + 1.0/362880.0;
+            p = p*t + 1.0/40320.0;
+            p = p*t + 1.0/5040.0;
+            p = p*t + 1.0/720.0;
+            p = p*t + 1.0/120.0;
+            p = p*t + 1.0/24.0;
+            p = p*t + 1.0/6.0;
+            p = p*t + 0.5;
+            p = p*t + 1.0;
+            values[i] = p*t + 1.0;
+        }
+
+        for (int s = 0; s < n_squarings; ++s)
+            for (size_t i = 0u; i < n; ++i)
+                values[i] *= values[i];
+    }
+
+
+    /// Updates the nearest-valid layers after the given tiles have received a valid elevation.
+    /// A tile can only get closer to a valid tile, and its new nearest valid tile is one of the given tiles if
+    /// that one is at most as far away as its old nearest valid tile. As no tile is farther away from its
+    /// nearest valid tile than distance_max_, the distance transform is restricted to the blocks of the given
+    /// tiles plus a margin of distance_max_. Within this window, a tile takes the result of the transform if
+    /// it is at least as close as the old one, which also covers tiles whose nearest valid tile changed its
+    /// elevation. Only the pages that actually change are copied.
+    /// \param[in] tiles positions in the map data vector of the tiles that are valid now and whose elevation
+    /// has changed.
+    void update_nearest(const std::vector<size_t>& tiles)
+    {
+        if (tiles.empty())
+            return;
+
+        // Determine the window: the bounding box of the dirty blocks, extended by the largest distance.
+        size_t ix_min = x_size_, ix_max = 0u, iy_min = y_size_, iy_max = 0u;
+        for (size_t i = 0u; i < tiles.size(); ++i)
+        {
+            size_t ix_begin, ix_end, iy_begin, iy_end;
+            block_range(block(tiles[i]), ix_begin, ix_end, iy_begin, iy_end);
+            ix_min = std::min(ix_min, ix_begin);
+            ix_max = std::max(ix_max, ix_end);
+            iy_min = std::min(iy_min, iy_begin);
+            iy_max = std::max(iy_max, iy_end);
+        }
+
+        const double margin = std::ceil(distance_max_ / resolution_);
+        if (!(margin < std::max(x_size_, y_size_)))
+        {
+            compute_nearest();
+            return;
+        }
+
+        const size_t m = margin;
+        ix_min = ix_min > m ? ix_min - m : 0u;
+        iy_min = iy_min > m ? iy_min - m : 0u;
+        ix_max = std::min(ix_max + m, x_size_);
+        iy_max = std::min(iy_max + m, y_size_);
+        const size_t wx = ix_max - ix_min, wy = iy_max - iy_min;
+        if (wx == x_size_ && wy == y_size_)
+        {
+            compute_nearest();
+            return;
+        }
+
+        // Compute the distances to the given tiles within the window.
+        std::vector<unsigned char> seed(wx * wy, 0u);
+        for (size_t i = 0u; i < tiles.size(); ++i)
+            seed[(tiles[i] / y_size_ - ix_min) * wy + tiles[i] % y_size_ - iy_min] = 1u;
+
+        std::vector<double> distance;
+        std::vector<uint32_t> nearest_tile;
+        distance_transform(seed, wx, wy, distance, nearest_tile);
+
+        // Take over the tiles that are at least as close to one of the given tiles as to their old nearest one.
+        for (size_t ix = 0u; ix < wx; ++ix)
+            for (size_t iy = 0u; iy < wy; ++iy)
+            {
+                const size_t k = ix*wy + iy;
+                const size_t i = index(ix_min + ix, iy_min + iy);
+                const double d = distance[k] * resolution_;
+                if (!(d <= distance_[i]))
+                    continue;
+
+                const double z = map_[index(ix_min + nearest_tile[k]/wy, iy_min + nearest_tile[k]%wy)];
+                if (d != distance_[i])
+                    distance_.writable(i) = d;
+                if (!(z == nearest_[i]))
+                    nearest_.writable(i) = z;
+            }
+    }
+
+
+    /// Sets distance_max_ to the maximum of the distance layer.
+    void bound_distance()
+    {
+        distance_max_ = 0.0;
+        for (size_t p = 0u; p < distance_.n_pages(); ++p)
+        {
+            const double* page = distance_.page(p);
+            for (size_t i = 0u; i < distance_.page_length(p); ++i)
+                distance_max_ = std::max(distance_max_, page[i]);
+        }
+    }
+
+
+    /// Returns the index of the block that contains the tile at the given position in the map data vector.
+    size_t block(size_t i) const
+    {
+        const size_t y_blocks = (y_size_ + block_size - 1u) / block_size;
+        return ((i / y_size_) / block_size) * y_blocks + (i % y_size_) / block_size;
+    }
+
+
+    /// Adds a point with the given z-coordinate and intensity to the tile at the given position in the map data
+    /// vector. Raises the tile to the z-coordinate and updates the statistics and reflectivity layers.
+    void merge(size_t i, double z, double intensity)
+    {
+        if (std::isnan(z))
+            return;
+
+        double& e = map_.writable(i);
+        e = std::isfinite(e) ? std::max(e, z) : z;
+
+        if (!has_statistics())
+            return;
+
+        // Update the minimum, the mean, and the variance using Welford's algorithm.
+        const uint32_t n = ++count_.writable(i);
+        if (n == 1u)
+        {
+            min_.writable(i) = mean_.writable(i) = z;
+            variance_.writable(i) = 0.0;
+        }
+        else
+        {
+            const double mean = mean_[i];
+            min_.writable(i) = std::min(min_[i], z);
+            mean_.writable(i) = mean + (z - mean) / n;
+            variance_.writable(i) = (variance_[i]*(n-1u) + (z - mean)*(z - mean_[i])) / n;
+        }
+
+        // Update the mean intensity. A point with NaN intensity counts with the current mean.
+        if (has_reflectivity() && std::isfinite(intensity))
+        {
+            const double r = reflectivity_[i];
+            reflectivity_.writable(i) = std::isnan(r) ? intensity : r + (intensity - r) / n;
+        }
+    }
+
+
+    /// Merges the points [begin, end) into the map.
+    /// \param[in] hits positions of the hit tiles in the map data vector.
+    /// \param[in] z z-coordinates of the points.
+    /// \param[in] intensity intensities of the points.
+    /// \param[in] begin index of the first point to merge.
+    /// \param[in] end index behind the last point to merge.
+    void merge_range(const std::vector<size_t>& hits, const std::vector<double>& z,
+                     const std::vector<double>& intensity, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            merge(hits[i], z[i], intensity[i]);
+    }
+
+
+    /// Merges the points of the parts [begin, end) into the map.
+    /// \param[in] offsets index of the first point of every part and, at the end, the total number of points.
+    void merge_parts(const std::vector<size_t>& hits, const std::vector<double>& z,
+                     const std::vector<double>& intensity, const std::vector<size_t>& offsets, size_t begin,
+                     size_t end)
+    {
+        for (size_t p = begin; p < end; ++p)
+            merge_range(hits, z, intensity, offsets[p], offsets[p+1u]);
+    }
+
+
+    /// Allocates the layers for a map that covers the given rectangle and sets all tiles to NaN.
+    /// The resolution must be set beforehand.
+    void allocate(double x_min, double y_min, double x_max, double y_max, bool statistics, bool reflectivity)
+    {
+        // Compute the corner of the map where the x and y coordinates reach their minimum.
+        x_min_ = std::floor(x_min/resolution_) * resolution_;
+        y_min_ = std::floor(y_min/resolution_) * resolution_;
+
+        // Compute the size of the map.
+        x_size_ = std::max<size_t>(std::ceil((x_max-x_min_) / resolution_), 1);
+        y_size_ = std::max<size_t>(std::ceil((y_max-y_min_) / resolution_), 1);
+
+        // Allocate the map and set all values to NaN.
+        map_.assign(x_size_ * y_size_, std::numeric_limits<double>::quiet_NaN());
+        if (statistics || reflectivity)
+        {
+            min_.assign(map_.size(), std::numeric_limits<double>::quiet_NaN());
+            mean_.assign(map_.size(), std::numeric_limits<double>::quiet_NaN());
+            variance_.assign(map_.size(), std::numeric_limits<double>::quiet_NaN());
+            count_.assign(map_.size(), 0u);
+        }
+        if (reflectivity)
+            reflectivity_.assign(map_.size(), std::numeric_limits<double>::quiet_NaN());
+    }
+
+
+    /// Resets the tile at the given position in the map data vector to the state without any points.
+    void reset(size_t i)
+    {
+        map_.writable(i) = std::numeric_limits<double>::quiet_NaN();
+        if (has_statistics())
+        {
+            min_.writable(i) = mean_.writable(i) = variance_.writable(i) = std::numeric_limits<double>::quiet_NaN();
+            count_.writable(i) = 0u;
+        }
+        if (has_reflectivity())
+            reflectivity_.writable(i) = std::numeric_limits<double>::quiet_NaN();
+    }
+
+
+    /// Copies the shared and external pages of all layers that merge() writes to at the given tile.
+    void detach(size_t i)
+    {
+        map_.detach(i);
+        if (has_statistics())
+        {
+            min_.detach(i);
+            mean_.detach(i);
+            variance_.detach(i);
+            count_.detach(i);
+        }
+        if (has_reflectivity())
+            reflectivity_.detach(i);
+    }
+
+
+    /// Implements match() using the nearest-valid elevation layer.
+    /// Points outside the map are clamped to the closest border tile, so every point has a valid tile index
+    /// and the loop is free of data-dependent branches.
+    double match_nearest(const pcl::PointCloud<PointType>& pc) const
+    {
+        const LayerBuffer<double>& nearest = nearest_;
+        const double inv_res = 1.0 / resolution_;
+        const double x_last = x_size_ - 1u;
+        const double y_last = y_size_ - 1u;
+
+        double d_total = 0.0;
+        unsigned int n = 0u;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            // Clamp the tile coordinates. NaN coordinates are clamped to zero.
+            const double fx = std::min(x_last, std::max(0.0, std::floor((pc[i].x - x_min_) * inv_res)));
+            const double fy = std::min(y_last, std::max(0.0, std::floor((pc[i].y - y_min_) * inv_res)));
+            const double dz = pc[i].z - nearest[(size_t)fx*y_size_ + (size_t)fy];
+
+            // Mask out NaN distances.
+            const bool valid = std::isfinite(dz);
+            d_total += valid ? std::max(0.0, dz) : 0.0;
+            n += valid;
+        }
+
+        return d_total / n;
+    }
+
+
+    /// Copies the given layer into a layer extended by n tiles on each side.
+    template<typename T>
+    void pad_layer(LayerBuffer<T>& layer, size_t n, T value) const
+    {
+        if (layer.empty())
+            return;
+
+        const size_t y_size = y_size_ + 2u*n;
+        std::vector<T> padded((x_size_ + 2u*n) * y_size, value);
+        for (size_t ix = 0u; ix < x_size_; ++ix)
+            for (size_t iy = 0u; iy < y_size_; ++iy)
+                padded[(ix+n)*y_size + n + iy] = layer[index(ix, iy)];
+        layer.assign(padded);
+    }
+
+
+    /// Nearest-neighbor lookup of a batch of points.
+    void elevation_nearest(const LayerBuffer<double>& data, const float* x, const float* y, float* out, size_t n,
+                           double offset_x, double offset_y) const
+    {
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        const double x_offset = offset_x - x_min_;
+        const double y_offset = offset_y - y_min_;
+        const double inv_res = 1.0 / resolution_;
+        const double x_size = x_size_;
+        const double y_size = y_size_;
+        const int y_stride = y_size_;
+
+        for (size_t i = 0u; i < n; ++i)
+        {
+            // Compute the continuous tile coordinates.
+            // All comparisons involving NaN coordinates are false, so NaN points are treated as lying outside.
+            const double fx = (x[i] + x_offset) * inv_res;
+            const double fy = (y[i] + y_offset) * inv_res;
+            const bool inside = fx >= 0.0 && fx < x_size && fy >= 0.0 && fy < y_size;
+
+            // Clamp the index of points outside the map to the first tile to keep the gather in bounds.
+            const int k = inside ? (int)fx*y_stride + (int)fy : 0;
+            const float e = data[k];
+            out[i] = inside ? e : nan;
+        }
+    }
+
+
+    /// Bilinear lookup of a batch of points.
+    void elevation_bilinear(const LayerBuffer<double>& data, const float* x, const float* y, float* out, size_t n,
+                            double offset_x, double offset_y) const
+    {
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        const double x_offset = offset_x - x_min_;
+        const double y_offset = offset_y - y_min_;
+        const double inv_res = 1.0 / resolution_;
+        const double x_size = x_size_;
+        const double y_size = y_size_;
+        const int x_last = x_size_ - 1;
+        const int y_last = y_size_ - 1;
+        const int y_stride = y_size_;
+
+        for (size_t i = 0u; i < n; ++i)
+        {
+            // Compute the tile coordinates relative to the tile centers.
+            const double fx = (x[i] + x_offset) * inv_res - 0.5;
+            const double fy = (y[i] + y_offset) * inv_res - 0.5;
+            const bool inside = fx >= -0.5 && fx < x_size-0.5 && fy >= -0.5 && fy < y_size-0.5;
+
+            // Compute the indices of the lower left tile and the interpolation weights.
+            // The index of points outside the map is set to the first tile to keep the gathers in bounds.
+            const double fx0 = inside ? std::floor(fx) : 0.0;
+            const double fy0 = inside ? std::floor(fy) : 0.0;
+            const float wx = inside ? fx - fx0 : 0.0;
+            const float wy = inside ? fy - fy0 : 0.0;
+            const int ix0 = fx0;
+            const int iy0 = fy0;
+
+            // Clamp the neighbor indices at the map borders. Neighbors outside the map get zero weight.
+            const int ix_a = std::max(ix0, 0);
+            const int iy_a = std::max(iy0, 0);
+            const int ix_b = std::min(ix0+1, x_last);
+            const int iy_b = std::min(iy0+1, y_last);
+            const float in_xa = ix0 >= 0 ? 1.0f : 0.0f;
+            const float in_ya = iy0 >= 0 ? 1.0f : 0.0f;
+            const float in_xb = ix0+1 <= x_last ? 1.0f : 0.0f;
+            const float in_yb = iy0+1 <= y_last ? 1.0f : 0.0f;
+
+            // Gather the four neighbors.
+            const float e_aa = data[ix_a*y_stride + iy_a];
+            const float e_ab = data[ix_a*y_stride + iy_b];
+            const float e_ba = data[ix_b*y_stride + iy_a];
+            const float e_bb = data[ix_b*y_stride + iy_b];
+
+            // Compute the weights of the neighbors. NaN tiles get zero weight.
+            const float w_aa = (1.0f-wx) * (1.0f-wy) * in_xa * in_ya * (std::isnan(e_aa) ? 0.0f : 1.0f);
+            const float w_ab = (1.0f-wx) * wy        * in_xa * in_yb * (std::isnan(e_ab) ? 0.0f : 1.0f);
+            const float w_ba = wx        * (1.0f-wy) * in_xb * in_ya * (std::isnan(e_ba) ? 0.0f : 1.0f);
+            const float w_bb = wx        * wy        * in_xb * in_yb * (std::isnan(e_bb) ? 0.0f : 1.0f);
+
+            // Compute the weighted mean of the valid neighbors.
+            const float w = w_aa + w_ab + w_ba + w_bb;
+            const float e = (w_aa > 0.0f ? w_aa*e_aa : 0.0f) + (w_ab > 0.0f ? w_ab*e_ab : 0.0f)
+                          + (w_ba > 0.0f ? w_ba*e_ba : 0.0f) + (w_bb > 0.0f ? w_bb*e_bb : 0.0f);
+            out[i] = inside && w > 0.0f ? e / w : nan;
+        }
     }
 
     /// Returns the index of the tile where the given point resides.
@@ -434,6 +2189,13 @@ protected:
 
 
 template<typename PointType> const double ElevationMap<PointType>::resolution_min = 0.001;
+template<typename PointType> const size_t ElevationMap<PointType>::block_size;
+template<typename PointType> const char ElevationMap<PointType>::file_magic[8] = "ELEVMAP";
+template<typename PointType> const uint32_t ElevationMap<PointType>::file_version;
+template<typename PointType> const uint32_t ElevationMap<PointType>::file_compressed;
+template<typename PointType> const uint32_t ElevationMap<PointType>::file_statistics;
+template<typename PointType> const uint32_t ElevationMap<PointType>::file_nearest;
+template<typename PointType> const uint32_t ElevationMap<PointType>::file_reflectivity;
 
 
 #endif
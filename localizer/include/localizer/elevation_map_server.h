@@ -0,0 +1,325 @@
+#ifndef ELEVATION_MAP_SERVER_H_
+#define ELEVATION_MAP_SERVER_H_ ELEVATION_MAP_SERVER_H_
+
+// Standard libraries.
+#include <string>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+
+// POSIX shared memory.
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+// ROS logging.
+#include <ros/console.h>
+
+// Localizer.
+#include "localizer/elevation_map.h"
+
+
+/// Control block at the start of the control segment of a shared elevation map.
+struct SharedMapControl
+{
+    /// Number of the current version of the map. Zero if no map has been published yet.
+    /// Accessed atomically by all processes.
+    uint64_t version;
+};
+
+
+/// Returns the name of the shared memory segment that holds the given version of a shared map.
+/// Version zero denotes the control segment.
+inline std::string shared_map_segment(const std::string& name, uint64_t version = 0u)
+{
+    std::stringstream segment;
+    segment << "/" << name;
+    if (version > 0u)
+        segment << "." << version;
+
+    return segment.str();
+}
+
+
+/// Publishes elevation maps in POSIX shared memory, so that several processes on one host use the same copy of
+/// the map instead of holding their own.
+/// Every published version of the map lives in its own segment named "/<name>.<version>" that holds the
+/// uncompressed map image written by ElevationMap::write_image(). The control segment "/<name>" holds the
+/// number of the current version. A new version is written completely before the version number is switched
+/// atomically. Then the name of the previous segment is removed; processes that still map the previous version
+/// keep using it, and the kernel frees its memory when the last of them releases it.
+/// Link against librt for shm_open().
+template<typename PointType>
+class ElevationMapServer
+{
+protected:
+    /// Name of the shared map.
+    std::string name_;
+
+    /// Mapped control block.
+    SharedMapControl* control_;
+
+    /// Version published by this server. Zero if none has been published yet.
+    uint64_t version_;
+
+
+public:
+    /// Constructor.
+    /// Creates the control segment or opens it, if it already exists. Version numbers continue from the
+    /// version published last, so clients never mistake a map of a new server for the one they hold.
+    /// \param[in] name name of the shared map without leading slash.
+    ElevationMapServer(const std::string& name)
+        : name_(name),
+          control_(NULL),
+          version_(0u)
+    {
+        const std::string segment = shared_map_segment(name_);
+        int fd = shm_open(segment.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(SharedMapControl)) != 0)
+        {
+            ROS_ERROR_STREAM("Failed to create shared memory segment \"" << segment << "\": "
+                             << std::strerror(errno) << ".");
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        void* control = mmap(NULL, sizeof(SharedMapControl), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (control == MAP_FAILED)
+        {
+            ROS_ERROR_STREAM("Failed to map shared memory segment \"" << segment << "\".");
+            return;
+        }
+
+        control_ = (SharedMapControl*)control;
+    }
+
+
+    /// Destructor.
+    /// Removes the segment of the current version. Clients keep the map they have already mapped.
+    ~ElevationMapServer()
+    {
+        if (version_ > 0u)
+            shm_unlink(shared_map_segment(name_, version_).c_str());
+
+        if (control_ != NULL)
+            munmap(control_, sizeof(SharedMapControl));
+    }
+
+
+    /// Publishes a copy of the given map as the new version of the shared map.
+    /// \return \c true if the map was published.
+    bool publish(const ElevationMap<PointType>& map)
+    {
+        if (control_ == NULL)
+            return false;
+
+        // Create the segment of the new version.
+        const uint64_t version = __atomic_load_n(&control_->version, __ATOMIC_ACQUIRE) + 1u;
+        const std::string segment = shared_map_segment(name_, version);
+        const size_t size = map.image_size();
+        int fd = shm_open(segment.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0)
+        {
+            ROS_ERROR_STREAM("Failed to create shared memory segment \"" << segment << "\": "
+                             << std::strerror(errno) << ".");
+            if (fd >= 0)
+            {
+                close(fd);
+                shm_unlink(segment.c_str());
+            }
+            return false;
+        }
+
+        void* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (image == MAP_FAILED)
+        {
+            ROS_ERROR_STREAM("Failed to map shared memory segment \"" << segment << "\".");
+            shm_unlink(segment.c_str());
+            return false;
+        }
+
+        // Write the map and switch the clients over to it.
+        map.write_image(image);
+        munmap(image, size);
+        __atomic_store_n(&control_->version, version, __ATOMIC_RELEASE);
+
+        // Remove the name of the previous version.
+        if (version_ > 0u)
+            shm_unlink(shared_map_segment(name_, version_).c_str());
+        version_ = version;
+
+        ROS_DEBUG_STREAM("Published version " << version << " of shared map \"" << name_ << "\".");
+        return true;
+    }
+
+
+    /// Returns the version published last by this server.
+    uint64_t version() const
+    {
+        return version_;
+    }
+};
+
+
+/// Maps the current version of an elevation map published by an ElevationMapServer read-only.
+/// The maps returned by read() refer directly to the shared memory; no tiles are copied. Each map keeps its
+/// segment mapped as long as the map or any of its copies exist, even if the server has moved on to a newer
+/// version. A client is meant to be polled by a single thread, which passes new maps on, for example to an
+/// RcuMap.
+template<typename PointType>
+class ElevationMapClient
+{
+protected:
+    /// Name of the shared map.
+    std::string name_;
+
+    /// Mapped control block. NULL until the server has created it.
+    const SharedMapControl* control_;
+
+    /// Most recent map.
+    boost::shared_ptr<const ElevationMap<PointType> > map_;
+
+    /// Version of the most recent map.
+    uint64_t version_;
+
+    /// Unmaps a shared memory segment when the last map referring to it is destroyed.
+    struct Unmapper
+    {
+        size_t size;
+
+        Unmapper(size_t size)
+            : size(size)
+        {
+        }
+
+        void operator()(const void* image) const
+        {
+            munmap(const_cast<void*>(image), size);
+        }
+    };
+
+
+public:
+    /// Constructor.
+    /// \param[in] name name of the shared map without leading slash.
+    ElevationMapClient(const std::string& name)
+        : name_(name),
+          control_(NULL),
+          version_(0u)
+    {
+    }
+
+
+    /// Destructor.
+    ~ElevationMapClient()
+    {
+        if (control_ != NULL)
+            munmap(const_cast<SharedMapControl*>(control_), sizeof(SharedMapControl));
+    }
+
+
+    /// Returns whether the server has published a version that differs from the one returned by read() last.
+    bool changed()
+    {
+        return open_control() && __atomic_load_n(&control_->version, __ATOMIC_ACQUIRE) != version_;
+    }
+
+
+    /// Returns the current version of the shared map.
+    /// If no map has been published yet, the pointer is empty. If the current version cannot be mapped, the
+    /// most recent map is returned.
+    boost::shared_ptr<const ElevationMap<PointType> > read()
+    {
+        if (!open_control())
+            return map_;
+
+        // The server may remove a version between reading its number and opening its segment.
+        // Then the number is read again.
+        const int n_attempts = 3;
+        for (int attempt = 0; attempt < n_attempts; ++attempt)
+        {
+            const uint64_t version = __atomic_load_n(&control_->version, __ATOMIC_ACQUIRE);
+            if (version == version_ || version == 0u)
+                return map_;
+
+            const std::string segment = shared_map_segment(name_, version);
+            int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                continue;
+
+            struct stat status;
+            void* image = MAP_FAILED;
+            if (fstat(fd, &status) == 0 && status.st_size > 0)
+                image = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (image == MAP_FAILED)
+            {
+                ROS_ERROR_STREAM("Failed to map shared memory segment \"" << segment << "\".");
+                return map_;
+            }
+
+            // Create a map that refers to the segment and unmaps it when the map is gone.
+            boost::shared_ptr<const void> owner(image, Unmapper(status.st_size));
+            boost::shared_ptr<ElevationMap<PointType> > map = boost::make_shared<ElevationMap<PointType> >();
+            if (!map->attach(image, status.st_size, owner))
+                return map_;
+
+            map_ = map;
+            version_ = version;
+            ROS_DEBUG_STREAM("Mapped version " << version << " of shared map \"" << name_ << "\".");
+            return map_;
+        }
+
+        return map_;
+    }
+
+
+    /// Returns the version of the map returned by read() last.
+    uint64_t version() const
+    {
+        return version_;
+    }
+
+
+protected:
+    /// Maps the control segment, if it is not mapped yet.
+    /// \return \c false if the server has not created the control segment yet.
+    bool open_control()
+    {
+        if (control_ != NULL)
+            return true;
+
+        int fd = shm_open(shared_map_segment(name_).c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+
+        // The server creates the segment before it sets its size. Reading a segment that is still too small
+        // would raise SIGBUS, so it counts as not created yet.
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(SharedMapControl))
+        {
+            close(fd);
+            return false;
+        }
+
+        void* control = mmap(NULL, sizeof(SharedMapControl), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (control == MAP_FAILED)
+            return false;
+
+        control_ = (const SharedMapControl*)control;
+        return true;
+    }
+};
+
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef ERROR_BOUND_H_
+#define ERROR_BOUND_H_ ERROR_BOUND_H_
+
+// Standard libraries.
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+
+// Boost.
+#include <boost/atomic.hpp>
+
+
+/// Lowest particle error found so far while the particles are scored concurrently.
+/// Scoring a particle can stop as soon as its partial error exceeds the lowest error plus a margin, since the
+/// particle can no longer get a significant weight. The lowest error is stored as the bit pattern of a
+/// nonnegative double: for nonnegative values, the order of the bit patterns equals the order of the values,
+/// so the minimum is updated by a lock-free compare-and-swap on an integer.
+class ErrorBound
+{
+protected:
+    /// Bit pattern of the lowest error.
+    boost::atomic<uint64_t> best_;
+
+    /// Margin above the lowest error. Infinite if the bound is disabled.
+    double margin_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] margin margin above the lowest error. Infinity disables the bound.
+    ErrorBound(double margin = std::numeric_limits<double>::infinity())
+        : best_(bits(std::numeric_limits<double>::infinity())),
+          margin_(margin)
+    {
+    }
+
+
+    /// Copy constructor.
+    ErrorBound(const ErrorBound& other)
+        : best_(other.best_.load(boost::memory_order_relaxed)),
+          margin_(other.margin_)
+    {
+    }
+
+
+    /// Assignment operator.
+    ErrorBound& operator=(const ErrorBound& other)
+    {
+        best_.store(other.best_.load(boost::memory_order_relaxed), boost::memory_order_relaxed);
+        margin_ = other.margin_;
+        return *this;
+    }
+
+
+    /// Sets the margin above the lowest error. Infinity disables the bound.
+    void set_margin(double margin)
+    {
+        margin_ = margin;
+    }
+
+
+    /// Returns the margin above the lowest error.
+    double get_margin() const
+    {
+        return margin_;
+    }
+
+
+    /// Returns whether the bound is enabled.
+    bool enabled() const
+    {
+        return margin_ < std::numeric_limits<double>::infinity();
+    }
+
+
+    /// Forgets the lowest error.
+    void reset()
+    {
+        best_.store(bits(std::numeric_limits<double>::infinity()), boost::memory_order_relaxed);
+    }
+
+
+    /// Returns the error above which scoring a particle can stop.
+    double get() const
+    {
+        return value(best_.load(boost::memory_order_relaxed)) + margin_;
+    }
+
+
+    /// Reports the error of a completely scored particle.
+    /// Errors that are negative or NaN are ignored.
+    void update(double error)
+    {
+        if (!(error >= 0.0))
+            return;
+
+        const uint64_t candidate = bits(error);
+        uint64_t current = best_.load(boost::memory_order_relaxed);
+        while (candidate < current && !best_.compare_exchange_weak(current, candidate, boost::memory_order_relaxed))
+        {
+        }
+    }
+
+
+protected:
+    /// Returns the bit pattern of the given double.
+    static uint64_t bits(double value)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+
+    /// Returns the double with the given bit pattern.
+    static double value(uint64_t bits)
+    {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef KDTREE_BATCH_H_
+#define KDTREE_BATCH_H_ KDTREE_BATCH_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Point Cloud Library.
+#include <pcl/point_cloud.h>
+#include <pcl/kdtree/kdtree_flann.h>
+
+
+/// Scratch memory for the batched queries of a KdTreeBatch.
+/// Every thread that queries the tree holds its own scratch memory, so the queries do not allocate memory once
+/// the buffers have reached the batch size.
+struct KdTreeBatchScratch
+{
+    /// Coordinates of the query points, three per point.
+    std::vector<float> queries;
+
+    /// Indices of the nearest neighbors.
+    std::vector<int> indices;
+
+    /// Squared distances to the nearest neighbors.
+    std::vector<float> distances;
+
+
+    /// Resizes the buffers to the given number of query points.
+    void resize(size_t n)
+    {
+        queries.resize(3u*n);
+        indices.resize(n);
+        distances.resize(n);
+    }
+};
+
+
+/// kd-tree that answers nearest-neighbor queries for batches of points.
+/// Extends pcl::KdTreeFLANN by queries that pass whole batches of points to FLANN at once instead of one
+/// point per call through std::vector parameters. The search for the nearest neighbor of a point is limited to
+/// a maximum distance, so FLANN prunes all branches of the tree beyond it.
+/// The tree must be built from a point cloud whose point representation consists of the x, y, and
+/// z-coordinates, which is the default for the PCL point types.
+template<typename PointType>
+class KdTreeBatch : public pcl::KdTreeFLANN<PointType>
+{
+public:
+    /// Constructor.
+    KdTreeBatch()
+        : pcl::KdTreeFLANN<PointType>(false)
+    {
+    }
+
+
+    /// Computes the distances from a batch of points to their nearest neighbors in the tree.
+    /// The queries are read from scratch.queries, the first n points of which must be set. Uses the approximation
+    /// factor set by setEpsilon().
+    /// \param[in] n number of query points.
+    /// \param[in] d_max maximum distance. Points without a neighbor within this distance yield d_max.
+    /// \param scratch scratch memory holding the query points.
+    /// \param[out] d distances to the nearest neighbors.
+    void nearest_distances(size_t n, float d_max, KdTreeBatchScratch& scratch, float* d) const
+    {
+        if (n == 0u)
+            return;
+
+        if (!this->flann_index_)
+        {
+            std::fill(d, d + n, d_max);
+            return;
+        }
+
+        // Search for the nearest neighbor within the maximum distance. FLANN works with squared distances and
+        // returns an infinite distance for points without a neighbor within the radius.
+        std::fill(scratch.distances.begin(), scratch.distances.begin() + n, std::numeric_limits<float>::infinity());
+        flann::Matrix<float> queries(&scratch.queries[0], n, 3u);
+        flann::Matrix<int> indices(&scratch.indices[0], n, 1u);
+        flann::Matrix<float> distances(&scratch.distances[0], n, 1u);
+        flann::SearchParams parameters(flann::FLANN_CHECKS_UNLIMITED, this->getEpsilon(), false);
+        parameters.max_neighbors = 1;
+        parameters.cores = 1;
+        this->flann_index_->radiusSearch(queries, indices, distances, d_max*d_max, parameters);
+
+        for (size_t i = 0u; i < n; ++i)
+            d[i] = std::min(d_max, std::sqrt(scratch.distances[i]));
+    }
+};
+
+
+#endif
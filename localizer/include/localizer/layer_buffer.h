@@ -0,0 +1,227 @@
+#ifndef LAYER_BUFFER_H_
+#define LAYER_BUFFER_H_ LAYER_BUFFER_H_
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
+
+
+/// Array that holds one layer of a grid map in pages of fixed size.
+/// Every page either belongs to the buffer, possibly shared with copies of the buffer, or refers to read-only
+/// memory owned by someone else, for example a shared memory segment. Read access works the same in all cases.
+/// Copying a buffer copies only the table of pages, so all pages are shared with the copy. The first write
+/// access to a page that is shared or external copies this page alone (copy-on-write), so a modified copy of a
+/// large layer costs memory and time only for the pages that were actually written to.
+template<typename T>
+class LayerBuffer
+{
+public:
+    /// Number of elements per page is 2^page_bits.
+    static const size_t page_bits = 10u;
+
+    /// Number of elements per page.
+    static const size_t page_size = (size_t)1u << page_bits;
+
+
+protected:
+    /// Pages that belong to the buffer. Empty for pages in external memory.
+    std::vector<boost::shared_array<T> > pages_;
+
+    /// First element of every page, either in a page of the buffer or in external memory.
+    std::vector<const T*> page_data_;
+
+    /// Number of elements.
+    size_t size_;
+
+    /// Number of pages in external memory.
+    size_t n_external_;
+
+    /// Keeps the external memory alive as long as any page refers to it.
+    boost::shared_ptr<const void> owner_;
+
+
+public:
+    /// Default constructor.
+    /// Creates an empty buffer.
+    LayerBuffer()
+        : size_(0u),
+          n_external_(0u)
+    {
+    }
+
+
+    /// Makes the buffer refer to the given external memory.
+    /// \param[in] data first element.
+    /// \param[in] size number of elements.
+    /// \param[in] owner object that keeps the memory alive; it is released when no page refers to the memory
+    /// anymore.
+    void view(const T* data, size_t size, const boost::shared_ptr<const void>& owner)
+    {
+        const size_t n_pages = (size + page_size-1u) / page_size;
+        pages_.assign(n_pages, boost::shared_array<T>());
+        page_data_.resize(n_pages);
+        for (size_t p = 0u; p < n_pages; ++p)
+            page_data_[p] = data + p*page_size;
+        size_ = size;
+        n_external_ = n_pages;
+        owner_ = n_pages > 0u ? owner : boost::shared_ptr<const void>();
+    }
+
+
+    /// Returns whether any page of the buffer refers to external memory.
+    bool is_view() const
+    {
+        return static_cast<bool>(owner_);
+    }
+
+
+    /// Sets the buffer to n copies of the given value.
+    void assign(size_t n, const T& value)
+    {
+        resize_pages(n);
+        for (size_t p = 0u; p < pages_.size(); ++p)
+            std::fill(pages_[p].get(), pages_[p].get() + page_length(p), value);
+    }
+
+
+    /// Sets the buffer to a copy of the given elements.
+    void assign(const std::vector<T>& elements)
+    {
+        resize_pages(elements.size());
+        for (size_t p = 0u; p < pages_.size(); ++p)
+            std::copy(elements.begin() + p*page_size, elements.begin() + p*page_size + page_length(p),
+                      pages_[p].get());
+    }
+
+
+    /// Copies all elements into the given vector.
+    void copy(std::vector<T>& elements) const
+    {
+        elements.resize(size_);
+        for (size_t p = 0u; p < page_data_.size(); ++p)
+            std::copy(page_data_[p], page_data_[p] + page_length(p), elements.begin() + p*page_size);
+    }
+
+
+    /// Removes all elements.
+    void clear()
+    {
+        pages_.clear();
+        page_data_.clear();
+        size_ = 0u;
+        n_external_ = 0u;
+        owner_.reset();
+    }
+
+
+    /// Returns the number of elements.
+    size_t size() const
+    {
+        return size_;
+    }
+
+
+    /// Returns whether the buffer is empty.
+    bool empty() const
+    {
+        return size_ == 0u;
+    }
+
+
+    /// Returns the number of pages.
+    size_t n_pages() const
+    {
+        return page_data_.size();
+    }
+
+
+    /// Returns the first element of the given page.
+    const T* page(size_t p) const
+    {
+        return page_data_[p];
+    }
+
+
+    /// Returns the number of elements of the given page. Only the last page may hold less than page_size.
+    size_t page_length(size_t p) const
+    {
+        return std::min(page_size, size_ - p*page_size);
+    }
+
+
+    /// Returns the number of elements stored contiguously from the given element to the end of its page.
+    size_t contiguous(size_t i) const
+    {
+        return std::min(size_, (i/page_size + 1u) * page_size) - i;
+    }
+
+
+    /// Read access.
+    const T& operator[](size_t i) const
+    {
+        return page_data_[i >> page_bits][i & (page_size-1u)];
+    }
+
+
+    /// Write access.
+    /// Copies the page of the element first if it is shared with another buffer or refers to external memory.
+    /// Different threads may write to the same page concurrently only after detach() was called for the page.
+    T& writable(size_t i)
+    {
+        return detach(i)[i & (page_size-1u)];
+    }
+
+
+    /// Makes sure the page of the given element belongs to this buffer alone, so it can be modified.
+    /// \return first element of the page.
+    T* detach(size_t i)
+    {
+        const size_t p = i >> page_bits;
+        boost::shared_array<T>& page = pages_[p];
+        if (page && page.unique())
+            return page.get();
+
+        // Copy the shared or external page.
+        const bool external = !page;
+        boost::shared_array<T> copy(new T[page_size]);
+        std::copy(page_data_[p], page_data_[p] + page_length(p), copy.get());
+        page.swap(copy);
+        page_data_[p] = page.get();
+
+        // Release the external memory once no page refers to it.
+        if (external && --n_external_ == 0u)
+            owner_.reset();
+
+        return page.get();
+    }
+
+
+protected:
+    /// Replaces all pages by new pages of this buffer that hold n elements.
+    void resize_pages(size_t n)
+    {
+        const size_t n_pages = (n + page_size-1u) / page_size;
+        pages_.resize(n_pages);
+        page_data_.resize(n_pages);
+        for (size_t p = 0u; p < n_pages; ++p)
+        {
+            pages_[p].reset(new T[page_size]);
+            page_data_[p] = pages_[p].get();
+        }
+        size_ = n;
+        n_external_ = 0u;
+        owner_.reset();
+    }
+};
+
+
+template<typename T> const size_t LayerBuffer<T>::page_bits;
+template<typename T> const size_t LayerBuffer<T>::page_size;
+
+
+#endif
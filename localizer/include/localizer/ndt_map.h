@@ -0,0 +1,290 @@
+#ifndef NDT_MAP_H_
+#define NDT_MAP_H_ NDT_MAP_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/unordered_map.hpp>
+
+// Eigen.
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
+
+// Point Cloud Library.
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// ROS.
+#include <ros/console.h>
+#include <tf/tf.h>
+
+// Localizer.
+#include "localizer/block_index.h"
+
+
+/// Normal distributions transform of a point cloud map.
+/// Divides the map into cubic voxels and approximates the points within every voxel by a normal distribution,
+/// stored as its mean and inverse covariance. A point is scored by the normal distribution of the voxel it falls
+/// into, which gives a smooth cost function even for voxels far larger than the spacing of the map points.
+/// The coordinates are stored relative to a voxel corner near the map, so they keep their precision as floats
+/// even for maps in UTM coordinates. Described in:
+/// Martin Magnusson.
+/// The Three-Dimensional Normal-Distributions Transform.
+/// PhD thesis, Orebro University, 2009.
+class NdtMap
+{
+protected:
+    /// Voxel indices relative to the origin must lie in [-voxel_limit, voxel_limit) to fit into a key.
+    static const long voxel_limit = 1l << 20;
+
+    /// Normal distribution of one voxel.
+    struct Gaussian
+    {
+        /// Mean relative to the origin.
+        float mean[3];
+
+        /// Upper triangle of the inverse covariance matrix: xx, xy, xz, yy, yz, zz.
+        float icov[6];
+
+        /// Weight of the distribution. Zero for the empty distribution.
+        float weight;
+    };
+
+
+    /// Edge length of the voxels.
+    double resolution_;
+
+    /// Inverse of the edge length of the voxels.
+    double inv_resolution_;
+
+    /// Corner of the voxel all coordinates are relative to.
+    tf::Vector3 origin_;
+
+    /// Maps the keys of the voxels with a normal distribution to the indices of their distributions.
+    BlockIndex index_;
+
+    /// Normal distributions of all voxels. The first entry is the empty distribution of voxels without one.
+    std::vector<Gaussian> gaussians_;
+
+
+public:
+    /// Constructor.
+    /// Computes the normal distributions of the given map.
+    /// \param[in] map point cloud map.
+    /// \param[in] resolution edge length of the voxels.
+    /// \param[in] min_points minimum number of points a voxel needs to get a normal distribution.
+    template<typename PointType>
+    NdtMap(const pcl::PointCloud<PointType>& map, double resolution, size_t min_points = 5u)
+        : resolution_(resolution),
+          inv_resolution_(1.0 / resolution),
+          origin_(0.0, 0.0, 0.0),
+          gaussians_(1u)
+    {
+        std::fill(gaussians_[0].mean, gaussians_[0].mean + 3, 0.0f);
+        std::fill(gaussians_[0].icov, gaussians_[0].icov + 6, 0.0f);
+        gaussians_[0].weight = 0.0f;
+
+        // Put the origin at the corner of the voxel of the first finite point.
+        size_t i = 0u;
+        while (i < map.size() && !pcl::isFinite(map[i]))
+            ++i;
+
+        if (i == map.size())
+            return;
+
+        origin_ = tf::Vector3(std::floor(map[i].x / resolution_) * resolution_,
+                              std::floor(map[i].y / resolution_) * resolution_,
+                              std::floor(map[i].z / resolution_) * resolution_);
+
+        // Accumulate the first and second moments of the points within every voxel.
+        boost::unordered_map<uint64_t, Moments> moments;
+        size_t n_outside = 0u;
+        for (; i < map.size(); ++i)
+        {
+            if (!pcl::isFinite(map[i]))
+                continue;
+
+            const Eigen::Vector3d p(map[i].x - origin_.x(), map[i].y - origin_.y(), map[i].z - origin_.z());
+            uint64_t k;
+            if (!key(p.x(), p.y(), p.z(), k))
+            {
+                n_outside++;
+                continue;
+            }
+
+            Moments& m = moments[k];
+            m.n++;
+            m.sum += p;
+            m.sum_squares += p * p.transpose();
+        }
+
+        if (n_outside > 0u)
+            ROS_WARN_STREAM(n_outside << " map points lie outside the range of the normal distributions transform.");
+
+        // Compute the normal distributions. The covariance matrices are regularized, so the distributions of
+        // voxels whose points lie on a plane or a line stay finite.
+        for (boost::unordered_map<uint64_t, Moments>::const_iterator it = moments.begin(); it != moments.end(); ++it)
+        {
+            const Moments& m = it->second;
+            if (m.n < std::max<size_t>(3u, min_points))
+                continue;
+
+            const Eigen::Vector3d mean = m.sum / m.n;
+            const Eigen::Matrix3d covariance = (m.sum_squares - m.n * mean * mean.transpose()) / (m.n - 1u);
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+            Eigen::Vector3d eigenvalues = solver.eigenvalues();
+            const double min_eigenvalue = std::max(1.0e-2 * eigenvalues.maxCoeff(),
+                                                   std::pow(1.0e-2 * resolution_, 2.0));
+            for (int e = 0; e < 3; ++e)
+                eigenvalues[e] = 1.0 / std::max(min_eigenvalue, eigenvalues[e]);
+            const Eigen::Matrix3d icov
+                = solver.eigenvectors() * eigenvalues.asDiagonal() * solver.eigenvectors().transpose();
+
+            Gaussian g;
+            for (int d = 0; d < 3; ++d)
+                g.mean[d] = mean[d];
+            g.icov[0] = icov(0, 0);
+            g.icov[1] = icov(0, 1);
+            g.icov[2] = icov(0, 2);
+            g.icov[3] = icov(1, 1);
+            g.icov[4] = icov(1, 2);
+            g.icov[5] = icov(2, 2);
+            g.weight = 1.0f;
+            index_.insert(it->first, gaussians_.size());
+            gaussians_.push_back(g);
+        }
+    }
+
+
+    /// Computes the sum of the costs of a batch of points.
+    /// The cost of a point is one minus the unnormalized density of the normal distribution of its voxel, so it
+    /// lies in [0, 1]. Points in voxels without a normal distribution cost one.
+    /// The points are given relative to an offset, so they keep their precision as floats. The distributions
+    /// are looked up point by point, and the densities are computed by a loop free of data-dependent branches,
+    /// which the compiler can vectorize.
+    /// \param[in] x x-coordinates of the points relative to the offset.
+    /// \param[in] y y-coordinates of the points relative to the offset.
+    /// \param[in] z z-coordinates of the points relative to the offset.
+    /// \param[in] n number of points, at most batch_size.
+    /// \param[in] offset position the coordinates of the points are relative to.
+    /// \return sum of the costs of the points.
+    float cost(const float* x, const float* y, const float* z, size_t n, const tf::Vector3& offset) const
+    {
+        float px[batch_size], py[batch_size], pz[batch_size];
+        float mx[batch_size], my[batch_size], mz[batch_size];
+        float ixx[batch_size], ixy[batch_size], ixz[batch_size], iyy[batch_size], iyz[batch_size], izz[batch_size];
+        float w[batch_size];
+
+        // Look up the normal distributions of the points.
+        const double ox = offset.x() - origin_.x();
+        const double oy = offset.y() - origin_.y();
+        const double oz = offset.z() - origin_.z();
+        for (size_t k = 0u; k < n; ++k)
+        {
+            const double dx = ox + x[k], dy = oy + y[k], dz = oz + z[k];
+            px[k] = dx;
+            py[k] = dy;
+            pz[k] = dz;
+
+            const Gaussian& g = gaussians_[find(dx, dy, dz)];
+            mx[k] = g.mean[0];
+            my[k] = g.mean[1];
+            mz[k] = g.mean[2];
+            ixx[k] = g.icov[0];
+            ixy[k] = g.icov[1];
+            ixz[k] = g.icov[2];
+            iyy[k] = g.icov[3];
+            iyz[k] = g.icov[4];
+            izz[k] = g.icov[5];
+            w[k] = g.weight;
+        }
+
+        // Evaluate the densities.
+        float total = 0.0f;
+        for (size_t k = 0u; k < n; ++k)
+        {
+            const float dx = px[k] - mx[k], dy = py[k] - my[k], dz = pz[k] - mz[k];
+            const float m = dx*(ixx[k]*dx + 2.0f*(ixy[k]*dy + ixz[k]*dz)) + dy*(iyy[k]*dy + 2.0f*iyz[k]*dz)
+                + dz*izz[k]*dz;
+            // Capping the exponent avoids the slow underflow path of exp() for points far from the mean.
+            total += 1.0f - w[k]*std::exp(-0.5f*std::min(m, 100.0f));
+        }
+
+        return total;
+    }
+
+
+    /// Returns the edge length of the voxels.
+    double get_resolution() const
+    {
+        return resolution_;
+    }
+
+
+    /// Returns the number of voxels with a normal distribution.
+    size_t n_voxels() const
+    {
+        return index_.size();
+    }
+
+
+    /// Maximum number of points per call to cost().
+    static const size_t batch_size = 64u;
+
+
+protected:
+    /// First and second moments of the points within one voxel.
+    struct Moments
+    {
+        size_t n;
+        Eigen::Vector3d sum;
+        Eigen::Matrix3d sum_squares;
+
+        Moments()
+            : n(0u),
+              sum(Eigen::Vector3d::Zero()),
+              sum_squares(Eigen::Matrix3d::Zero())
+        {
+        }
+    };
+
+
+    /// Returns the index of the normal distribution of the voxel that contains the given point.
+    /// \param[in] x x-coordinate of the point relative to the origin.
+    /// \param[in] y y-coordinate of the point relative to the origin.
+    /// \param[in] z z-coordinate of the point relative to the origin.
+    /// \return index of the distribution, zero if the voxel has none.
+    uint32_t find(double x, double y, double z) const
+    {
+        uint64_t k;
+        if (!key(x, y, z, k))
+            return 0u;
+
+        const uint32_t g = index_.find(k);
+        return g == BlockIndex::npos ? 0u : g;
+    }
+
+
+    /// Computes the key of the voxel that contains the given point.
+    /// The coordinates are shifted to positive values, so truncation rounds them down without calling floor().
+    /// \return \c false if the point is NaN or outside the range of the voxel indices.
+    bool key(double x, double y, double z, uint64_t& k) const
+    {
+        const double limit = 2.0 * voxel_limit;
+        const double fx = x * inv_resolution_ + voxel_limit;
+        const double fy = y * inv_resolution_ + voxel_limit;
+        const double fz = z * inv_resolution_ + voxel_limit;
+        if (!(fx >= 0.0 && fx < limit && fy >= 0.0 && fy < limit && fz >= 0.0 && fz < limit))
+            return false;
+
+        k = BlockIndex::key((long)fx - voxel_limit, (long)fy - voxel_limit, (long)fz - voxel_limit);
+        return true;
+    }
+};
+
+
+#endif
@@ -6,11 +6,14 @@
 
 // Boost.
 #include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
 
 // Particles, motion model, and sensor model.
 #include "localizer/particle.h"
 #include "localizer/motion_model.h"
 #include "localizer/sensor_model.h"
+#include "localizer/worker_pool.h"
+#include "localizer/particle_order.h"
 
 // Random number generators.
 #include "localizer/random_generators.h"
@@ -33,15 +36,59 @@ protected:
     /// Sensor model used for weighting the particles in the sensor integration step.
     boost::shared_ptr<SensorModelT> sensor_model_;
 
+    /// Worker threads passed to the sensor model.
+    boost::shared_ptr<WorkerPool> worker_pool_;
+
     /// Indicates whether the particle filter has been initialized.
     bool initialized_;
 
+    /// Edge length of the cells used to sort the particles spatially before they are scored. Zero disables the
+    /// sorting.
+    double sort_cell_size_;
+
 
 public:
     /// Default constructor.
+    /// Creates a worker pool with one worker per core.
     ParticleFilter()
-        : initialized_(false)
+        : worker_pool_(boost::make_shared<WorkerPool>()),
+          initialized_(false),
+          sort_cell_size_(0.5)
+    {
+    }
+
+
+    /// Sets the worker threads used by the sensor model.
+    void set_worker_pool(const boost::shared_ptr<WorkerPool>& worker_pool)
+    {
+        worker_pool_ = worker_pool;
+        if (sensor_model_)
+            sensor_model_->set_worker_pool(worker_pool_);
+    }
+
+
+    /// Replaces the worker threads by a new pool with the given number of workers.
+    /// \param[in] n_threads number of workers. Zero selects the number of cores.
+    /// \param[in] pin if true, the workers are pinned to cores.
+    void set_n_threads(unsigned int n_threads, bool pin = false)
+    {
+        set_worker_pool(boost::make_shared<WorkerPool>(n_threads, pin));
+    }
+
+
+    /// Returns the worker threads used by the sensor model.
+    boost::shared_ptr<WorkerPool> get_worker_pool() const
     {
+        return worker_pool_;
+    }
+
+
+    /// Sets the edge length of the cells used to sort the particles spatially before they are scored.
+    /// The particles are sorted along the Morton curve of their cells, so consecutive particles and the
+    /// particles of one worker look up the same parts of the map. Zero disables the sorting.
+    void set_sort_cell_size(double cell_size)
+    {
+        sort_cell_size_ = std::max(0.0, cell_size);
     }
 
 
@@ -70,13 +117,14 @@ public:
     void set_sensor_model(boost::shared_ptr<SensorModelT> sensor_model)
     {
         sensor_model_ = sensor_model;
+        sensor_model_->set_worker_pool(worker_pool_);
     }
 
 
     /// Sets the sensor model.
     void set_sensor_model(const SensorModelT& sensor_model)
     {
-        sensor_model_ = boost::shared_ptr<SensorModelT>(sensor_model);
+        set_sensor_model(boost::make_shared<SensorModelT>(sensor_model));
     }
 
 
@@ -130,17 +178,23 @@ public:
     /// Computes the localization errors for all particles according to the given sensor input.
     void integrate_measurement(const typename SensorModelT::Measurement& measurement)
     {
-        if (is_initialized())
-            sensor_model_->compute_particle_errors(measurement, particles_);
+        if (!is_initialized())
+            return;
+
+        sort_particles_morton(particles_, sort_cell_size_);
+        sensor_model_->compute_particle_errors(measurement, particles_);
     }
 
 
     /// Computes the localization errors of all particles from multiple sensor readings and resamples them.
     void integrate_measurements(const std::vector<typename SensorModelT::Measurement>& measurements)
     {
-        if (is_initialized())
-            for (size_t i = 0u; i < measurements.size(); ++i)
-                sensor_model_->compute_particle_errors(measurements[i], particles_);
+        if (!is_initialized())
+            return;
+
+        sort_particles_morton(particles_, sort_cell_size_);
+        for (size_t i = 0u; i < measurements.size(); ++i)
+            sensor_model_->compute_particle_errors(measurements[i], particles_);
     }
 
 
@@ -0,0 +1,80 @@
+#ifndef PARTICLE_ORDER_H_
+#define PARTICLE_ORDER_H_ PARTICLE_ORDER_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+
+// Particles.
+#include "localizer/particle.h"
+
+
+/// Spreads the bits of a 32-bit integer to the even bits of a 64-bit integer.
+inline uint64_t morton_spread(uint32_t v)
+{
+    uint64_t x = v;
+    x = (x | x << 16) & 0x0000ffff0000ffffull;
+    x = (x | x << 8)  & 0x00ff00ff00ff00ffull;
+    x = (x | x << 4)  & 0x0f0f0f0f0f0f0f0full;
+    x = (x | x << 2)  & 0x3333333333333333ull;
+    x = (x | x << 1)  & 0x5555555555555555ull;
+    return x;
+}
+
+
+/// Computes the Morton code of a 2D cell by interleaving the bits of its coordinates.
+/// Cells that are close to each other mostly get close codes, so sorting by the code groups nearby cells.
+inline uint64_t morton_code(uint32_t x, uint32_t y)
+{
+    return morton_spread(x) | morton_spread(y) << 1;
+}
+
+
+/// Sorts the particles along the Morton curve of their positions in the xy-plane.
+/// Consecutive particles then lie close to each other and look up the same parts of the map, which keeps the
+/// map in the caches when the particles are scored in order. As the worker pool hands contiguous ranges of
+/// particles to its workers, every worker also works on its own region of the map.
+/// Particles with NaN positions are moved to the end.
+/// \param[in,out] particles particles to sort.
+/// \param[in] cell_size edge length of the cells the positions are quantized to.
+inline void sort_particles_morton(std::vector<Particle>& particles, double cell_size)
+{
+    if (particles.size() < 2u || !(cell_size > 0.0))
+        return;
+
+    // Quantize the positions relative to the lower left corner of the bounding box of the particles.
+    double x_min = std::numeric_limits<double>::infinity();
+    double y_min = std::numeric_limits<double>::infinity();
+    for (size_t i = 0u; i < particles.size(); ++i)
+    {
+        x_min = std::min(x_min, particles[i].pose.getOrigin().x());
+        y_min = std::min(y_min, particles[i].pose.getOrigin().y());
+    }
+
+    const double limit = std::numeric_limits<uint32_t>::max();
+    std::vector<std::pair<uint64_t, uint32_t> > codes(particles.size());
+    for (size_t i = 0u; i < particles.size(); ++i)
+    {
+        const double cx = std::floor((particles[i].pose.getOrigin().x() - x_min) / cell_size);
+        const double cy = std::floor((particles[i].pose.getOrigin().y() - y_min) / cell_size);
+        const bool valid = cx >= 0.0 && cy >= 0.0;
+        codes[i].first = valid ? morton_code(std::min(limit, cx), std::min(limit, cy))
+                               : std::numeric_limits<uint64_t>::max();
+        codes[i].second = i;
+    }
+
+    std::sort(codes.begin(), codes.end());
+
+    std::vector<Particle> sorted;
+    sorted.reserve(particles.size());
+    for (size_t i = 0u; i < codes.size(); ++i)
+        sorted.push_back(particles[codes[i].second]);
+    particles.swap(sorted);
+}
+
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef POINT_INTENSITY_H_
+#define POINT_INTENSITY_H_ POINT_INTENSITY_H_
+
+// Standard libraries.
+#include <limits>
+
+// Boost.
+#include <boost/type_traits/integral_constant.hpp>
+
+
+/// Reads the intensity of points of any point type.
+/// Point types without an intensity field, like pcl::PointXYZ, yield NaN intensity, so code that optionally
+/// uses the intensity can be instantiated for all point types.
+template<typename PointType>
+class PointIntensity
+{
+protected:
+    /// Class with an intensity member.
+    struct Fallback
+    {
+        float intensity;
+    };
+
+    /// Class in which the name intensity is ambiguous if and only if the point type has an intensity member.
+    struct Probe : PointType, Fallback
+    {
+    };
+
+    /// Valid only if the given value is a pointer to a member of the given type.
+    template<typename T, T> struct Check;
+
+    /// Chosen if Probe::intensity unambiguously refers to Fallback::intensity.
+    template<typename T> static char (&test(Check<float Fallback::*, &T::intensity>*))[1];
+
+    /// Chosen otherwise.
+    template<typename T> static char (&test(...))[2];
+
+
+public:
+    /// Tells whether the point type has an intensity field.
+    static const bool available = sizeof(test<Probe>(0)) == 2u;
+
+
+    /// Returns the intensity of the given point, or NaN if the point type has no intensity field.
+    static double get(const PointType& point)
+    {
+        return get(point, boost::integral_constant<bool, available>());
+    }
+
+
+protected:
+    /// Returns the intensity of a point type with an intensity field.
+    static double get(const PointType& point, boost::true_type)
+    {
+        return point.intensity;
+    }
+
+
+    /// Returns NaN for a point type without an intensity field.
+    static double get(const PointType&, boost::false_type)
+    {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+
+template<typename PointType> const bool PointIntensity<PointType>::available;
+
+
+#endif
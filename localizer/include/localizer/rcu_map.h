@@ -0,0 +1,88 @@
+#ifndef RCU_MAP_H_
+#define RCU_MAP_H_ RCU_MAP_H_
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Localizer.
+#include "localizer/worker_pool.h"
+
+
+/// Read-copy-update container for maps that are read by many threads and updated by few.
+/// Readers take a snapshot of the current map and keep using it for as long as they hold the pointer.
+/// Writers modify a private copy of the map and publish it with an atomic pointer swap, so readers never
+/// wait for an update to finish and never observe a partially updated map.
+template<typename MapT>
+class RcuMap
+{
+protected:
+    /// Current version of the map.
+    boost::shared_ptr<const MapT> map_;
+
+    /// Serializes the writers.
+    boost::mutex writer_mutex_;
+
+
+public:
+    /// Constructor.
+    /// Stores a copy of the given map.
+    RcuMap(const MapT& map)
+        : map_(boost::make_shared<const MapT>(map))
+    {
+    }
+
+
+    /// Constructor.
+    /// Takes ownership of the given map.
+    RcuMap(const boost::shared_ptr<const MapT>& map)
+        : map_(map)
+    {
+    }
+
+
+    /// Returns a snapshot of the current map.
+    /// The snapshot remains valid and unchanged even if the map is updated in the meantime.
+    boost::shared_ptr<const MapT> read() const
+    {
+        return boost::atomic_load(&map_);
+    }
+
+
+    /// Replaces the current map with the given map.
+    void publish(const boost::shared_ptr<const MapT>& map)
+    {
+        boost::mutex::scoped_lock lock(writer_mutex_);
+        boost::atomic_store(&map_, map);
+    }
+
+
+    /// Merges the given point cloud into a copy of the current map and publishes the result.
+    /// The set of dirty blocks of the published map contains exactly the blocks touched by this update.
+    /// The copy shares the pages of all layers with the current map, see LayerBuffer, and the update copies only
+    /// the pages it writes to. So the cost of an update depends on the size of the point cloud, not on the size
+    /// of the map.
+    /// \param[in] pc point cloud in the map frame.
+    /// \param[in] replace if true, the tiles hit by the point cloud are overwritten instead of raised.
+    /// \param[in] pool workers that merge large point clouds in parallel. If NULL, the calling thread merges them.
+    /// \return number of points merged into the map.
+    template<typename PointCloudT>
+    size_t update(const PointCloudT& pc, bool replace = false, WorkerPool* pool = NULL)
+    {
+        boost::mutex::scoped_lock lock(writer_mutex_);
+
+        // Copy the current map, sharing its pages, and apply the update to the copy.
+        boost::shared_ptr<MapT> map = boost::make_shared<MapT>(*boost::atomic_load(&map_));
+        map->clear_dirty_blocks();
+        size_t n = map->update(pc, replace, pool);
+
+        // Swap the updated map in.
+        boost::atomic_store(&map_, boost::shared_ptr<const MapT>(map));
+
+        return n;
+    }
+};
+
+
+#endif
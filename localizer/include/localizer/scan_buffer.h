@@ -0,0 +1,258 @@
+#ifndef SCAN_BUFFER_H_
+#define SCAN_BUFFER_H_ SCAN_BUFFER_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Boost.
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+// ROS coordinate transformations.
+#include <tf/tf.h>
+
+
+/// Point cloud stored as structure of arrays.
+/// Holds the x, y, and z coordinates of the points in three contiguous arrays, so the scoring kernels process
+/// the points with unit-stride loads that the compiler can vectorize. The intensities of the points are stored
+/// in a fourth array if the point cloud provides them.
+class ScanBuffer
+{
+protected:
+    /// x-coordinates of the points.
+    std::vector<float> x_;
+
+    /// y-coordinates of the points.
+    std::vector<float> y_;
+
+    /// z-coordinates of the points.
+    std::vector<float> z_;
+
+    /// Intensities of the points. Empty if the point cloud has no intensities.
+    std::vector<float> intensity_;
+
+
+public:
+    /// Default constructor.
+    /// Creates an empty buffer.
+    ScanBuffer()
+    {
+    }
+
+
+    /// Constructor.
+    /// Copies the coordinates of the given point cloud.
+    template<typename PointType>
+    ScanBuffer(const pcl::PointCloud<PointType>& pc)
+    {
+        assign(pc);
+    }
+
+
+    /// Copies the coordinates of the given point cloud.
+    template<typename PointType>
+    void assign(const pcl::PointCloud<PointType>& pc)
+    {
+        intensity_.clear();
+        resize(pc.size());
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            x_[i] = pc[i].x;
+            y_[i] = pc[i].y;
+            z_[i] = pc[i].z;
+        }
+    }
+
+
+    /// Copies the coordinates and the intensities of the given point cloud.
+    void assign(const pcl::PointCloud<pcl::PointXYZI>& pc)
+    {
+        intensity_.resize(pc.size());
+        resize(pc.size());
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            x_[i] = pc[i].x;
+            y_[i] = pc[i].y;
+            z_[i] = pc[i].z;
+            intensity_[i] = pc[i].intensity;
+        }
+    }
+
+
+    /// Sets the buffer to the given scan rotated about the z-axis by the given angle.
+    /// The intensities do not change under rotation and are not copied; they are read from the given scan.
+    void rotate_z(const ScanBuffer& scan, double yaw)
+    {
+        intensity_.clear();
+        resize(scan.size());
+        const float c = std::cos(yaw);
+        const float s = std::sin(yaw);
+        for (size_t i = 0u; i < x_.size(); ++i)
+        {
+            x_[i] = c*scan.x_[i] - s*scan.y_[i];
+            y_[i] = s*scan.x_[i] + c*scan.y_[i];
+            z_[i] = scan.z_[i];
+        }
+    }
+
+
+    /// Sets the buffer to the given scan rotated by the rotation part of the given transform.
+    /// The translation is left out, so the coordinates stay small and keep their precision as floats. The
+    /// intensities are not copied, like in rotate_z().
+    void rotate(const ScanBuffer& scan, const tf::Transform& transform)
+    {
+        intensity_.clear();
+        resize(scan.size());
+        const tf::Matrix3x3& r = transform.getBasis();
+        const tf::Vector3 r0 = r.getRow(0), r1 = r.getRow(1), r2 = r.getRow(2);
+        const float r00 = r0.x(), r01 = r0.y(), r02 = r0.z();
+        const float r10 = r1.x(), r11 = r1.y(), r12 = r1.z();
+        const float r20 = r2.x(), r21 = r2.y(), r22 = r2.z();
+        for (size_t i = 0u; i < x_.size(); ++i)
+        {
+            const float x = scan.x_[i], y = scan.y_[i], z = scan.z_[i];
+            x_[i] = r00*x + r01*y + r02*z;
+            y_[i] = r10*x + r11*y + r12*z;
+            z_[i] = r20*x + r21*y + r22*z;
+        }
+    }
+
+
+    /// Puts the points in random order.
+    /// Scoring functions that stop early then see a representative sample of the scan in the points they
+    /// have processed.
+    /// \param[in,out] engine random number engine that draws the order.
+    void shuffle(boost::random::mt19937& engine)
+    {
+        // Draw a uniformly distributed permutation by the Fisher-Yates shuffle.
+        std::vector<size_t> order(size());
+        for (size_t i = 0u; i < order.size(); ++i)
+            order[i] = i;
+        for (size_t i = order.size(); i > 1u; --i)
+            std::swap(order[i-1u], order[boost::random::uniform_int_distribution<size_t>(0u, i-1u)(engine)]);
+
+        ScanBuffer shuffled;
+        shuffled.resize(size());
+        for (size_t i = 0u; i < order.size(); ++i)
+        {
+            shuffled.x_[i] = x_[order[i]];
+            shuffled.y_[i] = y_[order[i]];
+            shuffled.z_[i] = z_[order[i]];
+        }
+        if (has_intensity())
+        {
+            shuffled.intensity_.resize(size());
+            for (size_t i = 0u; i < order.size(); ++i)
+                shuffled.intensity_[i] = intensity_[order[i]];
+        }
+        swap(shuffled);
+    }
+
+
+    /// Swaps the contents of two buffers.
+    void swap(ScanBuffer& other)
+    {
+        x_.swap(other.x_);
+        y_.swap(other.y_);
+        z_.swap(other.z_);
+        intensity_.swap(other.intensity_);
+    }
+
+
+    /// Resizes the buffer to the given number of points.
+    /// The intensities are resized only if the buffer has them.
+    void resize(size_t n)
+    {
+        x_.resize(n);
+        y_.resize(n);
+        z_.resize(n);
+        if (!intensity_.empty())
+            intensity_.resize(n);
+    }
+
+
+    /// Returns the number of points.
+    size_t size() const
+    {
+        return x_.size();
+    }
+
+
+    /// Returns whether the buffer is empty.
+    bool empty() const
+    {
+        return x_.empty();
+    }
+
+
+    /// Returns whether the buffer holds the intensities of its points.
+    bool has_intensity() const
+    {
+        return !intensity_.empty();
+    }
+
+
+    /// Returns the x-coordinates of the points.
+    const float* x() const
+    {
+        return x_.empty() ? NULL : &x_[0];
+    }
+
+
+    /// Returns the x-coordinates of the points.
+    float* x()
+    {
+        return x_.empty() ? NULL : &x_[0];
+    }
+
+
+    /// Returns the y-coordinates of the points.
+    const float* y() const
+    {
+        return y_.empty() ? NULL : &y_[0];
+    }
+
+
+    /// Returns the y-coordinates of the points.
+    float* y()
+    {
+        return y_.empty() ? NULL : &y_[0];
+    }
+
+
+    /// Returns the z-coordinates of the points.
+    const float* z() const
+    {
+        return z_.empty() ? NULL : &z_[0];
+    }
+
+
+    /// Returns the z-coordinates of the points.
+    float* z()
+    {
+        return z_.empty() ? NULL : &z_[0];
+    }
+
+
+    /// Returns the intensities of the points or NULL, if the buffer has no intensities.
+    const float* intensity() const
+    {
+        return intensity_.empty() ? NULL : &intensity_[0];
+    }
+
+
+    /// Returns the intensities of the points or NULL, if the buffer has no intensities.
+    float* intensity()
+    {
+        return intensity_.empty() ? NULL : &intensity_[0];
+    }
+};
+
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef SCORE_CACHE_H_
+#define SCORE_CACHE_H_ SCORE_CACHE_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+
+// ROS coordinate transformations.
+#include <tf/tf.h>
+
+
+/// Hash table that assigns the particles scored against one measurement to bins of quantized poses.
+/// The first particle that claims a bin becomes its representative; all other particles in the bin reuse the
+/// error of the representative. The workers claim bins concurrently: the slots of the open-addressing table are
+/// claimed by a lock-free compare-and-swap on a single 64-bit tag, which holds the epoch of the slot in its
+/// upper 16 bits and a 48-bit fingerprint of the bin in the lower 48 bits. Starting a new epoch invalidates all
+/// slots at once without touching the table.
+class ScoreCache
+{
+protected:
+    /// Number of bits of the fingerprint of a bin.
+    static const int fingerprint_bits = 48;
+
+    /// Tags of all slots. The number of slots is a power of two.
+    boost::scoped_array<boost::atomic<uint64_t> > tags_;
+
+    /// Errors of the bins of all slots. Written and read in separate phases, not concurrently with the claims.
+    std::vector<double> errors_;
+
+    /// Number of slots.
+    size_t size_;
+
+    /// Current epoch. Never zero, so slots of a new table are never valid.
+    uint64_t epoch_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] capacity number of bins the table can hold.
+    ScoreCache(size_t capacity = 1024u)
+        : size_(0u),
+          epoch_(1u)
+    {
+        reserve(capacity);
+    }
+
+
+    /// Copy constructor.
+    /// Creates an empty table of the same size.
+    ScoreCache(const ScoreCache& other)
+        : size_(0u),
+          epoch_(1u)
+    {
+        reserve(other.size_ / 2u);
+    }
+
+
+    /// Assignment operator.
+    /// Makes the table empty and at least as large as the other one.
+    ScoreCache& operator=(const ScoreCache& other)
+    {
+        reserve(other.size_ / 2u);
+        new_epoch();
+        return *this;
+    }
+
+
+    /// Makes sure the table holds the given number of bins at a load factor of at most one half.
+    /// Must not be called concurrently with claim(). Growing the table clears it.
+    /// \return \c true if the table has grown.
+    bool reserve(size_t capacity)
+    {
+        size_t size = 64u;
+        while (size < 2u*capacity)
+            size *= 2u;
+
+        if (size <= size_)
+            return false;
+
+        tags_.reset(new boost::atomic<uint64_t>[size]);
+        for (size_t s = 0u; s < size; ++s)
+            tags_[s].store(0u, boost::memory_order_relaxed);
+        errors_.assign(size, 0.0);
+        size_ = size;
+        epoch_ = 1u;
+        return true;
+    }
+
+
+    /// Returns the number of slots.
+    size_t size() const
+    {
+        return size_;
+    }
+
+
+    /// Invalidates all bins.
+    /// Must not be called concurrently with claim().
+    void new_epoch()
+    {
+        // On overflow of the epoch, the tags are cleared.
+        if (++epoch_ >= (uint64_t)1u << (64 - fingerprint_bits))
+        {
+            for (size_t s = 0u; s < size_; ++s)
+                tags_[s].store(0u, boost::memory_order_relaxed);
+            epoch_ = 1u;
+        }
+    }
+
+
+    /// Claims the slot of the bin with the given key in the current epoch.
+    /// Can be called concurrently. The table must hold all bins claimed in the epoch, see reserve().
+    /// \param[in] key key of the bin, see key().
+    /// \param[out] first \c true if the caller claimed the bin first and has to compute its error.
+    /// \return slot of the bin.
+    size_t claim(uint64_t key, bool& first)
+    {
+        const uint64_t h = hash(key);
+        const uint64_t fingerprint_mask = ((uint64_t)1u << fingerprint_bits) - 1u;
+        const uint64_t tag = epoch_ << fingerprint_bits | (h & fingerprint_mask);
+        const size_t mask = size_ - 1u;
+        for (size_t s = (h >> fingerprint_bits ^ h) & mask; ; s = (s + 1u) & mask)
+        {
+            uint64_t current = tags_[s].load(boost::memory_order_relaxed);
+            while (current >> fingerprint_bits != epoch_)
+            {
+                // The slot is empty or stale. Try to claim it. On failure, current holds the new tag.
+                if (tags_[s].compare_exchange_weak(current, tag, boost::memory_order_relaxed))
+                {
+                    first = true;
+                    return s;
+                }
+            }
+
+            if (current == tag)
+            {
+                first = false;
+                return s;
+            }
+        }
+    }
+
+
+    /// Stores the error of the bin in the given slot.
+    void set_error(size_t slot, double error)
+    {
+        errors_[slot] = error;
+    }
+
+
+    /// Returns the error of the bin in the given slot.
+    double get_error(size_t slot) const
+    {
+        return errors_[slot];
+    }
+
+
+    /// Computes the key of the bin of the given pose.
+    /// The position is quantized in x, y, and z, and the orientation by its roll, pitch, and yaw angles. The
+    /// quantized coordinates are mixed into a 64-bit key, so different bins share a key with negligible
+    /// probability.
+    /// \param[in] pose pose of a particle.
+    /// \param[in] position_bin_size edge length of the position bins.
+    /// \param[in] angle_bin_size width of the angle bins in radians.
+    static uint64_t key(const tf::Transform& pose, double position_bin_size, double angle_bin_size)
+    {
+        double roll, pitch, yaw;
+        tf::Matrix3x3(pose.getRotation()).getRPY(roll, pitch, yaw);
+        const tf::Vector3& p = pose.getOrigin();
+        const double bins[6] = {p.x() / position_bin_size, p.y() / position_bin_size, p.z() / position_bin_size,
+                                roll / angle_bin_size, pitch / angle_bin_size, yaw / angle_bin_size};
+
+        uint64_t key = 0u;
+        for (int b = 0; b < 6; ++b)
+            key = hash(key ^ (uint64_t)(int64_t)std::floor(bins[b] + 0.5));
+
+        return key;
+    }
+
+
+protected:
+    /// Scrambles the bits of the key.
+    /// This is the finalizer of the SplitMix64 generator.
+    static uint64_t hash(uint64_t key)
+    {
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+        return key ^ (key >> 31);
+    }
+};
+
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef SCORING_TERM_H_
+#define SCORING_TERM_H_ SCORING_TERM_H_
+
+// Standard libraries.
+#include <cmath>
+#include <algorithm>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+
+// ROS.
+#include <ros/console.h>
+#include <tf/tf.h>
+
+// Maps.
+#include "elevation_map.h"
+#include "localizer/rcu_map.h"
+#include "localizer/ndt_map.h"
+#include "localizer/distance_field.h"
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model_elevation.h"
+
+
+/// Part of the error of a particle computed from the points of a scan in the map frame.
+/// SensorModelComposite transforms the points of a scan once per particle and passes them batch by batch to all
+/// of its terms. The points of a batch are given relative to an offset, the position of the particle, so they
+/// keep their precision as floats; the terms apply the offset in double precision. The intensities of the
+/// points are passed along if the scan has them.
+class ScoringTerm
+{
+public:
+    /// Virtual destructor.
+    virtual ~ScoringTerm()
+    {
+    }
+
+
+    /// Prepares the term for scoring the particles with a new measurement.
+    /// Called once per measurement before any particle is scored.
+    virtual void begin_measurement()
+    {
+    }
+
+
+    /// Adjusts the pose of a particle before it is scored.
+    /// Called concurrently for different particles.
+    virtual void prepare_particle(Particle& particle) const
+    {
+    }
+
+
+    /// Computes the sum of the nonnegative costs of a batch of points.
+    /// Called concurrently for different particles.
+    /// \param[in] x x-coordinates of the points relative to the offset.
+    /// \param[in] y y-coordinates of the points relative to the offset.
+    /// \param[in] z z-coordinates of the points relative to the offset.
+    /// \param[in] intensity intensities of the points or NULL, if the scan has no intensities.
+    /// \param[in] n number of points.
+    /// \param[in] offset position the coordinates of the points are relative to.
+    /// \return sum of the costs of the points.
+    virtual double cost(const float* x, const float* y, const float* z, const float* intensity, size_t n,
+                        const tf::Vector3& offset) const = 0;
+};
+
+
+/// Scoring term of the elevation model: the distance in z-direction between the points and the elevation map.
+/// Puts the particles on the ground of the map before they are scored, like SensorModelElevation.
+class ElevationTerm : public ScoringTerm
+{
+protected:
+    /// Handle of the elevation map, which can be updated while the particles are scored.
+    boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > > map_;
+
+    /// Snapshot of the map taken for the current measurement.
+    boost::shared_ptr<const ElevationMap<pcl::PointXYZI> > snapshot_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] map handle of the elevation map.
+    ElevationTerm(const boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > >& map)
+        : map_(map)
+    {
+    }
+
+
+    /// Takes a snapshot of the map.
+    virtual void begin_measurement()
+    {
+        snapshot_ = map_->read();
+    }
+
+
+    /// Puts the particle on the ground of the map.
+    virtual void prepare_particle(Particle& particle) const
+    {
+        SensorModelElevation::correct_z(*snapshot_, particle);
+    }
+
+
+    /// Computes the sum of the distances in z-direction between the points and the map.
+    /// Points without a valid distance count with the mean distance of the batch.
+    virtual double cost(const float* x, const float* y, const float* z, const float* intensity, size_t n,
+                        const tf::Vector3& offset) const
+    {
+        const double e = snapshot_->match(x, y, z, n, offset.x(), offset.y(), offset.z());
+        return std::isfinite(e) ? e * n : 0.0;
+    }
+};
+
+
+/// Scoring term of the normal distributions transform: one minus the density of the normal distribution of
+/// the map voxel of every point.
+class NdtTerm : public ScoringTerm
+{
+protected:
+    /// Normal distributions transform of the map.
+    boost::shared_ptr<const NdtMap> map_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] map normal distributions transform of the map.
+    NdtTerm(const boost::shared_ptr<const NdtMap>& map)
+        : map_(map)
+    {
+    }
+
+
+    /// Computes the sum of the costs of the points.
+    virtual double cost(const float* x, const float* y, const float* z, const float* intensity, size_t n,
+                        const tf::Vector3& offset) const
+    {
+        double total = 0.0;
+        for (size_t begin = 0u; begin < n; begin += NdtMap::batch_size)
+        {
+            const size_t m = std::min(n - begin, NdtMap::batch_size);
+            total += map_->cost(x + begin, y + begin, z + begin, m, offset);
+        }
+
+        return total;
+    }
+};
+
+
+/// Scoring term of the endpoint model: the capped distance between the points and the map, looked up in a
+/// distance field.
+class DistanceFieldTerm : public ScoringTerm
+{
+protected:
+    /// Distance field of the map.
+    boost::shared_ptr<const DistanceField3d> field_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] field distance field of the map.
+    DistanceFieldTerm(const boost::shared_ptr<const DistanceField3d>& field)
+        : field_(field)
+    {
+    }
+
+
+    /// Computes the sum of the capped distances between the points and the map.
+    virtual double cost(const float* x, const float* y, const float* z, const float* intensity, size_t n,
+                        const tf::Vector3& offset) const
+    {
+        double total = 0.0;
+        for (size_t k = 0u; k < n; ++k)
+            total += field_->distance(offset.x() + x[k], offset.y() + y[k], offset.z() + z[k]);
+
+        return total;
+    }
+};
+
+
+/// Scoring term of the reflectivity layer of the elevation map: the capped difference between the intensity of
+/// every point and the mean intensity of its map tile.
+/// Highly reflective surfaces like retro-reflective markers stand out in both the scan and the map, so this term
+/// discriminates poses that the geometry of the scene alone leaves ambiguous. The intensities of the scan must be
+/// on the same scale as those of the point cloud the map was built from.
+class IntensityTerm : public ScoringTerm
+{
+protected:
+    /// Handle of the elevation map, which can be updated while the particles are scored.
+    boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > > map_;
+
+    /// Snapshot of the map taken for the current measurement.
+    boost::shared_ptr<const ElevationMap<pcl::PointXYZI> > snapshot_;
+
+    /// Intensity difference at which the cost of a point reaches its maximum of one.
+    double scale_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] map handle of the elevation map. The map must store the reflectivity layer.
+    /// \param[in] scale intensity difference at which the cost of a point reaches its maximum of one.
+    IntensityTerm(const boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > >& map, double scale)
+        : map_(map),
+          scale_(scale)
+    {
+        if (!map_->read()->has_reflectivity())
+            ROS_WARN("The elevation map has no reflectivity layer. All points get the maximum intensity cost.");
+    }
+
+
+    /// Takes a snapshot of the map.
+    virtual void begin_measurement()
+    {
+        snapshot_ = map_->read();
+    }
+
+
+    /// Computes the sum of the capped intensity differences between the points and the map.
+    /// Without intensities, the scan carries no information for this term, and the cost is zero.
+    virtual double cost(const float* x, const float* y, const float* z, const float* intensity, size_t n,
+                        const tf::Vector3& offset) const
+    {
+        if (intensity == NULL)
+            return 0.0;
+
+        return snapshot_->match_reflectivity(x, y, intensity, n, offset.x(), offset.y(), scale_);
+    }
+};
+
+
+#endif
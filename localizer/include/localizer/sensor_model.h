@@ -1,9 +1,19 @@
 #ifndef SENSOR_MODEL_H_
 #define SENSOR_MODEL_H_ SENSOR_MODEL_H_
 
+// Standard libraries.
+#include <vector>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
 // Particles used by the particle filter.
 #include <localizer/particle.h>
 
+// Worker threads.
+#include "localizer/worker_pool.h"
+
 
 /// Sensor model for use with the ParticleFilter class for robot localization.
 template<typename MeasurementT>
@@ -15,10 +25,40 @@ public:
     typedef MeasurementT Measurement;
 
 
+protected:
+    /// Worker threads used to compute the particle errors in parallel.
+    boost::shared_ptr<WorkerPool> worker_pool_;
+
+
 public:
+    /// Virtual destructor.
+    virtual ~SensorModel()
+    {
+    }
+
+
     /// Computes the weights of the particles
     /// according to the given measurement.
     virtual void compute_particle_errors(const MeasurementT& measurement, std::vector<Particle>& particles) = 0;
+
+
+    /// Sets the worker threads used to compute the particle errors.
+    /// The pool can be shared with other sensor models, as long as they are not used concurrently.
+    void set_worker_pool(const boost::shared_ptr<WorkerPool>& worker_pool)
+    {
+        worker_pool_ = worker_pool;
+    }
+
+
+    /// Returns the worker threads used to compute the particle errors.
+    /// If no pool has been set, a pool with one worker per core is created on the first call.
+    boost::shared_ptr<WorkerPool> get_worker_pool()
+    {
+        if (!worker_pool_)
+            worker_pool_ = boost::make_shared<WorkerPool>();
+
+        return worker_pool_;
+    }
 };
 
 
@@ -0,0 +1,227 @@
+#ifndef SENSOR_MODEL_BEAM_H_
+#define SENSOR_MODEL_BEAM_H_ SENSOR_MODEL_BEAM_H_
+
+// Enable/disable multithreading.
+#define MULTITHREADING true
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Boost.
+#include <boost/bind.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+
+// ROS.
+#include <ros/console.h>
+#include <sensor_msgs/LaserScan.h>
+#include <tf/tf.h>
+
+// Elevation map.
+#include "elevation_map.h"
+#include "localizer/directional_distance_table.h"
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+
+
+/// Determines the weight of a particle by comparing a 2D laser scan to the ranges expected from an elevation
+/// map using the beam model.
+/// The beam model compares every measured range to the range expected along the beam, and it explains ranges
+/// shorter than expected by unmapped obstacles, which makes it robust against dynamic obstacles. The expected
+/// ranges are looked up in a directional distance table of the obstacles of the map instead of marching along
+/// every beam. The obstacles are the map tiles whose elevation reaches a given height.
+/// The error of a particle is the mean negative log-likelihood of the scored beams.
+class SensorModelBeam : public SensorModel<sensor_msgs::LaserScan>
+{
+protected:
+    /// Expected ranges of the obstacles of the map.
+    DirectionalDistanceTable table_;
+
+    /// Pose of the laser scanner in the robot frame. Only the 2D part is used.
+    tf::Transform laser_pose_;
+
+    /// Maximum number of beams scored per scan.
+    size_t max_beams_;
+
+    /// Weights of the four components of the beam model: measurement noise, unexpected obstacles, maximum range
+    /// readings, and random measurements.
+    double z_hit_, z_short_, z_max_, z_rand_;
+
+    /// Standard deviation of the measurement noise.
+    double sigma_hit_;
+
+    /// Rate of the exponential distribution of the ranges of unexpected obstacles.
+    double lambda_short_;
+
+    /// Direction of every scored beam of the current scan in the robot frame.
+    std::vector<float> beam_angle_;
+
+    /// Measured range of every scored beam of the current scan. Maximum range readings hold the maximum range.
+    std::vector<float> beam_range_;
+
+    /// Maximum range of the current scan.
+    float range_max_;
+
+
+public:
+    /// Constructor.
+    /// Computes the directional distance table of the given map.
+    /// \param[in] map elevation map.
+    /// \param[in] z_obstacle tiles with an elevation at or above this height are obstacles.
+    /// \param[in] n_theta number of directions over half a circle the table distinguishes.
+    /// \param[in] max_range maximum range of the laser scanner.
+    /// \param[in] max_beams maximum number of beams scored per scan. The beams are evenly subsampled.
+    SensorModelBeam(const ElevationMap<pcl::PointXYZI>& map, double z_obstacle, size_t n_theta = 360u,
+                    double max_range = 30.0, size_t max_beams = 60u)
+        : laser_pose_(tf::Transform::getIdentity()),
+          max_beams_(std::max<size_t>(1u, max_beams)),
+          z_hit_(0.8),
+          z_short_(0.1),
+          z_max_(0.05),
+          z_rand_(0.05),
+          sigma_hit_(0.2),
+          lambda_short_(0.1),
+          range_max_(max_range)
+    {
+        // NaN tiles are free.
+        std::vector<unsigned char> occupied(map.x_size() * map.y_size());
+        for (size_t ix = 0u; ix < map.x_size(); ++ix)
+            for (size_t iy = 0u; iy < map.y_size(); ++iy)
+                occupied[ix*map.y_size() + iy] = map.elevation(ix, iy) >= z_obstacle;
+
+        table_ = DirectionalDistanceTable(occupied, map.x_size(), map.y_size(), map.resolution(), map.x_min(),
+                                          map.y_min(), n_theta, max_range);
+    }
+
+
+    /// Sets the pose of the laser scanner in the robot frame.
+    /// Only the position in the xy-plane and the yaw angle are used.
+    void set_laser_pose(const tf::Transform& laser_pose)
+    {
+        laser_pose_ = laser_pose;
+    }
+
+
+    /// Sets the parameters of the beam model.
+    /// The weights are normalized to sum to one.
+    /// \param[in] z_hit weight of the Gaussian measurement noise.
+    /// \param[in] z_short weight of unexpected obstacles.
+    /// \param[in] z_max weight of maximum range readings.
+    /// \param[in] z_rand weight of random measurements.
+    /// \param[in] sigma_hit standard deviation of the measurement noise in meters.
+    /// \param[in] lambda_short rate of the exponential distribution of the ranges of unexpected obstacles.
+    void set_model_parameters(double z_hit, double z_short, double z_max, double z_rand, double sigma_hit,
+                              double lambda_short)
+    {
+        const double sum = z_hit + z_short + z_max + z_rand;
+        if (!(sum > 0.0 && z_max > 0.0 && z_rand > 0.0 && sigma_hit > 0.0 && lambda_short > 0.0))
+        {
+            ROS_ERROR("Invalid beam model parameters. The weights of maximum range readings and random "
+                      "measurements, the standard deviation, and the rate must be positive.");
+            return;
+        }
+
+        z_hit_ = z_hit / sum;
+        z_short_ = z_short / sum;
+        z_max_ = z_max / sum;
+        z_rand_ = z_rand / sum;
+        sigma_hit_ = sigma_hit;
+        lambda_short_ = lambda_short;
+    }
+
+
+    /// Computes the errors of all particles based on the beam model and the given laser scan.
+    /// \param[in] scan laser scan.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const sensor_msgs::LaserScan& scan, std::vector<Particle>& particles)
+    {
+        // Select the beams to score.
+        const size_t stride = std::max<size_t>(1u, (scan.ranges.size() + max_beams_-1u) / max_beams_);
+        const double yaw_laser = tf::getYaw(laser_pose_.getRotation());
+        range_max_ = std::min<float>(scan.range_max, table_.get_max_range());
+        beam_angle_.clear();
+        beam_range_.clear();
+        for (size_t i = 0u; i < scan.ranges.size(); i += stride)
+        {
+            // Comparisons involving NaN are false, so NaN ranges are skipped, while infinite ranges count as
+            // maximum range readings.
+            const float r = scan.ranges[i];
+            if (!(r >= scan.range_min))
+                continue;
+
+            beam_angle_.push_back(yaw_laser + scan.angle_min + i*scan.angle_increment);
+            beam_range_.push_back(std::min(r, range_max_));
+        }
+
+        // Without any valid beam, the scan tells nothing about the particles, so their errors are left unchanged.
+        if (beam_range_.empty())
+            return;
+
+        // Compute the particle errors.
+        if (MULTITHREADING)
+        {
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelBeam::compute_particle_errors_range,
+                                       this,
+                                       boost::ref(particles), _1, _2));
+        }
+        else
+            compute_particle_errors_range(particles, 0u, particles.size());
+    }
+
+
+protected:
+    /// Computes the errors of a range of particles.
+    /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_range(std::vector<Particle>& particles, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(particles[i]);
+    }
+
+
+    /// Computes the error of a particle: the mean negative log-likelihood of the beams of the current scan.
+    virtual void compute_particle_error(Particle& particle) const
+    {
+        // Compute the pose of the laser scanner in the map frame.
+        const double yaw = tf::getYaw(particle.pose.getRotation());
+        const double c = std::cos(yaw);
+        const double s = std::sin(yaw);
+        const double x = particle.pose.getOrigin().x() + c*laser_pose_.getOrigin().x()
+            - s*laser_pose_.getOrigin().y();
+        const double y = particle.pose.getOrigin().y() + s*laser_pose_.getOrigin().x()
+            + c*laser_pose_.getOrigin().y();
+
+        const float norm_hit = z_hit_ / (std::sqrt(2.0*M_PI) * sigma_hit_);
+        const float inv_var = 1.0 / (2.0*sigma_hit_*sigma_hit_);
+        const float p_rand = z_rand_ / range_max_;
+        const float lambda = lambda_short_;
+        double total = 0.0;
+        for (size_t k = 0u; k < beam_range_.size(); ++k)
+        {
+            const float z = beam_range_[k];
+            const float z_exp = std::min(range_max_, table_.distance(x, y, yaw + beam_angle_[k]));
+            const bool max_reading = z >= range_max_;
+
+            // Mix the likelihoods of the four components.
+            const float dz = z - z_exp;
+            float p = max_reading ? z_max_ : norm_hit*std::exp(-dz*dz*inv_var) + p_rand;
+            if (!max_reading && z < z_exp)
+                p += z_short_ * lambda*std::exp(-lambda*z) / (1.0f - std::exp(-lambda*z_exp));
+
+            total -= std::log(p);
+        }
+
+        particle.error = total / beam_range_.size();
+    }
+};
+
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef SENSOR_MODEL_CACHED_H_
+#define SENSOR_MODEL_CACHED_H_ SENSOR_MODEL_CACHED_H_
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+
+// ROS.
+#include <ros/console.h>
+#include <ros/time.h>
+#include <tf/tf.h>
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+#include "localizer/score_cache.h"
+
+
+/// Scores only one particle per bin of quantized poses using another sensor model.
+/// After resampling, many particles are copies of the same particle that the motion model moved by small
+/// amounts, so they end up at nearly the same pose. This model assigns the particles to bins of quantized
+/// poses, scores the first particle of every bin with the given sensor model, and passes its error to all
+/// other particles in the bin. The bins are valid for one measurement: a new epoch of the cache starts when a
+/// measurement with a new time stamp or sequence number arrives, so particles scored again against the same
+/// measurement in a later cycle reuse the errors of the earlier cycle. Measurements without a time stamp always
+/// start a new epoch.
+/// If the sensor model also adjusts the poses of the particles, like the elevation model does with the
+/// z-coordinate, the adjusted coordinates of the scored particle are copied to all other particles in its bin.
+/// \tparam SensorModelT sensor model that computes the errors.
+template<typename SensorModelT>
+class SensorModelCached : public SensorModel<typename SensorModelT::Measurement>
+{
+public:
+    /// Measurement of the sensor model.
+    typedef typename SensorModelT::Measurement Measurement;
+
+
+protected:
+    /// Sensor model that computes the errors.
+    boost::shared_ptr<SensorModelT> sensor_model_;
+
+    /// Edge length of the position bins.
+    double position_bin_size_;
+
+    /// Width of the angle bins in radians.
+    double angle_bin_size_;
+
+    /// Bins of the current measurement.
+    ScoreCache cache_;
+
+    /// Slot of the bin of every particle.
+    std::vector<size_t> slots_;
+
+    /// Indicates for every particle whether it is the first particle of its bin.
+    std::vector<unsigned char> first_;
+
+    /// Pose coordinates that the sensor model adjusted when scoring the first particle of a bin.
+    struct Adjustment
+    {
+        /// Bits 0 to 2 flag the adjusted x, y, and z-coordinates, bit 3 the adjusted orientation.
+        unsigned char flags;
+
+        /// Adjusted position.
+        tf::Vector3 origin;
+
+        /// Adjusted orientation.
+        tf::Quaternion rotation;
+    };
+
+    /// Adjustment of the bin in every slot of the cache.
+    std::vector<Adjustment> adjustments_;
+
+    /// Time stamp of the measurement of the current epoch.
+    uint64_t stamp_;
+
+    /// Sequence number of the measurement of the current epoch.
+    uint32_t seq_;
+
+    /// Number of bins claimed in the current epoch.
+    size_t n_bins_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] sensor_model sensor model that computes the errors.
+    /// \param[in] position_bin_size edge length of the position bins.
+    /// \param[in] angle_bin_size width of the angle bins in radians.
+    SensorModelCached(const boost::shared_ptr<SensorModelT>& sensor_model, double position_bin_size = 0.02,
+                      double angle_bin_size = 0.005)
+        : sensor_model_(sensor_model),
+          position_bin_size_(position_bin_size),
+          angle_bin_size_(angle_bin_size),
+          stamp_(0u),
+          seq_(0u),
+          n_bins_(0u)
+    {
+    }
+
+
+    /// Returns the sensor model that computes the errors.
+    boost::shared_ptr<SensorModelT> get_sensor_model() const
+    {
+        return sensor_model_;
+    }
+
+
+    /// Computes the errors of all particles, scoring one particle per bin.
+    /// \param[in] measurement measurement of the sensor.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const Measurement& measurement, std::vector<Particle>& particles)
+    {
+        sensor_model_->set_worker_pool(this->get_worker_pool());
+
+        // Start a new epoch for a new measurement.
+        const uint64_t stamp = nanoseconds(measurement.header.stamp);
+        if (stamp == 0u || stamp != stamp_ || measurement.header.seq != seq_)
+        {
+            cache_.new_epoch();
+            stamp_ = stamp;
+            seq_ = measurement.header.seq;
+            n_bins_ = 0u;
+        }
+
+        // Assign the particles to the bins. The cache must hold the bins of earlier calls in the same epoch as
+        // well; growing it clears them. The adjustments need one entry per slot, also for the initial table.
+        if (cache_.reserve(n_bins_ + particles.size()))
+            n_bins_ = 0u;
+        if (adjustments_.size() != cache_.size())
+            adjustments_.resize(cache_.size());
+        slots_.resize(particles.size());
+        first_.resize(particles.size());
+        this->get_worker_pool()->run(particles.size(), boost::bind(&SensorModelCached::claim_range, this,
+                                                                   boost::cref(particles), _1, _2), 256u);
+
+        // Score the first particle of every bin.
+        std::vector<Particle> scored;
+        std::vector<size_t> indices;
+        for (size_t i = 0u; i < particles.size(); ++i)
+            if (first_[i])
+            {
+                indices.push_back(i);
+                scored.push_back(particles[i]);
+            }
+
+        sensor_model_->compute_particle_errors(measurement, scored);
+        n_bins_ += scored.size();
+        for (size_t k = 0u; k < scored.size(); ++k)
+        {
+            const size_t slot = slots_[indices[k]];
+            cache_.set_error(slot, scored[k].error);
+
+            // Record which coordinates of the pose the sensor model adjusted.
+            const tf::Vector3& before = particles[indices[k]].pose.getOrigin();
+            const tf::Vector3& after = scored[k].pose.getOrigin();
+            const tf::Quaternion q_before = particles[indices[k]].pose.getRotation();
+            const tf::Quaternion q_after = scored[k].pose.getRotation();
+            Adjustment& adjustment = adjustments_[slot];
+            adjustment.flags = (after.x() != before.x()) | (after.y() != before.y()) << 1
+                | (after.z() != before.z()) << 2
+                | (q_after.x() != q_before.x() || q_after.y() != q_before.y() || q_after.z() != q_before.z()
+                   || q_after.w() != q_before.w()) << 3;
+            adjustment.origin = after;
+            adjustment.rotation = q_after;
+
+            particles[indices[k]] = scored[k];
+        }
+
+        // Pass the errors and the adjusted coordinates to the other particles of the bins.
+        for (size_t i = 0u; i < particles.size(); ++i)
+            if (!first_[i])
+            {
+                particles[i].error = cache_.get_error(slots_[i]);
+                adjust(adjustments_[slots_[i]], particles[i].pose);
+            }
+
+        ROS_DEBUG_STREAM("Scored " << scored.size() << " of " << particles.size() << " particles.");
+    }
+
+
+protected:
+    /// Claims the bins of a range of particles.
+    /// \param[in] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void claim_range(const std::vector<Particle>& particles, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            bool first;
+            slots_[i] = cache_.claim(ScoreCache::key(particles[i].pose, position_bin_size_, angle_bin_size_), first);
+            first_[i] = first;
+        }
+    }
+
+
+    /// Copies the adjusted coordinates of the first particle of a bin to the given pose.
+    static void adjust(const Adjustment& adjustment, tf::Transform& pose)
+    {
+        if (adjustment.flags == 0u)
+            return;
+
+        const tf::Vector3& p = pose.getOrigin();
+        pose.setOrigin(tf::Vector3((adjustment.flags & 1u) ? adjustment.origin.x() : p.x(),
+                                   (adjustment.flags & 2u) ? adjustment.origin.y() : p.y(),
+                                   (adjustment.flags & 4u) ? adjustment.origin.z() : p.z()));
+        if (adjustment.flags & 8u)
+            pose.setRotation(adjustment.rotation);
+    }
+
+
+    /// Returns the time stamp of a ROS message in nanoseconds.
+    static uint64_t nanoseconds(const ros::Time& stamp)
+    {
+        return stamp.toNSec();
+    }
+
+
+    /// Returns the time stamp of a PCL point cloud, which is given in microseconds.
+    static uint64_t nanoseconds(uint64_t stamp)
+    {
+        return stamp * 1000u;
+    }
+};
+
+
+#endif
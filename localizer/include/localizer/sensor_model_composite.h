@@ -0,0 +1,200 @@
+#ifndef SENSOR_MODEL_COMPOSITE_H_
+#define SENSOR_MODEL_COMPOSITE_H_ SENSOR_MODEL_COMPOSITE_H_
+
+// Enable/disable multithreading.
+#define MULTITHREADING true
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+
+// Boost.
+#include <boost/bind.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/shared_ptr.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+// ROS.
+#include <ros/console.h>
+#include <tf/tf.h>
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+#include "localizer/error_bound.h"
+#include "localizer/scan_buffer.h"
+#include "localizer/scoring_term.h"
+#include "localizer/voxel_downsampler.h"
+
+
+/// Determines the weight of a particle by the weighted sum of several scoring terms evaluated on the same
+/// point cloud.
+/// Running several sensor models one after the other transforms the point cloud once per model and particle and
+/// starts one parallel pass per model. This model transforms the points once per particle and passes every
+/// batch of transformed points to all terms, so the pose-dependent work is shared and all terms are evaluated
+/// in one parallel pass. The intensities of the points do not depend on the pose and are passed to the terms
+/// as they are.
+/// The error of a particle is the sum over the terms of the weight times the mean cost of the points.
+class SensorModelComposite : public SensorModel<pcl::PointCloud<pcl::PointXYZI> >
+{
+protected:
+    /// Scoring terms.
+    std::vector<boost::shared_ptr<ScoringTerm> > terms_;
+
+    /// Weights of the scoring terms.
+    std::vector<double> weights_;
+
+    /// Downsamples the incoming point clouds.
+    VoxelDownsampler downsampler_;
+
+    /// Point cloud of the current measurement. Kept to reuse its memory.
+    ScanBuffer scan_;
+
+    /// Lowest particle error of the current measurement plus the margin above which scoring stops early.
+    ErrorBound bound_;
+
+    /// Random number engine that puts the points of the scan in random order.
+    boost::random::mt19937 shuffle_engine_;
+
+    /// Number of points transformed at once.
+    static const size_t batch_size = 64u;
+
+
+public:
+    /// Constructor.
+    /// \param[in] scan_resolution voxel edge length used to downsample the incoming point clouds. Zero disables
+    /// the downsampling.
+    SensorModelComposite(double scan_resolution = 0.0)
+        : downsampler_(scan_resolution)
+    {
+    }
+
+
+    /// Adds a scoring term.
+    /// \param[in] term scoring term.
+    /// \param[in] weight weight of the mean cost of the term in the error of a particle. Must be nonnegative.
+    void add_term(const boost::shared_ptr<ScoringTerm>& term, double weight = 1.0)
+    {
+        if (!(weight >= 0.0))
+        {
+            ROS_ERROR_STREAM("Invalid scoring term weight " << weight << ". The weight must be nonnegative.");
+            return;
+        }
+
+        terms_.push_back(term);
+        weights_.push_back(weight);
+    }
+
+
+    /// Enables or disables early termination of the particle scoring.
+    /// If enabled, the points are processed in random order, and the scoring of a particle stops as soon as its
+    /// partial error exceeds the lowest complete error of the current measurement plus the margin.
+    /// \param[in] margin margin above the lowest error. Infinity disables early termination.
+    void set_error_bound_margin(double margin)
+    {
+        bound_.set_margin(std::max(0.0, margin));
+    }
+
+
+    /// Computes the errors of all particles based on the scoring terms and the measured point cloud.
+    /// \param[in] pc_robot measured point cloud in the robot frame of reference.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const pcl::PointCloud<pcl::PointXYZI>& pc_robot,
+                                         std::vector<Particle>& particles)
+    {
+        // Downsample the point cloud provided by the robot. The downsampling also removes NaN points.
+        scan_.assign(pc_robot);
+        if (downsampler_.get_leaf_size() > 0.0)
+            downsampler_.downsample(scan_, *get_worker_pool());
+        if (bound_.enabled())
+            scan_.shuffle(shuffle_engine_);
+        bound_.reset();
+
+        for (size_t t = 0u; t < terms_.size(); ++t)
+            terms_[t]->begin_measurement();
+
+        // Compute the particle errors.
+        if (MULTITHREADING)
+        {
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelComposite::compute_particle_errors_range,
+                                       this,
+                                       boost::cref(scan_), boost::ref(particles), _1, _2));
+        }
+        else
+            compute_particle_errors_range(scan_, particles, 0u, particles.size());
+    }
+
+
+protected:
+    /// Computes the errors of a range of particles.
+    /// \param[in] scan point cloud in the robot frame.
+    /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_range(const ScanBuffer& scan, std::vector<Particle>& particles, size_t begin,
+                                       size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(scan, particles[i]);
+    }
+
+
+    /// Computes the error of a particle.
+    /// The points are rotated into the map frame batch by batch, and every batch is scored by all terms. The
+    /// translation is passed to the terms separately, so the rotated coordinates keep their precision as floats.
+    /// \param[in] scan point cloud in the robot frame.
+    /// \param[in,out] particle particle whose error is computed.
+    virtual void compute_particle_error(const ScanBuffer& scan, Particle& particle)
+    {
+        for (size_t t = 0u; t < terms_.size(); ++t)
+            terms_[t]->prepare_particle(particle);
+
+        const tf::Matrix3x3& r = particle.pose.getBasis();
+        const tf::Vector3 r0 = r.getRow(0), r1 = r.getRow(1), r2 = r.getRow(2);
+        const float r00 = r0.x(), r01 = r0.y(), r02 = r0.z();
+        const float r10 = r1.x(), r11 = r1.y(), r12 = r1.z();
+        const float r20 = r2.x(), r21 = r2.y(), r22 = r2.z();
+
+        // The weighted costs are nonnegative, so the sum divided by the number of all points is a lower bound of
+        // the error.
+        const double cost_bound = bound_.get() * scan.size();
+
+        float x[batch_size], y[batch_size], z[batch_size];
+        double total = 0.0;
+        for (size_t begin = 0u; begin < scan.size(); begin += batch_size)
+        {
+            // Stop early if the particle cannot come close to the best one.
+            if (total > cost_bound)
+            {
+                particle.error = total / scan.size();
+                bound_.update(particle.error);
+                return;
+            }
+
+            const size_t n = std::min<size_t>(batch_size, scan.size() - begin);
+            const float* sx = scan.x() + begin;
+            const float* sy = scan.y() + begin;
+            const float* sz = scan.z() + begin;
+            const float* si = scan.has_intensity() ? scan.intensity() + begin : NULL;
+            for (size_t k = 0u; k < n; ++k)
+            {
+                x[k] = r00*sx[k] + r01*sy[k] + r02*sz[k];
+                y[k] = r10*sx[k] + r11*sy[k] + r12*sz[k];
+                z[k] = r20*sx[k] + r21*sy[k] + r22*sz[k];
+            }
+
+            for (size_t t = 0u; t < terms_.size(); ++t)
+                total += weights_[t] * terms_[t]->cost(x, y, z, si, n, particle.pose.getOrigin());
+        }
+
+        particle.error = total / scan.size();
+        bound_.update(particle.error);
+    }
+};
+
+
+#endif
@@ -9,9 +9,13 @@
 
 // Standard libraries.
 #include <vector>
+#include <map>
+#include <cmath>
+#include <limits>
 
 // Boost.
 #include <boost/thread.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 // Point Cloud Library.
 #include <pcl/point_types.h>
@@ -23,6 +27,9 @@
 
 // Elevation map.
 #include "elevation_map.h"
+#include "localizer/rcu_map.h"
+#include "localizer/scan_buffer.h"
+#include "localizer/error_bound.h"
 
 // Particle filter.
 #include "localizer/particle.h"
@@ -35,18 +42,87 @@ class SensorModelElevation : public SensorModel<pcl::PointCloud<pcl::PointXYZI>
 {
 protected:
     /// Given elevation map.
-    ElevationMap<pcl::PointXYZI> map_;
+    /// The map can be updated while the particle errors are computed. Every call to compute_particle_errors()
+    /// works on the snapshot of the map that was current when the call started.
+    boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > > map_;
+
+    /// Width of the yaw bins in radians. Zero disables the yaw bins.
+    double yaw_bin_size_;
+
+    /// Lowest particle error of the current measurement plus the margin above which scoring stops early.
+    ErrorBound bound_;
+
+    /// Random number engine that puts the points of the scan in random order.
+    boost::random::mt19937 shuffle_engine_;
 
 
 public:
     /// Constructor.
     /// \param[in] map global elevation map.
     SensorModelElevation(const ElevationMap<pcl::PointXYZI>& map)
-        : map_(map)
+        : map_(new RcuMap<ElevationMap<pcl::PointXYZI> >(map)),
+          yaw_bin_size_(0.0)
     {
         // Save the elevation map to file.
         if (SAVE_FILES)
-            map_.save("map.csv");
+            map.save_csv("map.csv");
+    }
+
+
+    /// Constructor.
+    /// \param[in] map handle of the global elevation map, shared with the components that update the map.
+    SensorModelElevation(const boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > >& map)
+        : map_(map),
+          yaw_bin_size_(0.0)
+    {
+    }
+
+
+    /// Returns the handle of the elevation map.
+    boost::shared_ptr<RcuMap<ElevationMap<pcl::PointXYZI> > > get_map() const
+    {
+        return map_;
+    }
+
+
+    /// Sets the width of the yaw bins.
+    /// If the width is positive, the yaw angles of the particles are rounded to multiples of the width. The point
+    /// cloud is rotated once per occupied bin, and every particle only translates the rotated point cloud of its
+    /// bin. This trades an orientation error of at most half the bin width for the per-particle rotation.
+    /// Particles with a nonzero roll or pitch angle are always scored with their exact pose.
+    /// \param[in] yaw_bin_size width of the yaw bins in radians, for example 0.25 degrees. Zero disables the
+    /// yaw bins.
+    void set_yaw_bin_size(double yaw_bin_size)
+    {
+        yaw_bin_size_ = std::max(0.0, yaw_bin_size);
+    }
+
+
+    /// Returns the width of the yaw bins in radians. Zero if the yaw bins are disabled.
+    double get_yaw_bin_size() const
+    {
+        return yaw_bin_size_;
+    }
+
+
+    /// Enables or disables early termination of the particle scoring.
+    /// If enabled, the points are processed in random order, and the scoring of a particle stops as soon as its
+    /// partial error exceeds the lowest complete error of the current measurement plus the margin. Then the
+    /// particle gets a lower bound of its error, which still exceeds the lowest error by more than the margin.
+    /// \param[in] margin margin above the lowest error. Infinity disables early termination.
+    void set_error_bound_margin(double margin)
+    {
+        bound_.set_margin(std::max(0.0, margin));
+    }
+
+
+    /// Merges the given point cloud into the elevation map without blocking concurrent particle weighting.
+    /// Large point clouds are merged on the worker pool of the model once it is free.
+    /// \param[in] pc point cloud in the map frame.
+    /// \param[in] replace if true, the tiles hit by the point cloud are overwritten instead of raised.
+    size_t update_map(const pcl::PointCloud<pcl::PointXYZI>& pc, bool replace = true)
+    {
+        return map_->update(pc, replace, get_worker_pool().get());
     }
 
 
@@ -56,40 +132,52 @@ public:
     virtual void compute_particle_errors(const pcl::PointCloud<pcl::PointXYZI>& pc,
                                          std::vector<Particle>& particles)
     {
+        // Take a snapshot of the map.
+        boost::shared_ptr<const ElevationMap<pcl::PointXYZI> > map = map_->read();
+
         // Compute the particle weights.
-        if (MULTITHREADING)
+        if (yaw_bin_size_ > 0.0 || bound_.enabled())
+            compute_particle_errors_scan(*map, pc, particles);
+        else if (MULTITHREADING)
         {
-            // Compute the errors of the individual particles in parallel. Use as many threads as cores are available.
-            boost::thread_group threads;
-            int n_threads = boost::thread::hardware_concurrency();
-            for (int t = 0; t < n_threads; t++)
-                threads.create_thread(boost::bind(
-                                          &SensorModelElevation::compute_particle_errors_thread,
-                                          this,
-                                          boost::cref(pc), boost::ref(particles), t));
-
-            // Wait for the threads to return.
-            threads.join_all();
+            // Compute the errors of the individual particles in parallel using the worker threads.
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelElevation::compute_particle_errors_range,
+                                       this,
+                                       boost::cref(*map), boost::cref(pc), boost::ref(particles), _1, _2));
         }
         else
         {
             // Compute the errors of all particles using one thread.
             for (size_t i = 0u; i < particles.size(); ++i)
-                compute_particle_error(pc, particles[i]);
+                compute_particle_error(*map, pc, particles[i]);
         }
     }
 
 
+    /// Adjust the z-position of the particle to make sure the robot stands on the ground.
+    static void correct_z(const ElevationMap<pcl::PointXYZI>& map, Particle& particle)
+    {
+        // Compute the height of the local ground plane of the map relative to the map frame.
+        double z_ground = map.z_ground(particle.pose.getOrigin().getX(), particle.pose.getOrigin().getY(), 2.0, 0.2);
+
+        // Add the distance from the ground to the robot base to the computed z-coordinate and assign it to the
+        // particle's z-position.
+        particle.pose.getOrigin().setZ(z_ground + 0.955);
+    }
+
+
     /// Computes the distance in z-direction between the map and the point cloud in the frames of all particles.
     std::vector<double> get_dz(const pcl::PointCloud<pcl::PointXYZI>& pc_robot, std::vector<Particle>& particles)
     {
+        boost::shared_ptr<const ElevationMap<pcl::PointXYZI> > map = map_->read();
         std::vector<double> dz(particles.size(), std::numeric_limits<double>::quiet_NaN());
         pcl::PointCloud<pcl::PointXYZI> pc_map;
         for (size_t i = 0; i < particles.size(); ++i)
         {
             // Transform the sensor point cloud from the particle frame to the map frame.
             pcl_ros::transformPointCloud(pc_robot, pc_map, particles[i].pose);
-            dz[i] = map_.diff(pc_map);
+            dz[i] = map->diff(pc_map);
         }
 
         return dz;
@@ -97,43 +185,127 @@ public:
 
 
 protected:
-    /// Computes the weights of a subset of particles when using multiple threads.
+    /// Computes the weights of a range of particles when using multiple threads.
+    /// \param[in] map snapshot of the elevation map.
+    /// \param[in] pc lidar point cloud in the robot frame of reference.
     /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_range(const ElevationMap<pcl::PointXYZI>& map,
+                                       const pcl::PointCloud<pcl::PointXYZI>& pc,
+                                       std::vector<Particle>& particles, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(map, pc, particles[i]);
+    }
+
+
+    /// Computes the weights of all particles from a structure-of-arrays copy of the point cloud.
+    /// Used if the yaw bins or early termination are enabled.
+    /// \param[in] map snapshot of the elevation map.
     /// \param[in] pc lidar point cloud in the robot frame of reference.
-    /// \param[in] thread number of this thread.
-    void compute_particle_errors_thread(const pcl::PointCloud<pcl::PointXYZI>& pc,
-                                        std::vector<Particle>& particles, int thread)
+    /// \param[in,out] particles set of particles.
+    void compute_particle_errors_scan(const ElevationMap<pcl::PointXYZI>& map,
+                                      const pcl::PointCloud<pcl::PointXYZI>& pc,
+                                      std::vector<Particle>& particles)
+    {
+        // Assign the particles to the yaw bins.
+        // Particles with roll or pitch and all particles without yaw bins keep the bin index -1.
+        const double max_tilt = 1.0e-6;
+        std::map<long, long> bin_indices;
+        std::vector<double> bin_yaws;
+        std::vector<long> particle_bins(particles.size(), -1);
+        for (size_t i = 0u; i < particles.size() && yaw_bin_size_ > 0.0; ++i)
+        {
+            double roll, pitch, yaw;
+            tf::Matrix3x3(particles[i].pose.getRotation()).getRPY(roll, pitch, yaw);
+            if (std::abs(roll) > max_tilt || std::abs(pitch) > max_tilt)
+                continue;
+
+            const long bin = std::floor(yaw / yaw_bin_size_ + 0.5);
+            std::map<long, long>::iterator it = bin_indices.find(bin);
+            if (it == bin_indices.end())
+            {
+                it = bin_indices.insert(std::make_pair(bin, (long)bin_yaws.size())).first;
+                bin_yaws.push_back(bin * yaw_bin_size_);
+            }
+            particle_bins[i] = it->second;
+        }
+
+        // Shuffle the point cloud for early termination and rotate it once per occupied bin.
+        ScanBuffer scan(pc);
+        scan.shuffle(shuffle_engine_);
+        bound_.reset();
+        std::vector<ScanBuffer> scans(bin_yaws.size());
+        if (MULTITHREADING)
+        {
+            get_worker_pool()->run(scans.size(), boost::bind(
+                                       &SensorModelElevation::rotate_scans_range,
+                                       boost::cref(scan), boost::cref(bin_yaws), boost::ref(scans), _1, _2));
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelElevation::compute_particle_errors_scan_range,
+                                       this,
+                                       boost::cref(map), boost::cref(scan), boost::cref(scans),
+                                       boost::cref(particle_bins), boost::ref(particles), _1, _2));
+        }
+        else
+        {
+            rotate_scans_range(scan, bin_yaws, scans, 0u, scans.size());
+            compute_particle_errors_scan_range(map, scan, scans, particle_bins, particles, 0u, particles.size());
+        }
+    }
+
+
+    /// Rotates the point cloud for a range of yaw bins.
+    /// \param[in] scan point cloud in the robot frame of reference.
+    /// \param[in] yaws yaw angles of all bins.
+    /// \param[out] scans rotated point clouds of all bins.
+    /// \param[in] begin index of the first bin of the range.
+    /// \param[in] end index behind the last bin of the range.
+    static void rotate_scans_range(const ScanBuffer& scan, const std::vector<double>& yaws,
+                                   std::vector<ScanBuffer>& scans, size_t begin, size_t end)
     {
-        // Compute the weights of the individual particles.
-        // Distribute the particles equally over all available threads.
-        const int n_threads = boost::thread::hardware_concurrency();
-        const int particles_per_thread = std::ceil(particles.size() / double(n_threads));
-        const int start_index = thread * particles_per_thread;
-        const int stop_index = std::min((int)particles.size(), (thread+1) * particles_per_thread);
-        for (int i = start_index; i < stop_index; ++i)
-            compute_particle_error(pc, particles[i]);
+        for (size_t b = begin; b < end; ++b)
+            scans[b].rotate_z(scan, yaws[b]);
     }
 
 
-    /// Adjust the z-position of the particle to make sure the robot stands on the ground.
-    void correct_z(Particle& particle) const
+    /// Computes the weights of a range of particles from the structure-of-arrays copy of the point cloud.
+    /// \param[in] map snapshot of the elevation map.
+    /// \param[in] scan point cloud in the robot frame of reference.
+    /// \param[in] scans rotated point clouds of all yaw bins.
+    /// \param[in] bins yaw bins of all particles. Particles with bin -1 rotate the point cloud themselves.
+    /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_scan_range(const ElevationMap<pcl::PointXYZI>& map, const ScanBuffer& scan,
+                                            const std::vector<ScanBuffer>& scans, const std::vector<long>& bins,
+                                            std::vector<Particle>& particles, size_t begin, size_t end)
     {
-        // Compute the height of the local ground plane of the map relative to the map frame.
-        double z_ground = map_.z_ground(particle.pose.getOrigin().getX(), particle.pose.getOrigin().getY(), 2.0, 0.2);
+        ScanBuffer rotated;
+        for (size_t i = begin; i < end; ++i)
+        {
+            correct_z(map, particles[i]);
+            if (bins[i] < 0)
+                rotated.rotate(scan, particles[i].pose);
 
-        // Add the distance from the ground to the robot base to the computed z-coordinate and assign it to the
-        // particle's z-position.
-        particle.pose.getOrigin().setZ(z_ground + 0.955);
+            const ScanBuffer& s = bins[i] < 0 ? rotated : scans[bins[i]];
+            const tf::Vector3& t = particles[i].pose.getOrigin();
+            particles[i].error = map.match(s.x(), s.y(), s.z(), s.size(), t.x(), t.y(), t.z(), bound_.get());
+            bound_.update(particles[i].error);
+        }
     }
 
 
     /// Compute the error between the given point cloud and the map.
+    /// \param[in] map snapshot of the elevation map.
     /// \param[in] pc point cloud provided by the sensor in the robot frame.
     /// \param[in,out] particle robot position for which the error is computed.
-    virtual void compute_particle_error(const pcl::PointCloud<pcl::PointXYZI>& pc, Particle& particle)
+    virtual void compute_particle_error(const ElevationMap<pcl::PointXYZI>& map,
+                                        const pcl::PointCloud<pcl::PointXYZI>& pc, Particle& particle)
     {
         // Correct the z-coordinate of the particle to make sure the robot stands on the ground.
-        correct_z(particle);
+        correct_z(map, particle);
 
         // Transform the sensor point cloud from the particle frame to the map frame.
         pcl::PointCloud<pcl::PointXYZI> pc_map;
@@ -141,7 +313,7 @@ protected:
 
         // Compute how well the measurements match the map by computing the mean distance between
         // the point cloud and the tiles of the elevation map.
-        particle.error = map_.match(pc_map);
+        particle.error = map.match(pc_map);
     }
 };
 
@@ -9,15 +9,19 @@
 
 // Standard library.
 #include <vector>
+#include <algorithm>
+#include <cmath>
 
 // Boost.
 #include <boost/thread.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 // Point Cloud Library.
 #include <pcl/point_types.h>
 #include <pcl/point_cloud.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/io/pcd_io.h>
 
 // ROS.
 #include <ros/console.h>
@@ -26,6 +30,11 @@
 // Particle filter.
 #include "localizer/particle.h"
 #include "localizer/sensor_model.h"
+#include "localizer/error_bound.h"
+#include "localizer/distance_field.h"
+#include "localizer/kdtree_batch.h"
+#include "localizer/scan_buffer.h"
+#include "localizer/voxel_downsampler.h"
 
 
 /// Determines the weight of a particle by comparing a given point cloud to a point cloud map using the
@@ -34,7 +43,16 @@ class SensorModelEndpoint : public SensorModel<pcl::PointCloud<pcl::PointXYZI> >
 {
 protected:
     /// 3D tree for computing the distances between points.
-    pcl::KdTreeFLANN<pcl::PointXYZI> kdtree_;
+    KdTreeBatch<pcl::PointXYZI> kdtree_;
+
+    /// Scratch memory of the kd-tree queries, one per worker.
+    std::vector<KdTreeBatchScratch> scratch_;
+
+    /// Downsamples the incoming point clouds.
+    VoxelDownsampler downsampler_;
+
+    /// Downsampled point cloud of the current measurement. Kept to reuse its memory.
+    ScanBuffer scan_;
 
     /// Voxel edge length used for sparsifying the incoming point clouds.
     double res_;
@@ -42,11 +60,24 @@ protected:
     /// Lower bound of the resolution used to sparsify point clouds.
     static const double min_res;
 
+    /// Maximum distance between a measured point and the map used for weighting the particles.
+    static const double max_distance;
+
+    /// Distance field of the map. If set, the distances are looked up in the field instead of the kd-tree.
+    boost::shared_ptr<const DistanceField3d> distance_field_;
+
+    /// Lowest particle error of the current measurement plus the margin above which scoring stops early.
+    ErrorBound bound_;
+
+    /// Random number engine that puts the points of the scan in random order.
+    boost::random::mt19937 shuffle_engine_;
+
 
 public:
     /// Constructor.
     /// \param[in] PCD file used as a map when weighting the particles.
     SensorModelEndpoint(pcl::PointCloud<pcl::PointXYZI>::ConstPtr map, double res = min_res)
+        : downsampler_(min_res)
     {
         set_sparsification_resolution(res);
 
@@ -63,38 +94,78 @@ public:
     }
 
 
-    /// Computes the weights of all particles based on the map and the measured point cloud.
+    /// Switches between looking up the distances in a kd-tree and in a precomputed distance field.
+    /// The distance field costs one hash table lookup per point instead of a nearest-neighbor search, but needs
+    /// memory for all voxels within the maximum distance of the map. Its distances deviate from the exact ones
+    /// by at most the voxel diagonal.
+    /// \param[in] resolution edge length of the voxels of the distance field. Zero selects the kd-tree.
+    void set_distance_field_resolution(double resolution)
+    {
+        if (resolution <= 0.0)
+        {
+            distance_field_.reset();
+            return;
+        }
+
+        if (distance_field_ && distance_field_->get_resolution() == resolution)
+            return;
+
+        distance_field_ = boost::make_shared<DistanceField3d>(*kdtree_.getInputCloud(), resolution, max_distance);
+        ROS_DEBUG_STREAM("Computed distance field with " << distance_field_->n_blocks() << " blocks.");
+    }
+
+
+    /// Sets the approximation factor of the kd-tree queries.
+    /// A query may return a neighbor whose distance exceeds the distance to the nearest neighbor by a factor
+    /// of up to 1 + epsilon. Zero requests exact nearest neighbors.
+    void set_kdtree_epsilon(float epsilon)
+    {
+        kdtree_.setEpsilon(std::max(0.0f, epsilon));
+    }
+
+
+    /// Enables or disables early termination of the particle scoring.
+    /// If enabled, the points are processed in random order, and the scoring of a particle stops as soon as its
+    /// partial error exceeds the lowest complete error of the current measurement plus the margin. Then the
+    /// particle gets a lower bound of its error, which still exceeds the lowest error by more than the margin.
+    /// \param[in] margin margin above the lowest error. Infinity disables early termination.
+    void set_error_bound_margin(double margin)
+    {
+        bound_.set_margin(std::max(0.0, margin));
+    }
+
+
+    /// Computes the errors of all particles based on the map and the measured point cloud.
     /// \param[in] pc_robot measured point cloud in the robot frame of reference.
     /// \param[in,out] particles set of particles.
-    virtual void compute_particle_weights(const pcl::PointCloud<pcl::PointXYZI>& pc_robot,
-                                          std::vector<Particle>& particles)
+    virtual void compute_particle_errors(const pcl::PointCloud<pcl::PointXYZI>& pc_robot,
+                                         std::vector<Particle>& particles)
     {
         // Downsample the point cloud provided by the robot.
-        pcl::PointCloud<pcl::PointXYZI> pc_sparse;
-        sparsify(pc_robot, pc_sparse);
+        scan_.assign(pc_robot);
+        downsampler_.downsample(scan_, *get_worker_pool());
+
+        // Put the points in random order, so the points processed before the scoring stops early are a
+        // representative sample of the scan.
+        if (bound_.enabled())
+            scan_.shuffle(shuffle_engine_);
+        bound_.reset();
 
-        // Compute the particle weights.
+        // Compute the particle errors.
+        scratch_.resize(get_worker_pool()->size());
         if (MULTITHREADING)
         {
-            // Compute the weights of the individual particles in parallel. Use as many threads as cores are available.
-            boost::thread_group threads;
-            int n_threads = boost::thread::hardware_concurrency();
-            for (int t = 0; t < n_threads; t++)
-            {
-                threads.create_thread(boost::bind(
-                                          &SensorModelEndpoint::compute_particle_weights_thread,
-                                          this,
-                                          boost::cref(pc_sparse), boost::ref(particles), t));
-            }
-
-            // Wait for the threads to return.
-            threads.join_all();
+            // Compute the errors of the individual particles in parallel using the worker threads.
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelEndpoint::compute_particle_errors_range,
+                                       this,
+                                       boost::cref(scan_), boost::ref(particles), _1, _2, _3));
         }
         else
         {
-            // Compute the weights of all particles.
+            // Compute the errors of all particles.
             for (size_t i = 0; i < particles.size(); ++i)
-                compute_particle_weight(pc_sparse, particles[i]);
+                compute_particle_error(scan_, particles[i], scratch_[0]);
         }
     }
 
@@ -108,28 +179,26 @@ protected:
             ROS_WARN_STREAM("Sparsification resolution set to minimum admissible resolution " << min_res << ".");
 
         res_ = std::max(min_res, res);
+        downsampler_.set_leaf_size(res_);
     }
 
 
-    /// Computes the weights of a subset of particles when using multiple threads.
+    /// Computes the errors of a range of particles when using multiple threads.
+    /// \param[in] scan downsampled lidar point cloud in the robot frame of reference.
     /// \param[in,out] particles vector of all particles.
-    /// \param[in] pc_robot lidar point cloud in the robot frame of reference.
-    /// \param[in] thread number of this thread.
-    void compute_particle_weights_thread(const pcl::PointCloud<pcl::PointXYZI>& pc_robot,
-                                         std::vector<Particle>& particles, int thread)
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    /// \param[in] worker number of the worker that processes the range.
+    void compute_particle_errors_range(const ScanBuffer& scan,
+                                       std::vector<Particle>& particles, size_t begin, size_t end,
+                                       unsigned int worker)
     {
-        // Compute the weights of the individual particles.
-        // Equally distribute the particles over the available threads.
-        const int n_threads = boost::thread::hardware_concurrency();
-        const int particles_per_thread = std::ceil(particles.size() / double(n_threads));
-        const int start_index = thread * particles_per_thread;
-        const int stop_index = std::min((int)particles.size(), (thread+1) * particles_per_thread);
-        for (int i = start_index; i < stop_index; ++i)
-            compute_particle_weight(pc_robot, particles[i]);
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(scan, particles[i], scratch_[worker]);
     }
 
 
-    /// Downsamples the point cloud using a voxel grid.
+    /// Downsamples the map using a voxel grid.
     /// \param[in] pc point cloud to sparsify.
     /// \param[out] pc_sparse sparsified point cloud.
     virtual void sparsify(const pcl::PointCloud<pcl::PointXYZI>& pc, pcl::PointCloud<pcl::PointXYZI>& pc_sparse)
@@ -141,44 +210,88 @@ protected:
     }
 
 
-    /// Computes the weight of the particle.
-    /// \param[in] pc_robot measured point cloud in the robot frame.
-    /// \param[in,out] particle particle whose weight is computed.
-    virtual void compute_particle_weight(const pcl::PointCloud<pcl::PointXYZI>& pc_robot, Particle& particle)
+    /// Computes the error of the particle: the mean capped distance between the measured points and the map.
+    /// The points are transformed and looked up in batches. The memory for the batches is taken from the
+    /// scratch memory of the calling worker, so no memory is allocated per particle.
+    /// \param[in] scan downsampled point cloud measured in the robot frame.
+    /// \param[in,out] particle particle whose error is computed.
+    /// \param scratch scratch memory of the calling worker.
+    virtual void compute_particle_error(const ScanBuffer& scan, Particle& particle, KdTreeBatchScratch& scratch)
     {
         // Set the maximum distance between two points used for weighting the particles.
-        const float d_max = 0.5f;
+        const float d_max = max_distance;
 
-        // Transform the sensor point cloud from the particle frame to the map frame.
-        pcl::PointCloud<pcl::PointXYZI> pc_map;
-        pcl_ros::transformPointCloud(pc_robot, pc_map, particle.pose);
+        // The scoring stops once the sum of the distances guarantees an error above the bound. As the distances
+        // are nonnegative, the sum divided by the number of all points is a lower bound of the error.
+        const double d_bound = bound_.get() * scan.size();
 
         // Compute how well the measurements match the map by computing the point-to-point distances.
-        std::vector<int> k_indices(1, -1);
-        std::vector<float> d(1, 0.0f);
+        // The points are transformed from the particle frame to the map frame batch by batch, so the scoring does
+        // not transform points it does not evaluate.
+        const size_t batch_size = 64u;
+        scratch.resize(batch_size);
+        float d[batch_size];
         float d_tot = 0.0f;
         int n_tot = 0;
-        for (size_t i = 0; i < pc_map.size(); ++i)
+        for (size_t begin = 0u; begin < scan.size(); begin += batch_size)
         {
-            // Determine the squared distance to the nearest point.
-            if (pcl::isFinite(pc_map[i]))
-                kdtree_.nearestKSearch(pc_map[i], 1, k_indices, d);
-            else
-                continue;
+            // Stop early if the particle cannot come close to the best one.
+            if (d_tot > d_bound)
+            {
+                particle.error = d_tot/scan.size();
+                bound_.update(particle.error);
+                return;
+            }
 
-            // Sum up the capped distances.
-            d_tot += std::min(d_max, std::sqrt(d[0]));
+            // Transform the finite points of the batch to the map frame.
+            const size_t end = std::min(scan.size(), begin + batch_size);
+            size_t n = 0u;
+            for (size_t i = begin; i < end; ++i)
+            {
+                const tf::Vector3 v = particle.pose * tf::Vector3(scan.x()[i], scan.y()[i], scan.z()[i]);
+                if (!std::isfinite(v.x()) || !std::isfinite(v.y()) || !std::isfinite(v.z()))
+                    continue;
+
+                scratch.queries[3u*n]    = v.x();
+                scratch.queries[3u*n+1u] = v.y();
+                scratch.queries[3u*n+2u] = v.z();
+                n++;
+            }
 
-            // Sum up the number of finite points.
-            n_tot++;
+            // Determine the capped distances to the nearest map points.
+            if (distance_field_)
+            {
+                for (size_t k = 0u; k < n; ++k)
+                    d[k] = distance_field_->distance(scratch.queries[3u*k], scratch.queries[3u*k+1u],
+                                                     scratch.queries[3u*k+2u]);
+            }
+            else
+                kdtree_.nearest_distances(n, d_max, scratch, d);
+
+            // Sum up the capped distances and the number of finite points.
+            for (size_t k = 0u; k < n; ++k)
+                d_tot += d[k];
+            n_tot += n;
         }
 
-        // Compute the particle weight relative to the baseline.
-        particle.weight = d_max - d_tot/n_tot;
+        // Compute the particle error.
+        particle.error = d_tot/n_tot;
+        bound_.update(particle.error);
 
         // Save the point clouds for debugging reasons.
         if (SAVE_PCD)
         {
+            pcl::PointCloud<pcl::PointXYZI> pc_map;
+            for (size_t i = 0u; i < scan.size(); ++i)
+            {
+                const tf::Vector3 v = particle.pose * tf::Vector3(scan.x()[i], scan.y()[i], scan.z()[i]);
+                pcl::PointXYZI p;
+                p.x = v.x();
+                p.y = v.y();
+                p.z = v.z();
+                p.intensity = 0.0f;
+                pc_map.push_back(p);
+            }
             std::stringstream filename;
             ros::Time now(ros::Time::now());
             filename << now.sec << now.nsec << ".pcd";
@@ -190,6 +303,7 @@ protected:
 
 
 const double SensorModelEndpoint::min_res = 1.0e-3;
+const double SensorModelEndpoint::max_distance = 0.5;
 
 
 #endif
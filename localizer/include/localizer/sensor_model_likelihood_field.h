@@ -0,0 +1,250 @@
+#ifndef SENSOR_MODEL_LIKELIHOOD_FIELD_H_
+#define SENSOR_MODEL_LIKELIHOOD_FIELD_H_ SENSOR_MODEL_LIKELIHOOD_FIELD_H_
+
+// Enable/disable multithreading.
+#define MULTITHREADING true
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/bind.hpp>
+
+// ROS.
+#include <ros/console.h>
+#include <sensor_msgs/LaserScan.h>
+#include <nav_msgs/OccupancyGrid.h>
+#include <tf/tf.h>
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+#include "localizer/distance_transform.h"
+
+
+/// Determines the weight of a particle by comparing a 2D laser scan to an occupancy grid map using the
+/// likelihood field model.
+/// The likelihood of a beam endpoint depends only on the distance between the endpoint and the nearest
+/// obstacle. The model precomputes the cost of an endpoint, its negative log-likelihood, for every cell of the
+/// map once, so scoring a beam costs one table lookup. The directions of the beams relative to the robot are
+/// precomputed as well and reused for all scans with the same geometry.
+/// The error of a particle is the mean cost of the scored beams. Beams at or beyond the maximum range are not
+/// scored.
+class SensorModelLikelihoodField : public SensorModel<sensor_msgs::LaserScan>
+{
+protected:
+    /// Cost of a beam endpoint in every cell of the map.
+    /// Cell (ix, iy) is located at index ix*y_size_ + iy.
+    std::vector<float> cost_;
+
+    /// Number of cells in x direction.
+    size_t x_size_;
+
+    /// Number of cells in y direction.
+    size_t y_size_;
+
+    /// Edge length of the cells.
+    double resolution_;
+
+    /// x-coordinate of the lower left corner of the map.
+    double x_min_;
+
+    /// y-coordinate of the lower left corner of the map.
+    double y_min_;
+
+    /// Cost of beam endpoints outside the map.
+    float cost_max_;
+
+    /// Pose of the laser scanner in the robot frame. Only the 2D part is used.
+    tf::Transform laser_pose_;
+
+    /// Maximum number of beams scored per scan.
+    size_t max_beams_;
+
+    /// Geometry of the scans the beam table was computed for.
+    float table_angle_min_, table_angle_increment_;
+
+    /// Direction of every beam in the robot frame.
+    std::vector<float> beam_cos_, beam_sin_;
+
+    /// Endpoints of the beams of the current scan in the robot frame.
+    std::vector<float> beam_x_, beam_y_;
+
+
+public:
+    /// Constructor.
+    /// Computes the likelihood field of the given map.
+    /// \param[in] map occupancy grid map. Cells with an occupancy above 50 are obstacles.
+    /// \param[in] sigma standard deviation of the measurement noise in meters.
+    /// \param[in] z_hit weight of the Gaussian measurement noise.
+    /// \param[in] z_rand weight of random measurements. Bounds the cost of a beam.
+    /// \param[in] max_beams maximum number of beams scored per scan. The beams are evenly subsampled.
+    SensorModelLikelihoodField(const nav_msgs::OccupancyGrid& map, double sigma = 0.2, double z_hit = 0.95,
+                               double z_rand = 0.05, size_t max_beams = 180u)
+        : x_size_(map.info.width),
+          y_size_(map.info.height),
+          resolution_(map.info.resolution),
+          x_min_(map.info.origin.position.x),
+          y_min_(map.info.origin.position.y),
+          laser_pose_(tf::Transform::getIdentity()),
+          max_beams_(std::max<size_t>(1u, max_beams)),
+          table_angle_min_(std::numeric_limits<float>::quiet_NaN()),
+          table_angle_increment_(std::numeric_limits<float>::quiet_NaN())
+    {
+        const geometry_msgs::Quaternion& q = map.info.origin.orientation;
+        if (std::abs(q.x) + std::abs(q.y) + std::abs(q.z) > 1.0e-6)
+            ROS_WARN("The rotation of the occupancy grid map is ignored.");
+
+        if (map.data.size() != x_size_ * y_size_)
+        {
+            ROS_ERROR_STREAM("Occupancy grid has " << map.data.size() << " cells instead of "
+                             << x_size_ * y_size_ << ".");
+            x_size_ = y_size_ = 0u;
+        }
+
+        // Compute the distance from every cell to the nearest obstacle.
+        std::vector<unsigned char> occupied(x_size_ * y_size_);
+        for (size_t ix = 0u; ix < x_size_; ++ix)
+            for (size_t iy = 0u; iy < y_size_; ++iy)
+                occupied[ix*y_size_ + iy] = map.data[iy*x_size_ + ix] > 50;
+
+        std::vector<double> distance;
+        std::vector<uint32_t> nearest;
+        distance_transform(occupied, x_size_, y_size_, distance, nearest);
+
+        // Convert the distances to costs.
+        cost_.resize(distance.size());
+        for (size_t i = 0u; i < distance.size(); ++i)
+            cost_[i] = -std::log(z_hit * std::exp(-std::pow(distance[i]*resolution_, 2.0) / (2.0*sigma*sigma))
+                                 + z_rand);
+        cost_max_ = -std::log(z_rand);
+    }
+
+
+    /// Sets the pose of the laser scanner in the robot frame.
+    /// Only the position in the xy-plane and the yaw angle are used.
+    void set_laser_pose(const tf::Transform& laser_pose)
+    {
+        laser_pose_ = laser_pose;
+        beam_cos_.clear();
+        beam_sin_.clear();
+    }
+
+
+    /// Computes the errors of all particles based on the likelihood field and the given laser scan.
+    /// \param[in] scan laser scan.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const sensor_msgs::LaserScan& scan, std::vector<Particle>& particles)
+    {
+        // Compute the endpoints of the beams to score in the robot frame.
+        update_beam_table(scan);
+        const size_t stride = std::max<size_t>(1u, (scan.ranges.size() + max_beams_-1u) / max_beams_);
+        const float x_laser = laser_pose_.getOrigin().x();
+        const float y_laser = laser_pose_.getOrigin().y();
+        beam_x_.clear();
+        beam_y_.clear();
+        for (size_t i = 0u; i < scan.ranges.size(); i += stride)
+        {
+            // Comparisons involving NaN are false, and infinite ranges exceed the maximum range.
+            const float r = scan.ranges[i];
+            if (!(r >= scan.range_min && r < scan.range_max))
+                continue;
+
+            beam_x_.push_back(x_laser + r*beam_cos_[i]);
+            beam_y_.push_back(y_laser + r*beam_sin_[i]);
+        }
+
+        // Without any valid beam, the scan tells nothing about the particles, so their errors are left unchanged.
+        if (beam_x_.empty())
+            return;
+
+        // Compute the particle errors.
+        if (MULTITHREADING)
+        {
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelLikelihoodField::compute_particle_errors_range,
+                                       this,
+                                       boost::ref(particles), _1, _2));
+        }
+        else
+            compute_particle_errors_range(particles, 0u, particles.size());
+    }
+
+
+protected:
+    /// Computes the directions of the beams in the robot frame, if the geometry of the scan has changed.
+    void update_beam_table(const sensor_msgs::LaserScan& scan)
+    {
+        if (beam_cos_.size() == scan.ranges.size() && table_angle_min_ == scan.angle_min
+                && table_angle_increment_ == scan.angle_increment)
+            return;
+
+        const double yaw_laser = tf::getYaw(laser_pose_.getRotation());
+        beam_cos_.resize(scan.ranges.size());
+        beam_sin_.resize(scan.ranges.size());
+        for (size_t i = 0u; i < scan.ranges.size(); ++i)
+        {
+            const double angle = yaw_laser + scan.angle_min + i*scan.angle_increment;
+            beam_cos_[i] = std::cos(angle);
+            beam_sin_[i] = std::sin(angle);
+        }
+
+        table_angle_min_ = scan.angle_min;
+        table_angle_increment_ = scan.angle_increment;
+    }
+
+
+    /// Computes the errors of a range of particles.
+    /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_range(std::vector<Particle>& particles, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(particles[i]);
+    }
+
+
+    /// Computes the error of a particle: the mean cost of the endpoints of the beams of the current scan.
+    /// The loop over the beams is free of data-dependent branches, so the compiler can vectorize it.
+    virtual void compute_particle_error(Particle& particle) const
+    {
+        const size_t n = beam_x_.size();
+        const float* bx = beam_x_.empty() ? NULL : &beam_x_[0];
+        const float* by = beam_y_.empty() ? NULL : &beam_y_[0];
+        const float* cost = cost_.empty() ? &cost_max_ : &cost_[0];
+
+        // Transform the endpoints to cell coordinates relative to the lower left corner of the map.
+        const double yaw = tf::getYaw(particle.pose.getRotation());
+        const float inv_res = 1.0 / resolution_;
+        const float c = std::cos(yaw) * inv_res;
+        const float s = std::sin(yaw) * inv_res;
+        const float x0 = (particle.pose.getOrigin().x() - x_min_) * inv_res;
+        const float y0 = (particle.pose.getOrigin().y() - y_min_) * inv_res;
+        const float x_size = x_size_;
+        const float y_size = y_size_;
+        const int y_stride = y_size_;
+
+        float total = 0.0f;
+        for (size_t k = 0u; k < n; ++k)
+        {
+            const float fx = x0 + c*bx[k] - s*by[k];
+            const float fy = y0 + s*bx[k] + c*by[k];
+
+            // Clamp the index of endpoints outside the map to the first cell to keep the lookup in bounds.
+            const bool inside = fx >= 0.0f && fx < x_size && fy >= 0.0f && fy < y_size;
+            const int index = inside ? (int)fx*y_stride + (int)fy : 0;
+            const float e = cost[index];
+            total += inside ? e : cost_max_;
+        }
+
+        particle.error = total / n;
+    }
+};
+
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef SENSOR_MODEL_NDT_H_
+#define SENSOR_MODEL_NDT_H_ SENSOR_MODEL_NDT_H_
+
+// Enable/disable multithreading.
+#define MULTITHREADING true
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+
+// Boost.
+#include <boost/bind.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/make_shared.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+// ROS.
+#include <ros/console.h>
+#include <tf/tf.h>
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+#include "localizer/error_bound.h"
+#include "localizer/ndt_map.h"
+#include "localizer/scan_buffer.h"
+#include "localizer/voxel_downsampler.h"
+
+
+/// Determines the weight of a particle by comparing a given point cloud to the normal distributions transform
+/// of a point cloud map.
+/// Every point of the downsampled point cloud is scored by the normal distribution of the map voxel it falls
+/// into. The error of a particle is the mean cost of the points, which lies in [0, 1]. Compared to the endpoint
+/// model, the voxels can be far coarser, which saves map memory, and every point costs one hash table lookup
+/// instead of a nearest-neighbor search.
+class SensorModelNDT : public SensorModel<pcl::PointCloud<pcl::PointXYZI> >
+{
+protected:
+    /// Normal distributions transform of the map.
+    boost::shared_ptr<const NdtMap> map_;
+
+    /// Downsamples the incoming point clouds.
+    VoxelDownsampler downsampler_;
+
+    /// Downsampled point cloud of the current measurement. Kept to reuse its memory.
+    ScanBuffer scan_;
+
+    /// Lowest particle error of the current measurement plus the margin above which scoring stops early.
+    ErrorBound bound_;
+
+    /// Random number engine that puts the points of the scan in random order.
+    boost::random::mt19937 shuffle_engine_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] map point cloud map.
+    /// \param[in] resolution edge length of the voxels of the normal distributions transform.
+    /// \param[in] scan_resolution voxel edge length used to downsample the incoming point clouds.
+    SensorModelNDT(pcl::PointCloud<pcl::PointXYZI>::ConstPtr map, double resolution = 1.0,
+                   double scan_resolution = 0.2)
+        : map_(boost::make_shared<NdtMap>(*map, resolution)),
+          downsampler_(scan_resolution)
+    {
+        ROS_DEBUG_STREAM("Computed normal distributions of " << map_->n_voxels() << " voxels.");
+    }
+
+
+    /// Constructor.
+    /// \param[in] map normal distributions transform of the map, shared with other users.
+    /// \param[in] scan_resolution voxel edge length used to downsample the incoming point clouds.
+    SensorModelNDT(const boost::shared_ptr<const NdtMap>& map, double scan_resolution = 0.2)
+        : map_(map),
+          downsampler_(scan_resolution)
+    {
+    }
+
+
+    /// Returns the normal distributions transform of the map.
+    boost::shared_ptr<const NdtMap> get_map() const
+    {
+        return map_;
+    }
+
+
+    /// Enables or disables early termination of the particle scoring.
+    /// If enabled, the points are processed in random order, and the scoring of a particle stops as soon as its
+    /// partial error exceeds the lowest complete error of the current measurement plus the margin.
+    /// \param[in] margin margin above the lowest error. Infinity disables early termination.
+    void set_error_bound_margin(double margin)
+    {
+        bound_.set_margin(std::max(0.0, margin));
+    }
+
+
+    /// Computes the errors of all particles based on the map and the measured point cloud.
+    /// \param[in] pc_robot measured point cloud in the robot frame of reference.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const pcl::PointCloud<pcl::PointXYZI>& pc_robot,
+                                         std::vector<Particle>& particles)
+    {
+        // Downsample the point cloud provided by the robot. This also removes NaN points.
+        scan_.assign(pc_robot);
+        downsampler_.downsample(scan_, *get_worker_pool());
+        if (bound_.enabled())
+            scan_.shuffle(shuffle_engine_);
+        bound_.reset();
+
+        // Compute the particle errors.
+        if (MULTITHREADING)
+        {
+            get_worker_pool()->run(particles.size(), boost::bind(
+                                       &SensorModelNDT::compute_particle_errors_range,
+                                       this,
+                                       boost::cref(scan_), boost::ref(particles), _1, _2));
+        }
+        else
+            compute_particle_errors_range(scan_, particles, 0u, particles.size());
+    }
+
+
+protected:
+    /// Computes the errors of a range of particles.
+    /// \param[in] scan downsampled point cloud in the robot frame.
+    /// \param[in,out] particles vector of all particles.
+    /// \param[in] begin index of the first particle of the range.
+    /// \param[in] end index behind the last particle of the range.
+    void compute_particle_errors_range(const ScanBuffer& scan, std::vector<Particle>& particles, size_t begin,
+                                       size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+            compute_particle_error(scan, particles[i]);
+    }
+
+
+    /// Computes the error of a particle: the mean cost of the points of the scan.
+    /// The points are rotated into the map frame batch by batch. The translation is passed to the map
+    /// separately, so the rotated coordinates stay small and keep their precision as floats.
+    /// \param[in] scan downsampled point cloud in the robot frame.
+    /// \param[in,out] particle particle whose error is computed.
+    virtual void compute_particle_error(const ScanBuffer& scan, Particle& particle)
+    {
+        if (scan.empty())
+        {
+            particle.error = 1.0;
+            return;
+        }
+
+        const tf::Matrix3x3& r = particle.pose.getBasis();
+        const tf::Vector3 r0 = r.getRow(0), r1 = r.getRow(1), r2 = r.getRow(2);
+        const float r00 = r0.x(), r01 = r0.y(), r02 = r0.z();
+        const float r10 = r1.x(), r11 = r1.y(), r12 = r1.z();
+        const float r20 = r2.x(), r21 = r2.y(), r22 = r2.z();
+
+        // The costs are nonnegative, so the sum divided by the number of all points is a lower bound of the error.
+        const double cost_bound = bound_.get() * scan.size();
+
+        const size_t batch_size = NdtMap::batch_size;
+        float x[batch_size], y[batch_size], z[batch_size];
+        double total = 0.0;
+        for (size_t begin = 0u; begin < scan.size(); begin += batch_size)
+        {
+            // Stop early if the particle cannot come close to the best one.
+            if (total > cost_bound)
+            {
+                particle.error = total / scan.size();
+                bound_.update(particle.error);
+                return;
+            }
+
+            const size_t n = std::min(batch_size, scan.size() - begin);
+            const float* sx = scan.x() + begin;
+            const float* sy = scan.y() + begin;
+            const float* sz = scan.z() + begin;
+            for (size_t k = 0u; k < n; ++k)
+            {
+                x[k] = r00*sx[k] + r01*sy[k] + r02*sz[k];
+                y[k] = r10*sx[k] + r11*sy[k] + r12*sz[k];
+                z[k] = r20*sx[k] + r21*sy[k] + r22*sz[k];
+            }
+
+            total += map_->cost(x, y, z, n, particle.pose.getOrigin());
+        }
+
+        particle.error = total / scan.size();
+        bound_.update(particle.error);
+    }
+};
+
+
+#endif
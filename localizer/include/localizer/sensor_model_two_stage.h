@@ -0,0 +1,158 @@
+#ifndef SENSOR_MODEL_TWO_STAGE_H_
+#define SENSOR_MODEL_TWO_STAGE_H_ SENSOR_MODEL_TWO_STAGE_H_
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Boost.
+#include <boost/shared_ptr.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_cloud.h>
+
+// Particle filter.
+#include "localizer/particle.h"
+#include "localizer/sensor_model.h"
+#include "localizer/random_generators.h"
+
+
+/// Scores the particles in two stages using another sensor model.
+/// First, all particles are scored on a small stratified subset of the points of the measured point cloud.
+/// Then, only the best particles are scored again on the full point cloud: the given number of particles with
+/// the lowest errors and all particles whose errors lie within a margin of the lowest error.
+/// The refined particles get the same errors as with single-stage scoring. The errors of the other particles
+/// are estimated from the subset; they are raised to the highest refined error, so that no particle that was
+/// not refined outweighs a refined one.
+/// \tparam SensorModelT sensor model that computes the errors. Its measurement must be a pcl::PointCloud.
+template<typename SensorModelT>
+class SensorModelTwoStage : public SensorModel<typename SensorModelT::Measurement>
+{
+public:
+    /// Measured point cloud.
+    typedef typename SensorModelT::Measurement Measurement;
+
+
+protected:
+    /// Sensor model that computes the errors.
+    boost::shared_ptr<SensorModelT> sensor_model_;
+
+    /// Number of points of the subset used in the first stage.
+    size_t n_points_;
+
+    /// Number of particles with the lowest errors that are scored on the full point cloud.
+    size_t n_refine_;
+
+    /// Particles whose first-stage error exceeds the lowest first-stage error by at most this margin are also
+    /// scored on the full point cloud.
+    double margin_;
+
+    /// Picks the points of the subset within their strata.
+    UniformNumberGenerator generator_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] sensor_model sensor model that computes the errors.
+    /// \param[in] n_points number of points of the subset used in the first stage.
+    /// \param[in] n_refine number of particles with the lowest errors scored on the full point cloud.
+    /// \param[in] margin particles within this margin of the lowest first-stage error are also scored on the
+    /// full point cloud.
+    SensorModelTwoStage(const boost::shared_ptr<SensorModelT>& sensor_model, size_t n_points = 200u,
+                        size_t n_refine = 50u, double margin = 0.0)
+        : sensor_model_(sensor_model),
+          n_points_(std::max<size_t>(1u, n_points)),
+          n_refine_(n_refine),
+          margin_(std::max(0.0, margin)),
+          generator_(0.0, 1.0)
+    {
+    }
+
+
+    /// Returns the sensor model that computes the errors.
+    boost::shared_ptr<SensorModelT> get_sensor_model() const
+    {
+        return sensor_model_;
+    }
+
+
+    /// Computes the errors of all particles in two stages.
+    /// If the point cloud is not larger than the subset, the particles are scored in a single stage.
+    /// \param[in] pc measured point cloud in the robot frame of reference.
+    /// \param[in,out] particles set of particles.
+    virtual void compute_particle_errors(const Measurement& pc, std::vector<Particle>& particles)
+    {
+        sensor_model_->set_worker_pool(this->get_worker_pool());
+        if (pc.size() <= n_points_ || particles.empty())
+        {
+            sensor_model_->compute_particle_errors(pc, particles);
+            return;
+        }
+
+        // Score all particles on the subset.
+        Measurement subset;
+        stratified_subset(pc, subset);
+        sensor_model_->compute_particle_errors(subset, particles);
+
+        // Select the particles to refine: the ones with the lowest errors and the ones close to the best.
+        // Particles with NaN errors are sorted behind all others.
+        std::vector<std::pair<double, size_t> > ranking(particles.size());
+        for (size_t i = 0u; i < particles.size(); ++i)
+            ranking[i] = std::make_pair(std::isnan(particles[i].error)
+                                        ? std::numeric_limits<double>::infinity() : particles[i].error, i);
+
+        const size_t n_refine = std::min(n_refine_, ranking.size());
+        std::nth_element(ranking.begin(), ranking.begin() + n_refine, ranking.end());
+        const double best = std::min_element(ranking.begin(), ranking.end())->first;
+        std::vector<Particle> refined;
+        std::vector<size_t> indices;
+        for (size_t k = 0u; k < ranking.size(); ++k)
+            if (k < n_refine || ranking[k].first <= best + margin_)
+            {
+                indices.push_back(ranking[k].second);
+                refined.push_back(particles[ranking[k].second]);
+            }
+
+        // Score the selected particles on the full point cloud.
+        sensor_model_->compute_particle_errors(pc, refined);
+        double max_error = -std::numeric_limits<double>::infinity();
+        for (size_t k = 0u; k < refined.size(); ++k)
+        {
+            particles[indices[k]] = refined[k];
+            if (!std::isnan(refined[k].error))
+                max_error = std::max(max_error, refined[k].error);
+        }
+
+        // Keep the particles that were not refined behind the refined ones.
+        std::vector<bool> is_refined(particles.size(), false);
+        for (size_t k = 0u; k < indices.size(); ++k)
+            is_refined[indices[k]] = true;
+        for (size_t i = 0u; i < particles.size(); ++i)
+            if (!is_refined[i] && !std::isnan(particles[i].error))
+                particles[i].error = std::max(particles[i].error, max_error);
+    }
+
+
+protected:
+    /// Picks a stratified subset of the given point cloud.
+    /// Divides the points into n_points_ strata of consecutive points and picks a random point of each stratum.
+    /// Sensor drivers order the points by beam and azimuth, so the subset covers the whole field of view, and
+    /// the random pick avoids aliasing with the scan pattern.
+    void stratified_subset(const Measurement& pc, Measurement& subset)
+    {
+        subset.clear();
+        subset.reserve(n_points_);
+        const double stratum = (double)pc.size() / n_points_;
+        for (size_t k = 0u; k < n_points_; ++k)
+        {
+            const size_t i = std::min(pc.size() - 1u, (size_t)((k + generator_()) * stratum));
+            subset.push_back(pc[i]);
+        }
+        subset.header = pc.header;
+    }
+};
+
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef SPARSE_ELEVATION_MAP_H_
+#define SPARSE_ELEVATION_MAP_H_ SPARSE_ELEVATION_MAP_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <stdint.h>
+
+// Point Cloud Library.
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+// ROS logging.
+#include <ros/console.h>
+
+// Hash index of the map blocks.
+#include "localizer/block_index.h"
+
+
+/// Elevation map that only stores the regions covered by the point cloud.
+/// The map is divided into square blocks of tiles. Only blocks that contain at least one point are allocated,
+/// and an open-addressing hash index maps block coordinates to the allocated blocks. In this way, the memory
+/// consumption scales with the observed area instead of with the area of the bounding box of the point cloud.
+/// The class provides the same lookup and matching interface as ElevationMap.
+template<typename PointType>
+class SparseElevationMap
+{
+public:
+    /// Interpolation modes used when looking up the map values of a batch of points.
+    enum Interp
+    {
+        /// Value of the tile in which the point lies.
+        NEAREST,
+
+        /// Bilinear interpolation between the centers of the four tiles surrounding the point.
+        BILINEAR
+    };
+
+
+    /// Cache of the block accessed last.
+    /// Consecutive lookups of nearby points usually hit the same block, so keeping one cursor per thread
+    /// saves most hash lookups. A cursor is valid until the map is modified.
+    struct Cursor
+    {
+        /// Key of the cached block.
+        uint64_t key;
+
+        /// Number of the cached block or BlockIndex::npos, if the block is not allocated.
+        uint32_t block;
+
+        /// Constructor.
+        /// Creates a cursor that does not refer to any block.
+        Cursor()
+            : key(0xffffffffffffffffull),
+              block(BlockIndex::npos)
+        {
+        }
+    };
+
+
+protected:
+    /// Number of bits of the tile coordinates within a block.
+    static const int block_bits = 4;
+
+    /// Edge length of the blocks in tiles.
+    static const int block_size = 1 << block_bits;
+
+    /// Number of tiles per block.
+    static const int block_tiles = block_size * block_size;
+
+    /// Map data.
+    /// Tile (lx, ly) of block b is located at index b*block_tiles + lx*block_size + ly.
+    std::vector<double> blocks_;
+
+    /// Global coordinates of the first tile of each block, stored as consecutive x-y pairs.
+    std::vector<int32_t> block_origins_;
+
+    /// Maps block coordinates to block numbers.
+    BlockIndex index_;
+
+    /// Edge length of the map tiles.
+    double resolution_;
+
+    /// Minimum admissible resolution.
+    static const double resolution_min;
+
+
+public:
+    /// Constructor.
+    SparseElevationMap(const pcl::PointCloud<PointType>& point_cloud, double resolution = 0.1)
+        : resolution_(std::max(resolution_min, resolution))
+    {
+        update(point_cloud);
+    }
+
+
+    /// Merges the given point cloud into the map.
+    /// Allocates the blocks hit by points that are not yet covered by the map.
+    /// \param[in] pc point cloud in the map frame.
+    /// \param[in] replace if true, the tiles hit by the point cloud are overwritten by the maximum z-coordinate
+    /// of the new points. Otherwise, they keep the maximum of their old value and the new points.
+    /// \return number of points merged into the map.
+    size_t update(const pcl::PointCloud<PointType>& pc, bool replace = false)
+    {
+        // Determine the tiles hit by the point cloud and allocate the missing blocks.
+        std::vector<size_t> hits;
+        hits.reserve(pc.size());
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            int32_t tx, ty;
+            if (std::isfinite(pc[i].z) && tile(pc[i].x, pc[i].y, tx, ty))
+            {
+                uint32_t b = index_.insert(block_key(tx, ty), blocks_.size() / block_tiles);
+                if (b * block_tiles == blocks_.size())
+                {
+                    blocks_.resize(blocks_.size() + block_tiles, std::numeric_limits<double>::quiet_NaN());
+                    block_origins_.push_back(tx & ~(block_size-1));
+                    block_origins_.push_back(ty & ~(block_size-1));
+                }
+
+                hits.push_back(b*block_tiles + local_index(tx, ty));
+            }
+        }
+
+        // Reset the touched tiles, if requested.
+        if (replace)
+            for (size_t i = 0u; i < hits.size(); ++i)
+                blocks_[hits[i]] = std::numeric_limits<double>::quiet_NaN();
+
+        // Merge the points into the map.
+        size_t n = 0u;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            int32_t tx, ty;
+            if (std::isfinite(pc[i].z) && tile(pc[i].x, pc[i].y, tx, ty))
+            {
+                double& e = blocks_[hits[n++]];
+                if (std::isfinite(e))
+                    e = std::max<double>(e, pc[i].z);
+                else
+                    e = pc[i].z;
+            }
+        }
+
+        return n;
+    }
+
+
+    /// Sets NaN tiles to the median of the valid tiles in the surrounding window.
+    /// Only tiles of allocated blocks are filled.
+    unsigned int fill_nan(unsigned int window_size = 3u)
+    {
+        // Compute half the window size.
+        int d_window = std::floor(window_size / 2u);
+
+        // Loop over all tiles of all blocks and fill the NaN tiles.
+        unsigned int n = 0u;
+        std::vector<double> blocks(blocks_);
+        std::vector<double> e_window;
+        Cursor cursor;
+        for (size_t b = 0u; b < blocks_.size() / block_tiles; ++b)
+        {
+            // Compute the coordinates of the first tile of the block.
+            const int32_t bx = block_origins_[2u*b];
+            const int32_t by = block_origins_[2u*b+1u];
+
+            for (int lx = 0; lx < block_size; ++lx)
+                for (int ly = 0; ly < block_size; ++ly)
+                {
+                    if (!std::isnan(blocks_[b*block_tiles + lx*block_size + ly]))
+                        continue;
+
+                    // Collect the values of all map tiles in the window.
+                    e_window.clear();
+                    for (int wx = -d_window; wx <= +d_window; ++wx)
+                        for (int wy = -d_window; wy <= +d_window; ++wy)
+                        {
+                            double e = tile_value(bx+lx+wx, by+ly+wy, cursor);
+                            if (!std::isnan(e))
+                                e_window.push_back(e);
+                        }
+
+                    // Assign the median to the current map tile.
+                    if (!e_window.empty())
+                    {
+                        std::nth_element(e_window.begin(), e_window.begin() + e_window.size()/2, e_window.end());
+                        blocks[b*block_tiles + lx*block_size + ly] = e_window[e_window.size() / 2];
+                        ++n;
+                    }
+                }
+        }
+
+        // Store the filtered map.
+        blocks_.swap(blocks);
+
+        return n;
+    }
+
+
+    /// Returns the map value correspoding to the given point.
+    double elevation(const PointType& point) const
+    {
+        return elevation(point.x, point.y);
+    }
+
+
+    /// Returns the map value corresponding to the given coordinates.
+    double elevation(double x, double y) const
+    {
+        Cursor cursor;
+        return elevation(x, y, cursor);
+    }
+
+
+    /// Returns the map value corresponding to the given coordinates.
+    /// Uses the given cursor to avoid the hash lookup if the point lies in the same block as the previous one.
+    double elevation(double x, double y, Cursor& cursor) const
+    {
+        int32_t tx, ty;
+        if (tile(x, y, tx, ty))
+            return tile_value(tx, ty, cursor);
+        else
+            return std::numeric_limits<double>::quiet_NaN();
+    }
+
+
+    /// Looks up the map values at the given coordinates for a batch of points.
+    /// Points on unallocated blocks yield NaN. In bilinear mode, NaN tiles are left out of the interpolation
+    /// and the weights of the remaining tiles are renormalized.
+    void elevation(const float* x, const float* y, float* out, size_t n, Interp mode = NEAREST) const
+    {
+        Cursor cursor;
+        const double inv_res = 1.0 / resolution_;
+        for (size_t i = 0u; i < n; ++i)
+        {
+            if (!std::isfinite(x[i]) || !std::isfinite(y[i]))
+            {
+                out[i] = std::numeric_limits<float>::quiet_NaN();
+                continue;
+            }
+
+            if (mode == NEAREST)
+            {
+                out[i] = tile_value(std::floor(x[i]*inv_res), std::floor(y[i]*inv_res), cursor);
+                continue;
+            }
+
+            // Compute the tile coordinates relative to the tile centers and the interpolation weights.
+            const double fx = x[i]*inv_res - 0.5;
+            const double fy = y[i]*inv_res - 0.5;
+            const int32_t tx = std::floor(fx);
+            const int32_t ty = std::floor(fy);
+            const double wx = fx - tx;
+            const double wy = fy - ty;
+
+            // Compute the weighted mean of the valid neighbors.
+            const double e[4] = { tile_value(tx, ty, cursor), tile_value(tx, ty+1, cursor),
+                                  tile_value(tx+1, ty, cursor), tile_value(tx+1, ty+1, cursor) };
+            const double w[4] = { (1.0-wx)*(1.0-wy), (1.0-wx)*wy, wx*(1.0-wy), wx*wy };
+            double e_sum = 0.0, w_sum = 0.0;
+            for (int k = 0; k < 4; ++k)
+                if (!std::isnan(e[k]))
+                {
+                    e_sum += w[k]*e[k];
+                    w_sum += w[k];
+                }
+
+            out[i] = w_sum > 0.0 ? e_sum / w_sum : std::numeric_limits<float>::quiet_NaN();
+        }
+    }
+
+
+    /// Returns the mean z-coordinate of the lowest map tiles above or below which the given points are located.
+    double z_ground(const pcl::PointCloud<pcl::PointXYZI>& pc, double fraction) const
+    {
+        // Collect the positions of all valid tiles onto which points are projected.
+        std::vector<size_t> tiles;
+        tiles.reserve(pc.size());
+        Cursor cursor;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            int32_t tx, ty;
+            if (tile(pc[i].x, pc[i].y, tx, ty) && !std::isnan(tile_value(tx, ty, cursor)))
+                tiles.push_back(cursor.block*block_tiles + local_index(tx, ty));
+        }
+
+        // Remove duplicates and gather the z-coordinates of the tiles.
+        std::sort(tiles.begin(), tiles.end());
+        tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+        std::vector<double> tile_z(tiles.size());
+        for (size_t i = 0u; i < tiles.size(); ++i)
+            tile_z[i] = blocks_[tiles[i]];
+
+        // Compute the mean of the lowest fraction of the coordinates.
+        int n = std::max(1, std::min<int>(tile_z.size(), (int)(fraction*tile_z.size()+0.5)));
+        if (tile_z.empty())
+            return 0.0;
+        std::nth_element(tile_z.begin(), tile_z.begin()+n-1, tile_z.end());
+        return std::accumulate(tile_z.begin(), tile_z.begin()+n, 0.0) / n;
+    }
+
+
+    /// Returns the mean z-coordinate of the lowest map tiles in a square around the given position.
+    double z_ground(double x, double y, double a, double fraction) const
+    {
+        // Compute the start and end tile coordinates in x- and y-direction. Like in ElevationMap::z_ground(),
+        // the window starts at the tile of the lower left corner and ends before the tile of the upper right one.
+        const int32_t txstart = std::floor((x-a/2) / resolution_);
+        const int32_t txend   = std::floor((x+a/2) / resolution_);
+        const int32_t tystart = std::floor((y-a/2) / resolution_);
+        const int32_t tyend   = std::floor((y+a/2) / resolution_);
+
+        // Push the z-coordinates of all tiles inside the square into a vector.
+        std::vector<double> tile_z;
+        Cursor cursor;
+        for (int32_t tx = txstart; tx < txend; ++tx)
+            for (int32_t ty = tystart; ty < tyend; ++ty)
+            {
+                double e = tile_value(tx, ty, cursor);
+                if (std::isfinite(e))
+                    tile_z.push_back(e);
+            }
+
+        // Compute the mean of the lowest tiles.
+        int n = std::min<int>(tile_z.size(), (int)(fraction*tile_z.size()+0.5));
+        if (n < 1)
+            return 0.0;
+        std::nth_element(tile_z.begin(), tile_z.begin()+n-1, tile_z.end());
+        return std::accumulate(tile_z.begin(), tile_z.begin()+n, 0.0) / n;
+    }
+
+
+    /// Computes the mean distance in z direction between the elevation map and a given point cloud.
+    double diff(const pcl::PointCloud<PointType>& pc) const
+    {
+        double d_total = 0.0;
+        unsigned int n = 0u;
+        Cursor cursor;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            double dz = pc[i].z - elevation(pc[i].x, pc[i].y, cursor);
+            if (std::isfinite(dz))
+            {
+                d_total += dz;
+                n++;
+            }
+        }
+
+        return d_total / std::max(1u, n);
+    }
+
+
+    /// Computes the error between the given point cloud and the elevation map.
+    double match(const pcl::PointCloud<PointType>& pc) const
+    {
+        // Compute the total distance in z-direction between the point cloud and the map.
+        double d_total = 0.0;
+        unsigned int n = 0u;
+        Cursor cursor;
+        for (size_t i = 0u; i < pc.size(); ++i)
+        {
+            // Determine distance between the current point and the map.
+            // Points on NaN tiles or outside the map are compared to zero elevation.
+            double e = elevation(pc[i].x, pc[i].y, cursor);
+            double dz = std::isfinite(e) ? pc[i].z - e : pc[i].z;
+
+            // If the distance is finite, add it to the total distance.
+            if (std::isfinite(dz))
+            {
+                d_total += std::max(0.0, dz);
+                n++;
+            }
+        }
+
+        // Compute the mean distance.
+        return d_total / n;
+    }
+
+
+    /// Returns the resolution of the map.
+    double resolution() const
+    {
+        return resolution_;
+    }
+
+
+    /// Returns the number of allocated blocks.
+    size_t n_blocks() const
+    {
+        return blocks_.size() / block_tiles;
+    }
+
+
+    /// Returns the number of bytes allocated for the map data and the block index.
+    size_t memory_usage() const
+    {
+        return blocks_.capacity()*sizeof(double) + block_origins_.capacity()*sizeof(int32_t)
+            + index_.memory_usage();
+    }
+
+
+protected:
+    /// Computes the global coordinates of the tile where the point with the given coordinates resides.
+    /// If the coordinates are not finite, this method returns \c false.
+    bool tile(double x, double y, int32_t& tx, int32_t& ty) const
+    {
+        if (!std::isfinite(x) || !std::isfinite(y))
+            return false;
+
+        tx = std::floor(x / resolution_);
+        ty = std::floor(y / resolution_);
+        return true;
+    }
+
+
+    /// Returns the key of the block that contains the tile with the given coordinates.
+    /// The right shift of negative coordinates rounds towards negative infinity.
+    static uint64_t block_key(int32_t tx, int32_t ty)
+    {
+        return BlockIndex::key(tx >> block_bits, ty >> block_bits);
+    }
+
+
+    /// Returns the index of the tile with the given global coordinates within its block.
+    static size_t local_index(int32_t tx, int32_t ty)
+    {
+        return (tx & (block_size-1)) * block_size + (ty & (block_size-1));
+    }
+
+
+    /// Returns the value of the tile with the given global coordinates.
+    double tile_value(int32_t tx, int32_t ty, Cursor& cursor) const
+    {
+        const uint64_t key = block_key(tx, ty);
+        if (key != cursor.key)
+        {
+            cursor.key = key;
+            cursor.block = index_.find(key);
+        }
+
+        if (cursor.block == BlockIndex::npos)
+            return std::numeric_limits<double>::quiet_NaN();
+        else
+            return blocks_[cursor.block*block_tiles + local_index(tx, ty)];
+    }
+};
+
+
+template<typename PointType> const double SparseElevationMap<PointType>::resolution_min = 0.001;
+
+
+#endif
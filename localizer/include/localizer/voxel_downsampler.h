@@ -0,0 +1,318 @@
+#ifndef VOXEL_DOWNSAMPLER_H_
+#define VOXEL_DOWNSAMPLER_H_ VOXEL_DOWNSAMPLER_H_
+
+// Standard libraries.
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+
+// Boost.
+#include <boost/bind.hpp>
+
+// Localizer.
+#include "localizer/scan_buffer.h"
+#include "localizer/worker_pool.h"
+
+
+/// Downsamples point clouds by replacing the points within each voxel of a regular grid by their centroid.
+/// Works in place on a ScanBuffer. The voxels are distributed over the workers of a WorkerPool by the hash of
+/// their indices, and every worker accumulates its voxels in its own open-addressing hash table. A counting sort
+/// groups the points by the table of their voxel first, so every worker visits only its own points. The tables
+/// are kept from one point cloud to the next and invalidated by an epoch counter, so downsampling a point cloud
+/// does neither allocate nor clear memory once the tables have grown to the size of the point clouds.
+/// The order of the resulting points is arbitrary. If the point cloud has intensities, every centroid gets the
+/// mean intensity of its points.
+class VoxelDownsampler
+{
+protected:
+    /// Voxel indices are stored in 21 bits each and must lie in [-voxel_limit, voxel_limit).
+    static const long voxel_limit = 1l << 20;
+
+    /// Key of points that are NaN or outside the range of the voxel indices.
+    static const uint64_t invalid_key = ~(uint64_t)0u;
+
+    /// Entry of a hash table that accumulates the points within one voxel.
+    struct Entry
+    {
+        /// Packed indices of the voxel.
+        uint64_t key;
+
+        /// Epoch in which the entry was last written. Entries of earlier epochs are empty.
+        uint32_t epoch;
+
+        /// Number of points in the voxel.
+        uint32_t count;
+
+        /// Sum of the coordinates of the points in the voxel.
+        double x, y, z;
+
+        /// Sum of the intensities of the points in the voxel.
+        double intensity;
+    };
+
+
+    /// Hash table of one worker.
+    struct Table
+    {
+        /// Entries of the table. The number of entries is a power of two.
+        std::vector<Entry> entries;
+
+        /// Number of voxels in the current epoch.
+        size_t n_voxels;
+    };
+
+
+    /// Edge length of the voxels.
+    double leaf_size_;
+
+    /// Number of points per task when computing the voxel indices.
+    static const size_t chunk_size = 4096u;
+
+    /// Packed voxel indices of all points of the current point cloud.
+    std::vector<uint64_t> keys_;
+
+    /// Table that accumulates the voxel of each point. Equal to the number of tables for invalid points.
+    std::vector<uint32_t> owners_;
+
+    /// Number of points of every chunk of chunk_size points that belong to each table, stored chunk by chunk.
+    /// After the prefix sum, position in order_ of the first of these points.
+    std::vector<size_t> chunk_counts_;
+
+    /// Indices of the valid points, grouped by table. Within every table, the points keep their order.
+    std::vector<size_t> order_;
+
+    /// Position in order_ of the first point of every table, followed by the number of valid points.
+    std::vector<size_t> table_begin_;
+
+    /// Hash tables of all workers.
+    std::vector<Table> tables_;
+
+    /// Current epoch. Incremented for every point cloud.
+    uint32_t epoch_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] leaf_size edge length of the voxels.
+    VoxelDownsampler(double leaf_size)
+        : leaf_size_(leaf_size),
+          epoch_(0u)
+    {
+    }
+
+
+    /// Sets the edge length of the voxels.
+    void set_leaf_size(double leaf_size)
+    {
+        leaf_size_ = leaf_size;
+    }
+
+
+    /// Returns the edge length of the voxels.
+    double get_leaf_size() const
+    {
+        return leaf_size_;
+    }
+
+
+    /// Replaces the points of the given point cloud by the centroids of the points within each voxel.
+    /// NaN points and points outside the range of the voxel indices are removed.
+    /// \param[in,out] scan point cloud to downsample.
+    /// \param[in] pool workers that downsample the point cloud.
+    void downsample(ScanBuffer& scan, WorkerPool& pool)
+    {
+        // Start a new epoch. On overflow, the tables are cleared.
+        if (++epoch_ == 0u)
+        {
+            for (size_t t = 0u; t < tables_.size(); ++t)
+                for (size_t e = 0u; e < tables_[t].entries.size(); ++e)
+                    tables_[t].entries[e].epoch = 0u;
+            epoch_ = 1u;
+        }
+
+        // Compute the voxel indices of all points and count the points of every table chunk by chunk.
+        tables_.resize(pool.size());
+        const size_t n_tables = tables_.size();
+        const size_t n_chunks = (scan.size() + chunk_size-1u) / chunk_size;
+        keys_.resize(scan.size());
+        owners_.resize(scan.size());
+        chunk_counts_.assign(n_chunks * n_tables, 0u);
+        pool.run(n_chunks, boost::bind(&VoxelDownsampler::compute_keys, this, boost::cref(scan), _1, _2));
+
+        // Turn the counts into positions in order_, table by table and chunk by chunk, so the points of every
+        // table are contiguous and keep their order.
+        table_begin_.resize(n_tables + 1u);
+        size_t position = 0u;
+        for (size_t t = 0u; t < n_tables; ++t)
+        {
+            table_begin_[t] = position;
+            for (size_t c = 0u; c < n_chunks; ++c)
+            {
+                const size_t count = chunk_counts_[c*n_tables + t];
+                chunk_counts_[c*n_tables + t] = position;
+                position += count;
+            }
+        }
+        table_begin_[n_tables] = position;
+
+        // Group the points by table.
+        order_.resize(position);
+        pool.run(n_chunks, boost::bind(&VoxelDownsampler::group_points, this, _1, _2));
+
+        // Accumulate the points in the hash tables of the workers.
+        pool.run(n_tables, boost::bind(&VoxelDownsampler::accumulate, this, boost::cref(scan), _1, _2));
+
+        // Write the centroids back to the point cloud, one contiguous range per table.
+        std::vector<size_t> offsets(tables_.size() + 1u, 0u);
+        for (size_t t = 0u; t < tables_.size(); ++t)
+            offsets[t+1u] = offsets[t] + tables_[t].n_voxels;
+
+        scan.resize(offsets.back());
+        pool.run(tables_.size(), boost::bind(&VoxelDownsampler::write_centroids, this, boost::ref(scan),
+                                             boost::cref(offsets), _1, _2));
+    }
+
+
+protected:
+    /// Computes the voxel indices and the tables of the points of the chunks [begin, end) and counts the points
+    /// of every table per chunk.
+    void compute_keys(const ScanBuffer& scan, size_t begin, size_t end)
+    {
+        const double inv_leaf_size = 1.0 / leaf_size_;
+        const double limit = voxel_limit;
+        const uint64_t mask = (1u << 21) - 1u;
+        const size_t n_tables = tables_.size();
+        for (size_t i = begin*chunk_size; i < std::min(scan.size(), end*chunk_size); ++i)
+        {
+            const double fx = std::floor(scan.x()[i] * inv_leaf_size);
+            const double fy = std::floor(scan.y()[i] * inv_leaf_size);
+            const double fz = std::floor(scan.z()[i] * inv_leaf_size);
+
+            // All comparisons involving NaN are false, so NaN points get the invalid key.
+            const bool valid = fx >= -limit && fx < limit
+                && fy >= -limit && fy < limit
+                && fz >= -limit && fz < limit;
+            keys_[i] = valid ? ((uint64_t)(long)fx & mask) << 42 | ((uint64_t)(long)fy & mask) << 21
+                               | ((uint64_t)(long)fz & mask)
+                             : invalid_key;
+            owners_[i] = valid ? owner(keys_[i]) : n_tables;
+            if (valid)
+                chunk_counts_[(i/chunk_size)*n_tables + owners_[i]]++;
+        }
+    }
+
+
+    /// Writes the indices of the valid points of the chunks [begin, end) to the ranges of their tables in order_.
+    void group_points(size_t begin, size_t end)
+    {
+        const size_t n_tables = tables_.size();
+        for (size_t c = begin; c < end; ++c)
+        {
+            size_t* next = &chunk_counts_[c*n_tables];
+            for (size_t i = c*chunk_size; i < std::min(keys_.size(), (c+1u)*chunk_size); ++i)
+                if (owners_[i] < n_tables)
+                    order_[next[owners_[i]]++] = i;
+        }
+    }
+
+
+    /// Accumulates the points of the voxels owned by the tables [begin, end).
+    void accumulate(const ScanBuffer& scan, size_t begin, size_t end)
+    {
+        for (size_t t = begin; t < end; ++t)
+        {
+            // Make sure the table holds all voxels of the worker at a load factor of at most one half.
+            const size_t n_owned = table_begin_[t+1u] - table_begin_[t];
+
+            Table& table = tables_[t];
+            if (table.entries.size() < 2u*n_owned)
+            {
+                size_t capacity = 64u;
+                while (capacity < 2u*n_owned)
+                    capacity *= 2u;
+
+                Entry empty;
+                empty.key = invalid_key;
+                empty.epoch = 0u;
+                empty.count = 0u;
+                empty.x = empty.y = empty.z = empty.intensity = 0.0;
+                table.entries.assign(capacity, empty);
+            }
+
+            // Insert the points by linear probing.
+            const float* intensity = scan.intensity();
+            const size_t slot_mask = table.entries.size() - 1u;
+            table.n_voxels = 0u;
+            for (size_t k = table_begin_[t]; k < table_begin_[t+1u]; ++k)
+            {
+                const size_t i = order_[k];
+                const uint64_t key = keys_[i];
+                size_t slot = hash(key) & slot_mask;
+                while (table.entries[slot].epoch == epoch_ && table.entries[slot].key != key)
+                    slot = (slot + 1u) & slot_mask;
+
+                Entry& entry = table.entries[slot];
+                if (entry.epoch != epoch_)
+                {
+                    entry.key = key;
+                    entry.epoch = epoch_;
+                    entry.count = 0u;
+                    entry.x = entry.y = entry.z = entry.intensity = 0.0;
+                    table.n_voxels++;
+                }
+
+                entry.count++;
+                entry.x += scan.x()[i];
+                entry.y += scan.y()[i];
+                entry.z += scan.z()[i];
+                if (intensity != NULL)
+                    entry.intensity += intensity[i];
+            }
+        }
+    }
+
+
+    /// Writes the centroids of the voxels of the tables [begin, end) to the point cloud.
+    void write_centroids(ScanBuffer& scan, const std::vector<size_t>& offsets, size_t begin, size_t end)
+    {
+        float* intensity = scan.intensity();
+        for (size_t t = begin; t < end; ++t)
+        {
+            size_t i = offsets[t];
+            const std::vector<Entry>& entries = tables_[t].entries;
+            for (size_t e = 0u; e < entries.size(); ++e)
+                if (entries[e].epoch == epoch_)
+                {
+                    scan.x()[i] = entries[e].x / entries[e].count;
+                    scan.y()[i] = entries[e].y / entries[e].count;
+                    scan.z()[i] = entries[e].z / entries[e].count;
+                    if (intensity != NULL)
+                        intensity[i] = entries[e].intensity / entries[e].count;
+                    ++i;
+                }
+        }
+    }
+
+
+    /// Mixes the bits of the given key.
+    static uint64_t hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        key ^= key >> 33;
+        return key;
+    }
+
+
+    /// Returns the table that accumulates the voxel with the given key.
+    size_t owner(uint64_t key) const
+    {
+        return (hash(key) >> 48) % tables_.size();
+    }
+};
+
+
+#endif
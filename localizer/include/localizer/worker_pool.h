@@ -0,0 +1,462 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_ WORKER_POOL_H_
+
+// Standard libraries.
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+
+// Thread affinity.
+#include <pthread.h>
+#include <sched.h>
+
+// Boost.
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/exception_ptr.hpp>
+
+// ROS time and logging.
+#include <ros/time.h>
+#include <ros/console.h>
+
+
+/// Load statistics of a worker of a WorkerPool.
+struct WorkerStatistics
+{
+    /// Total time spent processing items in seconds.
+    double busy;
+
+    /// Total time spent in run() without processing items in seconds, including wake-up latency and waiting
+    /// for the other workers to finish.
+    double idle;
+
+    /// Number of items processed.
+    unsigned long items;
+
+    /// Number of ranges stolen from other workers.
+    unsigned long steals;
+
+
+    /// Constructor.
+    WorkerStatistics()
+        : busy(0.0),
+          idle(0.0),
+          items(0u),
+          steals(0u)
+    {
+    }
+};
+
+
+/// Persistent pool of worker threads for fork/join parallelism.
+/// The threads are created once and wait for work between calls to run(), so no thread is created or joined
+/// while processing a sensor reading. The thread calling run() takes part in the work as worker 0.
+/// Items are scheduled by work stealing: every worker starts with an equal share of the items and processes it
+/// in small blocks. A worker that runs out of items steals half of the remaining items of another worker, so
+/// workers that are slowed down by expensive items or slower cores do not delay the end of the task.
+class WorkerPool
+{
+public:
+    /// Function executed by the workers.
+    /// Arguments: begin and end of the range of items to process and the number of the worker.
+    typedef boost::function<void(size_t, size_t, unsigned int)> Task;
+
+
+protected:
+    /// Size of a cache line in bytes.
+    static const size_t cache_line_size = 64u;
+
+    /// Maximum number of items of one pass of the workers. The ranges of items are packed into 64-bit words.
+    static const uint64_t max_items = 0xffffffffu;
+
+    /// Per-worker scheduling state, aligned to its own cache line.
+    struct Slot
+    {
+        /// Remaining items of the worker. The begin index is stored in the upper, the end index in the lower
+        /// 32 bits, so the owner and the thieves update the range with a single compare-and-swap.
+        boost::atomic<uint64_t> range;
+
+        /// Time spent processing items in the current task. Written by the owner only.
+        double busy;
+
+        /// Number of items processed in the current task. Written by the owner only.
+        unsigned long items;
+
+        /// Number of ranges stolen in the current task. Written by the owner only.
+        unsigned long steals;
+
+        /// Pads the slot to a full cache line to avoid false sharing.
+        char padding[cache_line_size - sizeof(boost::atomic<uint64_t>) - sizeof(double) - 2*sizeof(unsigned long)];
+    };
+
+
+    /// Worker threads. Worker w runs in threads_[w-1].
+    boost::thread_group threads_;
+
+    /// IDs of the worker threads. Worker w runs in the thread with ID worker_ids_[w-1].
+    std::vector<boost::thread::id> worker_ids_;
+
+    /// ID of the thread that runs the current task as worker 0.
+    boost::thread::id runner_id_;
+
+    /// Number of workers including the calling thread.
+    unsigned int n_workers_;
+
+    /// Serializes calls to run().
+    boost::mutex run_mutex_;
+
+    /// Protects the state shared with the worker threads.
+    boost::mutex mutex_;
+
+    /// Wakes up the worker threads when a task is posted or the pool shuts down.
+    boost::condition_variable start_;
+
+    /// Wakes up the calling thread when the last worker thread has finished the task.
+    boost::condition_variable done_;
+
+    /// Task currently executed.
+    const Task* task_;
+
+    /// Number of the current task. Incremented for every task.
+    unsigned long generation_;
+
+    /// Number of worker threads that have not finished the current task yet.
+    unsigned int pending_;
+
+    /// Tells the worker threads to exit.
+    bool stop_;
+
+    /// First exception thrown by the current task. Rethrown by run().
+    boost::exception_ptr error_;
+
+    /// Tells the workers to stop processing the current task after an exception.
+    boost::atomic<bool> canceled_;
+
+    /// Memory of the slots, with room to align them to a cache line.
+    boost::scoped_array<char> slot_memory_;
+
+    /// Scheduling state of all workers. Points into slot_memory_.
+    Slot* slots_;
+
+    /// Accumulated load statistics of all workers.
+    std::vector<WorkerStatistics> statistics_;
+
+    /// Number of items a worker claims at once.
+    size_t block_size_;
+
+
+public:
+    /// Constructor.
+    /// \param[in] n_workers number of workers including the calling thread. Zero selects the number of cores.
+    /// \param[in] pin if true, worker w is pinned to core w modulo the number of cores.
+    WorkerPool(unsigned int n_workers = 0u, bool pin = false)
+        : n_workers_(n_workers > 0u ? n_workers : std::max(1u, boost::thread::hardware_concurrency())),
+          task_(NULL),
+          generation_(0u),
+          pending_(0u),
+          stop_(false),
+          canceled_(false),
+          block_size_(1u)
+    {
+        // Align the slots to a cache line. new[] only guarantees the alignment of fundamental types.
+        slot_memory_.reset(new char[(n_workers_ + 1u) * sizeof(Slot)]);
+        const size_t misalignment = (uintptr_t)slot_memory_.get() % cache_line_size;
+        slots_ = (Slot*)(slot_memory_.get() + (misalignment > 0u ? cache_line_size - misalignment : 0u));
+        for (unsigned int w = 0u; w < n_workers_; ++w)
+            new (&slots_[w]) Slot();
+
+        statistics_.resize(n_workers_);
+        for (unsigned int w = 1u; w < n_workers_; ++w)
+            worker_ids_.push_back(threads_.create_thread(boost::bind(&WorkerPool::work, this, w, pin))->get_id());
+    }
+
+
+    /// Destructor.
+    /// Stops and joins the worker threads.
+    ~WorkerPool()
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        threads_.join_all();
+
+        for (unsigned int w = 0u; w < n_workers_; ++w)
+            slots_[w].~Slot();
+    }
+
+
+    /// Returns the number of workers including the calling thread.
+    unsigned int size() const
+    {
+        return n_workers_;
+    }
+
+
+    /// Processes the items [0, n) with the given task on all workers and returns when all items are done.
+    /// If the task throws an exception, the remaining items are canceled, and run() rethrows the first exception
+    /// once all workers have stopped.
+    /// A task may call run() of the same pool again. As all workers are busy with the outer task, the nested
+    /// call processes all of its items in the calling thread, which passes its own worker number to the task.
+    /// \param[in] n number of items. More than 2^32-1 items are processed in several passes.
+    /// \param[in] task function that processes a range of items.
+    /// \param[in] block_size number of items a worker claims at once. Larger blocks reduce the scheduling
+    /// overhead for cheap items, smaller blocks improve the load balance for expensive ones.
+    void run(size_t n, const Task& task, size_t block_size = 1u)
+    {
+        if (n == 0u)
+            return;
+
+        // Waiting for run_mutex_ would deadlock within a task, so process the items right away.
+        const unsigned int worker = calling_worker();
+        if (worker < n_workers_)
+        {
+            task(0u, n, worker);
+            return;
+        }
+
+        // The ranges of items are packed into 32 bits each.
+        if ((uint64_t)n > max_items)
+        {
+            for (size_t first = 0u; first < n; first += (size_t)max_items)
+                run(std::min<size_t>(n - first, (size_t)max_items),
+                    boost::bind(&WorkerPool::run_offset, boost::cref(task), first, _1, _2, _3), block_size);
+            return;
+        }
+
+        boost::mutex::scoped_lock run_lock(run_mutex_);
+        const ros::WallTime start = ros::WallTime::now();
+
+        // Hand every worker an equal share of the items.
+        const size_t items_per_worker = (n + n_workers_-1u) / n_workers_;
+        for (unsigned int w = 0u; w < n_workers_; ++w)
+        {
+            const size_t begin = std::min(n, w * items_per_worker);
+            const size_t end = std::min(n, begin + items_per_worker);
+            slots_[w].range.store(pack(begin, end), boost::memory_order_relaxed);
+            slots_[w].busy = 0.0;
+            slots_[w].items = 0u;
+            slots_[w].steals = 0u;
+        }
+
+        // Post the task.
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            task_ = &task;
+            runner_id_ = boost::this_thread::get_id();
+            canceled_.store(false, boost::memory_order_relaxed);
+            block_size_ = std::max<size_t>(1u, block_size);
+            pending_ = n_workers_ - 1u;
+            ++generation_;
+        }
+        start_.notify_all();
+
+        // Take part as worker 0 and wait for the others.
+        execute(0u);
+        boost::mutex::scoped_lock lock(mutex_);
+        while (pending_ > 0u)
+            done_.wait(lock);
+        task_ = NULL;
+        const boost::exception_ptr error = error_;
+        error_ = boost::exception_ptr();
+
+        // Accumulate the load statistics.
+        const double duration = (ros::WallTime::now() - start).toSec();
+        for (unsigned int w = 0u; w < n_workers_; ++w)
+        {
+            statistics_[w].busy += slots_[w].busy;
+            statistics_[w].idle += std::max(0.0, duration - slots_[w].busy);
+            statistics_[w].items += slots_[w].items;
+            statistics_[w].steals += slots_[w].steals;
+        }
+
+        if (error)
+            boost::rethrow_exception(error);
+    }
+
+
+    /// Returns the accumulated load statistics of all workers.
+    std::vector<WorkerStatistics> get_statistics()
+    {
+        boost::mutex::scoped_lock run_lock(run_mutex_);
+        return statistics_;
+    }
+
+
+    /// Resets the load statistics of all workers.
+    void reset_statistics()
+    {
+        boost::mutex::scoped_lock run_lock(run_mutex_);
+        statistics_.assign(n_workers_, WorkerStatistics());
+    }
+
+
+protected:
+    /// Main loop of a worker thread.
+    void work(unsigned int worker, bool pin)
+    {
+        if (pin)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(worker % std::max(1u, boost::thread::hardware_concurrency()), &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+                ROS_WARN_STREAM("Failed to pin worker " << worker << " to a core.");
+        }
+
+        unsigned long generation = 0u;
+        while (true)
+        {
+            // Wait for the next task.
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                while (generation_ == generation && !stop_)
+                    start_.wait(lock);
+                if (stop_)
+                    return;
+                generation = generation_;
+            }
+
+            execute(worker);
+
+            // Report completion.
+            boost::mutex::scoped_lock lock(mutex_);
+            if (--pending_ == 0u)
+                done_.notify_one();
+        }
+    }
+
+
+    /// Processes items of the current task until no worker has any items left.
+    /// Exceptions thrown by the task are caught, so every worker always reports completion.
+    void execute(unsigned int worker)
+    {
+        Slot& slot = slots_[worker];
+        size_t begin, end;
+        while (true)
+        {
+            // Process the own items block by block.
+            while (!canceled_.load(boost::memory_order_relaxed) && take(worker, begin, end))
+            {
+                const ros::WallTime start = ros::WallTime::now();
+                try
+                {
+                    (*task_)(begin, end, worker);
+                }
+                catch (...)
+                {
+                    cancel();
+                    return;
+                }
+                slot.busy += (ros::WallTime::now() - start).toSec();
+                slot.items += end - begin;
+            }
+
+            // Steal items from the other workers. Stop if there are none left.
+            bool stolen = false;
+            for (unsigned int k = 1u; k < n_workers_ && !stolen && !canceled_.load(boost::memory_order_relaxed); ++k)
+                stolen = steal((worker + k) % n_workers_, worker);
+            if (!stolen)
+                return;
+            ++slot.steals;
+        }
+    }
+
+
+    /// Returns the number of the worker that runs in the calling thread if the thread executes a task of this
+    /// pool, or the number of workers otherwise.
+    unsigned int calling_worker()
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        const boost::thread::id id = boost::this_thread::get_id();
+        if (task_ == NULL)
+            return n_workers_;
+        if (id == runner_id_)
+            return 0u;
+
+        return std::find(worker_ids_.begin(), worker_ids_.end(), id) - worker_ids_.begin() + 1u;
+    }
+
+
+    /// Processes the items [begin, end) of a pass that starts at the given item.
+    static void run_offset(const Task& task, size_t first, size_t begin, size_t end, unsigned int worker)
+    {
+        task(first + begin, first + end, worker);
+    }
+
+
+    /// Records the exception currently handled, if it is the first one of the task, and cancels the remaining
+    /// items of all workers. Must be called from a catch block.
+    void cancel()
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (!error_)
+                error_ = boost::current_exception();
+        }
+
+        canceled_.store(true, boost::memory_order_relaxed);
+    }
+
+
+    /// Claims the next block of the own items.
+    /// \return \c false if the worker has no items left.
+    bool take(unsigned int worker, size_t& begin, size_t& end)
+    {
+        boost::atomic<uint64_t>& range = slots_[worker].range;
+        uint64_t current = range.load(boost::memory_order_acquire);
+        while (true)
+        {
+            begin = current >> 32;
+            end = current & 0xffffffffu;
+            if (begin >= end)
+                return false;
+
+            const size_t next = std::min(end, begin + block_size_);
+            if (range.compare_exchange_weak(current, pack(next, end), boost::memory_order_acq_rel))
+            {
+                end = next;
+                return true;
+            }
+        }
+    }
+
+
+    /// Moves the upper half of the remaining items of the victim to the thief.
+    /// If the victim has only one block left, the thief takes all of it.
+    /// \return \c false if the victim has no items left.
+    bool steal(unsigned int victim, unsigned int thief)
+    {
+        boost::atomic<uint64_t>& range = slots_[victim].range;
+        uint64_t current = range.load(boost::memory_order_acquire);
+        while (true)
+        {
+            const size_t begin = current >> 32;
+            const size_t end = current & 0xffffffffu;
+            if (begin >= end)
+                return false;
+
+            const size_t middle = end - begin <= block_size_ ? begin : begin + (end - begin) / 2u;
+            if (range.compare_exchange_weak(current, pack(begin, middle), boost::memory_order_acq_rel))
+            {
+                slots_[thief].range.store(pack(middle, end), boost::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+
+    /// Packs a range of items into a single word.
+    static uint64_t pack(size_t begin, size_t end)
+    {
+        return ((uint64_t)begin << 32) | (uint64_t)end;
+    }
+};
+
+
+#endif
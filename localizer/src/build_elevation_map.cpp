@@ -0,0 +1,459 @@
+// Standard libraries.
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+#include "localizer/elevation_map.h"
+
+
+/// Reads the points of a PCD or PLY file in chunks, so files larger than the available memory can be
+/// rasterized. Supports ASCII and uncompressed binary files whose x, y, and z fields have any of the
+/// numeric types of the two formats. The intensity field is optional; points of files without it get NaN
+/// intensity.
+class PointCloudStream
+{
+protected:
+    /// Field of a point.
+    struct Field
+    {
+        /// Name of the field.
+        std::string name;
+
+        /// Size of one element in bytes.
+        size_t size;
+
+        /// Element type: 'F' for floating point, 'I' for signed and 'U' for unsigned integers.
+        char type;
+
+        /// Number of elements.
+        size_t count;
+    };
+
+    /// Input file.
+    std::ifstream file_;
+
+    /// Position of the first point in the file.
+    std::streampos data_start_;
+
+    /// Tells whether the points are stored in binary form.
+    bool binary_;
+
+    /// Number of points in the file.
+    size_t n_points_;
+
+    /// Number of points read since the stream was opened or rewound.
+    size_t n_read_;
+
+    /// Fields of a point.
+    std::vector<Field> fields_;
+
+    /// Size of a binary point in bytes.
+    size_t point_size_;
+
+    /// Byte offsets of the x, y, z, and intensity fields in a binary point.
+    size_t offset_[4];
+
+    /// Column indices of the x, y, z, and intensity fields in an ASCII point.
+    size_t column_[4];
+
+    /// Indices of the x, y, z, and intensity fields. The index of a missing intensity field is the number of
+    /// fields.
+    size_t field_[4];
+
+
+public:
+    /// Opens the given file and parses its header.
+    /// \return \c false if the file cannot be read or has an unsupported format.
+    bool open(const std::string& filename)
+    {
+        file_.open(filename.c_str(), std::ios::in | std::ios::binary);
+        if (!file_)
+        {
+            std::cerr << "Failed to open \"" << filename << "\"." << std::endl;
+            return false;
+        }
+
+        std::string magic;
+        std::getline(file_, magic);
+        const bool valid = magic.compare(0u, 3u, "ply") == 0 ? parse_ply_header() : parse_pcd_header(magic);
+        if (!valid)
+        {
+            std::cerr << "\"" << filename << "\" has an unsupported format." << std::endl;
+            return false;
+        }
+
+        // Locate the coordinate and intensity fields.
+        const char* names[4] = {"x", "y", "z", "intensity"};
+        point_size_ = 0u;
+        size_t column = 0u;
+        for (size_t c = 0u; c < 4u; ++c)
+            field_[c] = fields_.size();
+        for (size_t f = 0u; f < fields_.size(); ++f)
+        {
+            for (size_t c = 0u; c < 4u; ++c)
+                if (fields_[f].name == names[c])
+                {
+                    field_[c] = f;
+                    offset_[c] = point_size_;
+                    column_[c] = column;
+                }
+            point_size_ += fields_[f].size * fields_[f].count;
+            column += fields_[f].count;
+        }
+        for (size_t c = 0u; c < 3u; ++c)
+            if (field_[c] == fields_.size())
+            {
+                std::cerr << "\"" << filename << "\" lacks the " << names[c] << " coordinate." << std::endl;
+                return false;
+            }
+
+        data_start_ = file_.tellg();
+        n_read_ = 0u;
+        return true;
+    }
+
+
+    /// Tells whether the points have an intensity field.
+    bool has_intensity() const
+    {
+        return field_[3] < fields_.size();
+    }
+
+
+    /// Returns the number of points in the file.
+    size_t size() const
+    {
+        return n_points_;
+    }
+
+
+    /// Restarts reading at the first point.
+    void rewind()
+    {
+        file_.clear();
+        file_.seekg(data_start_);
+        n_read_ = 0u;
+    }
+
+
+    /// Reads the next points.
+    /// \param[in] n maximum number of points to read.
+    /// \param[out] chunk points read. Empty at the end of the file.
+    /// \return \c false if the file is truncated or malformed.
+    bool read(size_t n, pcl::PointCloud<pcl::PointXYZI>& chunk)
+    {
+        n = std::min(n, n_points_ - n_read_);
+        chunk.resize(n);
+
+        std::vector<char> buffer(binary_ ? n*point_size_ : 0u);
+        if (binary_ && n > 0u)
+            file_.read(&buffer[0], buffer.size());
+
+        std::string line;
+        std::vector<double> values;
+        const bool intensity = has_intensity();
+        for (size_t i = 0u; i < n && file_; ++i)
+        {
+            double xyzi[4] = {0.0, 0.0, 0.0, std::numeric_limits<double>::quiet_NaN()};
+            if (binary_)
+                for (size_t c = 0u; c < (intensity ? 4u : 3u); ++c)
+                    xyzi[c] = decode(&buffer[i*point_size_ + offset_[c]], fields_[field_[c]]);
+            else
+            {
+                // Parse the values with strtod(), which also accepts "nan".
+                std::getline(file_, line);
+                values.clear();
+                const char* begin = line.c_str();
+                char* end;
+                for (double value = std::strtod(begin, &end); end != begin; value = std::strtod(begin, &end))
+                {
+                    values.push_back(value);
+                    begin = end;
+                }
+                if (values.size() <= std::max(std::max(column_[0], column_[1]),
+                                              std::max(column_[2], intensity ? column_[3] : 0u)))
+                    return false;
+                for (size_t c = 0u; c < (intensity ? 4u : 3u); ++c)
+                    xyzi[c] = values[column_[c]];
+            }
+
+            chunk[i].x = xyzi[0];
+            chunk[i].y = xyzi[1];
+            chunk[i].z = xyzi[2];
+            chunk[i].intensity = xyzi[3];
+        }
+
+        n_read_ += n;
+        return !file_.fail();
+    }
+
+
+protected:
+    /// Parses the header of a PCD file.
+    bool parse_pcd_header(std::string line)
+    {
+        std::vector<std::string> names, types;
+        std::vector<size_t> sizes, counts;
+        n_points_ = 0u;
+        do
+        {
+            std::istringstream stream(line);
+            std::string key, word;
+            stream >> key;
+            if (key == "FIELDS")
+                while (stream >> word)
+                    names.push_back(word);
+            else if (key == "SIZE")
+                while (stream >> word)
+                    sizes.push_back(std::atoi(word.c_str()));
+            else if (key == "TYPE")
+                while (stream >> word)
+                    types.push_back(word);
+            else if (key == "COUNT")
+                while (stream >> word)
+                    counts.push_back(std::atoi(word.c_str()));
+            else if (key == "POINTS")
+                stream >> n_points_;
+            else if (key == "DATA")
+            {
+                stream >> word;
+                if (word != "ascii" && word != "binary")
+                    return false;
+                binary_ = word == "binary";
+                break;
+            }
+        }
+        while (std::getline(file_, line));
+
+        if (!file_ || names.size() != sizes.size() || names.size() != types.size())
+            return false;
+
+        counts.resize(names.size(), 1u);
+        for (size_t f = 0u; f < names.size(); ++f)
+        {
+            Field field = {names[f], sizes[f], types[f][0], counts[f]};
+            fields_.push_back(field);
+        }
+
+        return true;
+    }
+
+
+    /// Parses the header of a PLY file.
+    /// The vertices must be the first element of the file.
+    bool parse_ply_header()
+    {
+        std::string line;
+        bool vertices = false;
+        bool first = true;
+        n_points_ = 0u;
+        while (std::getline(file_, line))
+        {
+            std::istringstream stream(line);
+            std::string key, word;
+            stream >> key;
+            if (key == "format")
+            {
+                stream >> word;
+                if (word != "ascii" && word != "binary_little_endian")
+                    return false;
+                binary_ = word != "ascii";
+            }
+            else if (key == "element")
+            {
+                stream >> word;
+                vertices = word == "vertex";
+                if (vertices && !first)
+                    return false;
+                if (vertices)
+                    stream >> n_points_;
+                first = false;
+            }
+            else if (key == "property" && vertices)
+            {
+                std::string type, name;
+                stream >> type >> name;
+                Field field = {name, 0u, 'F', 1u};
+                if (type == "list")
+                    return false;
+                else if (type == "char" || type == "int8")
+                    field.size = 1u, field.type = 'I';
+                else if (type == "uchar" || type == "uint8")
+                    field.size = 1u, field.type = 'U';
+                else if (type == "short" || type == "int16")
+                    field.size = 2u, field.type = 'I';
+                else if (type == "ushort" || type == "uint16")
+                    field.size = 2u, field.type = 'U';
+                else if (type == "int" || type == "int32")
+                    field.size = 4u, field.type = 'I';
+                else if (type == "uint" || type == "uint32")
+                    field.size = 4u, field.type = 'U';
+                else if (type == "float" || type == "float32")
+                    field.size = 4u, field.type = 'F';
+                else if (type == "double" || type == "float64")
+                    field.size = 8u, field.type = 'F';
+                else
+                    return false;
+                fields_.push_back(field);
+            }
+            else if (key == "end_header")
+                return true;
+        }
+
+        return false;
+    }
+
+
+    /// Converts a binary field element to a double.
+    static double decode(const char* data, const Field& field)
+    {
+        switch (field.size*256 + field.type)
+        {
+            case 1*256 + 'I': { int8_t   v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 1*256 + 'U': { uint8_t  v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 2*256 + 'I': { int16_t  v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 2*256 + 'U': { uint16_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 4*256 + 'I': { int32_t  v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 4*256 + 'U': { uint32_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 8*256 + 'I': { int64_t  v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 8*256 + 'U': { uint64_t v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 4*256 + 'F': { float    v; std::memcpy(&v, data, sizeof(v)); return v; }
+            case 8*256 + 'F': { double   v; std::memcpy(&v, data, sizeof(v)); return v; }
+            default:          return std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+};
+
+
+/// Prints the command line syntax.
+void print_usage()
+{
+    std::cerr << "Usage: build_elevation_map [options] <input.pcd|input.ply> <output.map>\n"
+              << "Options:\n"
+              << "  -r <resolution>  edge length of the map tiles in meters (default: 0.1)\n"
+              << "  -s               store the statistics layers\n"
+              << "  -i               store the reflectivity layer, the mean intensity of each tile; implies -s\n"
+              << "  -f <window>      window size for filling NaN tiles; 0 disables filling (default: 3)\n"
+              << "  -p <tiles>       number of tiles to pad the map with on each side (default: 0)\n"
+              << "  -n <points>      number of points read at once (default: 1000000)\n"
+              << "  -c               compress the output file; compressed files cannot be memory-mapped"
+              << std::endl;
+}
+
+
+/// Builds an elevation map from a point cloud file offline and saves it in the binary map format.
+/// The point cloud is read twice in chunks: the first pass determines its extent, the second pass
+/// rasterizes the points. Afterwards, holes are filled and the nearest-valid layers are computed, so the
+/// localizer can use the map without any preprocessing.
+int main(int argc, char** argv)
+{
+    // Parse the command line.
+    double resolution = 0.1;
+    bool statistics = false;
+    bool reflectivity = false;
+    unsigned int window = 3u;
+    size_t padding = 0u;
+    size_t chunk_size = 1000000u;
+    bool compress = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg(argv[i]);
+        const bool has_value = i+1 < argc;
+        if (arg == "-r" && has_value)
+            resolution = std::atof(argv[++i]);
+        else if (arg == "-s")
+            statistics = true;
+        else if (arg == "-i")
+            reflectivity = true;
+        else if (arg == "-f" && has_value)
+            window = std::atoi(argv[++i]);
+        else if (arg == "-p" && has_value)
+            padding = std::atoi(argv[++i]);
+        else if (arg == "-n" && has_value)
+            chunk_size = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "-c")
+            compress = true;
+        else if (!arg.empty() && arg[0] != '-')
+            files.push_back(arg);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if (files.size() != 2u)
+    {
+        print_usage();
+        return 1;
+    }
+
+    PointCloudStream stream;
+    if (!stream.open(files[0]))
+        return 1;
+    if (reflectivity && !stream.has_intensity())
+    {
+        std::cerr << "\"" << files[0] << "\" has no intensity field to build the reflectivity layer from."
+                  << std::endl;
+        return 1;
+    }
+
+    // Determine the extent of the point cloud.
+    double x_min = std::numeric_limits<double>::max();
+    double y_min = std::numeric_limits<double>::max();
+    double x_max = -std::numeric_limits<double>::max();
+    double y_max = -std::numeric_limits<double>::max();
+    pcl::PointCloud<pcl::PointXYZI> chunk;
+    while (stream.read(chunk_size, chunk) && !chunk.empty())
+        for (size_t i = 0u; i < chunk.size(); ++i)
+            if (std::isfinite(chunk[i].x) && std::isfinite(chunk[i].y))
+            {
+                x_min = std::min<double>(x_min, chunk[i].x);
+                y_min = std::min<double>(y_min, chunk[i].y);
+                x_max = std::max<double>(x_max, chunk[i].x);
+                y_max = std::max<double>(y_max, chunk[i].y);
+            }
+    if (x_min > x_max)
+    {
+        std::cerr << "\"" << files[0] << "\" contains no valid points." << std::endl;
+        return 1;
+    }
+
+    // Rasterize the point cloud.
+    ElevationMap<pcl::PointXYZI> map(x_min, y_min, x_max, y_max, resolution, statistics, reflectivity);
+    WorkerPool pool;
+    stream.rewind();
+    size_t n = 0u;
+    while (stream.read(chunk_size, chunk) && !chunk.empty())
+    {
+        n += map.update(chunk, false, &pool);
+        std::cout << "\rRasterized " << n << " of " << stream.size() << " points." << std::flush;
+    }
+    std::cout << std::endl;
+    if (!chunk.empty())
+    {
+        std::cerr << "\"" << files[0] << "\" is truncated or malformed." << std::endl;
+        return 1;
+    }
+
+    // Compute the derived layers.
+    if (window > 0u)
+        std::cout << "Filled " << map.fill_nan(window) << " NaN tiles." << std::endl;
+    map.pad(padding);
+    map.compute_nearest();
+    map.clear_dirty_blocks();
+
+    return map.save(files[1], compress) ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+// Standard libraries.
+#include <vector>
+
+// Boost.
+#include <boost/make_shared.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+// Google Test.
+#include <gtest/gtest.h>
+
+#include "localizer/sensor_model_cached.h"
+
+
+/// Sensor model that sets the error of every particle to its x-coordinate and its z-coordinate to a fixed height.
+class HeightSensorModel : public SensorModel<pcl::PointCloud<pcl::PointXYZ> >
+{
+public:
+    /// Number of particles scored so far.
+    size_t n_scored;
+
+    /// Height all scored particles are moved to.
+    double z;
+
+
+    /// Constructor.
+    HeightSensorModel(double z)
+        : n_scored(0u),
+          z(z)
+    {
+    }
+
+
+    virtual void compute_particle_errors(const Measurement& measurement, std::vector<Particle>& particles)
+    {
+        for (size_t i = 0u; i < particles.size(); ++i)
+        {
+            const tf::Vector3& p = particles[i].pose.getOrigin();
+            particles[i].error = p.x();
+            particles[i].pose.setOrigin(tf::Vector3(p.x(), p.y(), z));
+        }
+
+        n_scored += particles.size();
+    }
+};
+
+
+/// Creates copies of particles at the given number of poses along the x-axis.
+std::vector<Particle> create_particles(size_t n_poses, size_t n_copies)
+{
+    const tf::Quaternion identity(0.0, 0.0, 0.0, 1.0);
+    std::vector<Particle> particles;
+    for (size_t i = 0u; i < n_poses; ++i)
+        for (size_t c = 0u; c < n_copies; ++c)
+            particles.push_back(Particle(tf::Transform(identity, tf::Vector3(0.5*i, 0.0, 0.0))));
+
+    return particles;
+}
+
+
+/// Creates a measurement with the given sequence number.
+pcl::PointCloud<pcl::PointXYZ> create_measurement(uint32_t seq)
+{
+    pcl::PointCloud<pcl::PointXYZ> measurement;
+    measurement.header.stamp = 1000u + seq;
+    measurement.header.seq = seq;
+    return measurement;
+}
+
+
+/// A particle set that fits into the initial table scores one particle per bin.
+TEST(SensorModelCached, ScoresSmallParticleSet)
+{
+    const boost::shared_ptr<HeightSensorModel> model = boost::make_shared<HeightSensorModel>(0.0);
+    SensorModelCached<HeightSensorModel> cached(model);
+
+    std::vector<Particle> particles = create_particles(10u, 10u);
+    cached.compute_particle_errors(create_measurement(1u), particles);
+
+    EXPECT_EQ(10u, model->n_scored);
+    for (size_t i = 0u; i < particles.size(); ++i)
+        EXPECT_DOUBLE_EQ(particles[i].pose.getOrigin().x(), particles[i].error) << "particle " << i;
+
+    // Scoring the same particles against the same measurement again reuses all bins.
+    cached.compute_particle_errors(create_measurement(1u), particles);
+    EXPECT_EQ(10u, model->n_scored);
+
+    // A new measurement scores them again.
+    cached.compute_particle_errors(create_measurement(2u), particles);
+    EXPECT_EQ(20u, model->n_scored);
+}
+
+
+/// The z-coordinate adjusted by the sensor model is copied to all particles of the bin.
+TEST(SensorModelCached, CopiesAdjustedZ)
+{
+    const boost::shared_ptr<HeightSensorModel> model = boost::make_shared<HeightSensorModel>(1.5);
+    SensorModelCached<HeightSensorModel> cached(model);
+
+    std::vector<Particle> particles = create_particles(5u, 20u);
+    cached.compute_particle_errors(create_measurement(1u), particles);
+
+    EXPECT_EQ(5u, model->n_scored);
+    for (size_t i = 0u; i < particles.size(); ++i)
+    {
+        const tf::Vector3& p = particles[i].pose.getOrigin();
+        EXPECT_DOUBLE_EQ(0.5*(i / 20u), p.x()) << "particle " << i;
+        EXPECT_DOUBLE_EQ(0.0, p.y()) << "particle " << i;
+        EXPECT_DOUBLE_EQ(1.5, p.z()) << "particle " << i;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
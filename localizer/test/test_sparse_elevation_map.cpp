@@ -0,0 +1,89 @@
+// Standard libraries.
+#include <cmath>
+
+// Boost.
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+// Point Cloud Library.
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+// Google Test.
+#include <gtest/gtest.h>
+
+#include "localizer/elevation_map.h"
+#include "localizer/sparse_elevation_map.h"
+
+
+/// Creates a random point cloud of a surface in the rectangle [x_min, x_max] x [y_min, y_max].
+pcl::PointCloud<pcl::PointXYZI> create_point_cloud(double x_min, double y_min, double x_max, double y_max,
+                                                   size_t n)
+{
+    boost::random::mt19937 engine(42u);
+    boost::random::uniform_real_distribution<double> ux(x_min, x_max), uy(y_min, y_max), noise(-0.05, 0.05);
+
+    pcl::PointCloud<pcl::PointXYZI> pc;
+    for (size_t i = 0u; i < n; ++i)
+    {
+        pcl::PointXYZI point;
+        point.x = ux(engine);
+        point.y = uy(engine);
+        point.z = std::sin(point.x) + 0.1*point.y + noise(engine);
+        point.intensity = 0.0f;
+        pc.push_back(point);
+    }
+
+    return pc;
+}
+
+
+/// The sparse and the dense map must average the same tiles for the same window.
+TEST(SparseElevationMap, ZGroundMatchesDenseMap)
+{
+    const pcl::PointCloud<pcl::PointXYZI> pc = create_point_cloud(-3.02, 1.03, 6.97, 8.01, 20000u);
+    const ElevationMap<pcl::PointXYZI> dense(pc, 0.1);
+    const SparseElevationMap<pcl::PointXYZI> sparse(pc, 0.1);
+
+    boost::random::mt19937 engine(7u);
+    boost::random::uniform_real_distribution<double> ux(-2.0, 6.0), uy(2.0, 7.0), ua(0.13, 1.97);
+    for (int i = 0; i < 200; ++i)
+    {
+        const double x = ux(engine);
+        const double y = uy(engine);
+        const double a = ua(engine);
+        EXPECT_NEAR(dense.z_ground(x, y, a, 0.3), sparse.z_ground(x, y, a, 0.3), 1e-9)
+            << "window of size " << a << " at (" << x << ", " << y << ")";
+    }
+}
+
+
+/// The window includes the tile that contains its lower left corner.
+TEST(SparseElevationMap, ZGroundIncludesLowerLeftTile)
+{
+    pcl::PointCloud<pcl::PointXYZI> pc;
+    for (int ix = 0; ix < 10; ++ix)
+        for (int iy = 0; iy < 10; ++iy)
+        {
+            pcl::PointXYZI point;
+            point.x = 0.1*ix + 0.05;
+            point.y = 0.1*iy + 0.05;
+            point.z = ix == 2 && iy == 3 ? 0.0f : 1.0f;
+            point.intensity = 0.0f;
+            pc.push_back(point);
+        }
+    const ElevationMap<pcl::PointXYZI> dense(pc, 0.1);
+    const SparseElevationMap<pcl::PointXYZI> sparse(pc, 0.1);
+
+    // The lower left corner (0.23, 0.34) lies in tile (2, 3), the only tile at height zero. The window covers
+    // 5x5 tiles, so the lowest fraction of 0.05 is this tile alone.
+    EXPECT_NEAR(0.0, dense.z_ground(0.48, 0.59, 0.5, 0.05), 1e-9);
+    EXPECT_NEAR(0.0, sparse.z_ground(0.48, 0.59, 0.5, 0.05), 1e-9);
+}
+
+
+int main(int argc, char** argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}